@@ -0,0 +1,282 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       benchmark.hpp
+ *
+ * Purpose:    Repeat a measurement, summarize it and write machine-readable
+ *             results
+ *
+ *             Every case runs `warmup` untimed iterations (first launches pay
+ *             for JIT, page faults and lazy allocation in the driver) and then
+ *             `iterations` measured ones. The samples are summarized by
+ *             min/median/p95/mean/stddev, the rate (GFLOPS, GB/s, ...) is
+ *             computed from the median.
+ *
+ *             An iteration returns its wall-clock time and, optionally, the
+ *             device time taken from profiling events. Both are summarized.
+ *
+ *             A case may give its arithmetic intensity, the floating point
+ *             operations per byte it must move. If the roofline of its device
+ *             was set, see roofline.hpp, the rate is also reported as a share
+ *             of what the roofline allows at that intensity:
+ *             min(peak GFLOPS, intensity * peak GB/s).
+ *
+ *             Command line options, see BenchmarkOptions::parse():
+ *
+ *               --warmup N       untimed iterations per case    (default 1)
+ *               --iterations N   measured iterations per case   (default 5)
+ *               --json PATH      write all cases as a JSON array
+ *               --csv PATH       write all cases as CSV
+ *
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace util {
+
+struct BenchmarkStats {
+    size_t runs = 0;
+    double min = 0.0;
+    double median = 0.0;
+    double p95 = 0.0;
+    double mean = 0.0;
+    double stddev = 0.0;
+};
+
+// Summary of a set of timings in seconds.
+inline BenchmarkStats summarize(std::vector<double> samples) {
+    BenchmarkStats stats;
+    stats.runs = samples.size();
+    if (samples.empty()) return stats;
+
+    std::sort(samples.begin(), samples.end());
+    const size_t n = samples.size();
+    stats.min = samples.front();
+    stats.median = n % 2 == 1 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2.0;
+    // Nearest rank, so the p95 of a handful of runs is an observed sample.
+    stats.p95 = samples[static_cast<size_t>(std::ceil(0.95 * static_cast<double>(n))) - 1];
+
+    double sum = 0.0;
+    for (double s: samples) sum += s;
+    stats.mean = sum / static_cast<double>(n);
+
+    double squares = 0.0;
+    for (double s: samples) squares += (s - stats.mean) * (s - stats.mean);
+    stats.stddev = n > 1 ? std::sqrt(squares / static_cast<double>(n - 1)) : 0.0;
+    return stats;
+}
+
+struct BenchmarkSample {
+    double seconds;                          // wall-clock time of the iteration
+    std::optional<double> deviceSeconds;     // time from profiling events, if available
+};
+
+struct BenchmarkCase {
+    std::string device;
+    std::string variant;
+    std::string size;    // problem size, e.g. "1920" or "1000x3072x777"
+    std::string unit;    // "GFLOPS" or "GB/s"
+    double work;         // floating point operations or bytes moved by one iteration
+    std::optional<double> intensity = std::nullopt;    // floating point operations per byte moved
+};
+
+// Peak rates of a device, measured by measureRoofline().
+struct Roofline {
+    double gflops;       // floating point operations
+    double bandwidth;    // GB/s of global memory
+
+    // GFLOPS the device can reach at an arithmetic intensity.
+    [[nodiscard]] double attainable(double intensity) const { return std::min(gflops, intensity * bandwidth); }
+
+    // Intensity above which the device is compute bound.
+    [[nodiscard]] double ridge() const { return gflops / bandwidth; }
+};
+
+struct BenchmarkRecord {
+    BenchmarkCase benchmark;
+    BenchmarkStats wall;
+    std::optional<BenchmarkStats> device;
+    std::optional<double> roofline = std::nullopt;    // share of the attainable rate, of the device time if profiled
+
+    // Rate from the median, in giga-units of work per second.
+    [[nodiscard]] double rate() const { return rate(wall); }
+
+    [[nodiscard]] double rate(const BenchmarkStats &stats) const {
+        return stats.median > 0.0 ? benchmark.work / stats.median / 1e9 : 0.0;
+    }
+};
+
+struct BenchmarkOptions {
+    int warmup = 1;
+    int iterations = 5;
+    std::string jsonPath;
+    std::string csvPath;
+
+    // Reads the options above, other arguments are left to the caller.
+    static BenchmarkOptions parse(int argc, char *argv[]) {
+        BenchmarkOptions options;
+        for (int i = 1; i + 1 < argc; i++) {
+            if (!strcmp(argv[i], "--warmup")) options.warmup = std::max(0, std::atoi(argv[++i]));
+            else if (!strcmp(argv[i], "--iterations")) options.iterations = std::max(1, std::atoi(argv[++i]));
+            else if (!strcmp(argv[i], "--json")) options.jsonPath = argv[++i];
+            else if (!strcmp(argv[i], "--csv")) options.csvPath = argv[++i];
+        }
+        return options;
+    }
+};
+
+class BenchmarkRunner {
+public:
+    explicit BenchmarkRunner(BenchmarkOptions options = {}) : options(std::move(options)) {}
+
+    [[nodiscard]] const BenchmarkOptions &getOptions() const { return options; }
+
+    // Cases of device with an intensity are then rated against the roofline.
+    void setRoofline(const std::string &device, const Roofline &roofline) { rooflines[device] = roofline; }
+
+    // Runs the case with the configured warmup and iterations and prints a summary line.
+    // Returns a copy of the record, the runner keeps its own for write().
+    BenchmarkRecord measure(const BenchmarkCase &benchmark, const std::function<BenchmarkSample()> &iteration) {
+        return measure(benchmark, iteration, options.warmup, options.iterations);
+    }
+
+    // Same with explicit counts, for cases too slow to be repeated.
+    BenchmarkRecord measure(const BenchmarkCase &benchmark, const std::function<BenchmarkSample()> &iteration,
+                            int warmup, int iterations) {
+        for (int i = 0; i < warmup; i++) iteration();
+
+        std::vector<double> wall;
+        std::vector<double> device;
+        for (int i = 0; i < iterations; i++) {
+            auto sample = iteration();
+            wall.push_back(sample.seconds);
+            if (sample.deviceSeconds) device.push_back(*sample.deviceSeconds);
+        }
+
+        BenchmarkRecord record{benchmark, summarize(wall), std::nullopt};
+        if (!device.empty()) record.device = summarize(device);
+        record.roofline = rooflineShare(record);
+        records.push_back(record);
+        print(record);
+        return record;
+    }
+
+    // Writes every case measured so far to the --json and --csv files.
+    void write() const {
+        if (!options.jsonPath.empty()) writeJson(options.jsonPath);
+        if (!options.csvPath.empty()) writeCsv(options.csvPath);
+    }
+
+private:
+    [[nodiscard]] std::optional<double> rooflineShare(const BenchmarkRecord &r) const {
+        const auto found = rooflines.find(r.benchmark.device);
+        if (found == rooflines.end() || !r.benchmark.intensity) return std::nullopt;
+        const double intensity = *r.benchmark.intensity;
+        const double rate = r.device ? r.rate(*r.device) : r.rate();
+        // A rate in GB/s is compared with the bandwidth the roofline allows at the intensity.
+        if (r.benchmark.unit == "GB/s") {
+            return intensity > 0.0 ? rate * intensity / found->second.attainable(intensity)
+                                   : rate / found->second.bandwidth;
+        }
+        return rate / found->second.attainable(intensity);
+    }
+
+    static void print(const BenchmarkRecord &r) {
+        const auto &w = r.wall;
+        printf(" min %.4f, median %.4f, p95 %.4f, stddev %.4f seconds (%zu runs) at %.2f %s",
+               w.min, w.median, w.p95, w.stddev, w.runs, r.rate(), r.benchmark.unit.c_str());
+        if (r.device) {
+            printf(", device median %.4f seconds at %.2f %s",
+                   r.device->median, r.rate(*r.device), r.benchmark.unit.c_str());
+        }
+        if (r.roofline) {
+            printf(", intensity %.2f flop/byte, %.0f%% of the roofline", *r.benchmark.intensity, 100.0 * *r.roofline);
+        }
+        printf("\n");
+    }
+
+    static std::string quoted(const std::string &text) {
+        std::string out = "\"";
+        for (char c: text) {
+            if (c == '"' || c == '\\') out += '\\';
+            out += c;
+        }
+        return out + "\"";
+    }
+
+    static std::string csvField(const std::string &text) {
+        std::string out = "\"";
+        for (char c: text) {
+            if (c == '"') out += '"';
+            out += c;
+        }
+        return out + "\"";
+    }
+
+    static std::string stats(const BenchmarkStats &s) {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer),
+                 "{\"runs\": %zu, \"min\": %.9g, \"median\": %.9g, \"p95\": %.9g, \"mean\": %.9g, \"stddev\": %.9g}",
+                 s.runs, s.min, s.median, s.p95, s.mean, s.stddev);
+        return buffer;
+    }
+
+    void writeJson(const std::string &path) const {
+        std::ofstream stream(path, std::ios::trunc);
+        stream << "[\n";
+        for (size_t i = 0; i < records.size(); i++) {
+            const auto &r = records[i];
+            stream << "  {\"device\": " << quoted(r.benchmark.device)
+                   << ", \"variant\": " << quoted(r.benchmark.variant)
+                   << ", \"size\": " << quoted(r.benchmark.size)
+                   << ", \"unit\": " << quoted(r.benchmark.unit)
+                   << ", \"rate\": " << r.rate()
+                   << ", \"seconds\": " << stats(r.wall);
+            if (r.device) {
+                stream << ", \"device_rate\": " << r.rate(*r.device)
+                       << ", \"device_seconds\": " << stats(*r.device);
+            }
+            if (r.roofline) {
+                stream << ", \"intensity\": " << *r.benchmark.intensity << ", \"roofline\": " << *r.roofline;
+            }
+            stream << "}" << (i + 1 < records.size() ? "," : "") << "\n";
+        }
+        stream << "]\n";
+    }
+
+    void writeCsv(const std::string &path) const {
+        std::ofstream stream(path, std::ios::trunc);
+        stream << "device,variant,size,unit,rate,runs,min,median,p95,mean,stddev,device_rate,device_median,"
+                  "intensity,roofline\n";
+        for (const auto &r: records) {
+            const auto &w = r.wall;
+            stream << csvField(r.benchmark.device) << ',' << csvField(r.benchmark.variant) << ','
+                   << csvField(r.benchmark.size) << ',' << r.benchmark.unit << ',' << r.rate() << ','
+                   << w.runs << ',' << w.min << ',' << w.median << ',' << w.p95 << ','
+                   << w.mean << ',' << w.stddev << ',';
+            if (r.device) stream << r.rate(*r.device) << ',' << r.device->median;
+            else stream << ',';
+            stream << ',';
+            if (r.roofline) stream << *r.benchmark.intensity << ',' << *r.roofline;
+            else stream << ',';
+            stream << '\n';
+        }
+    }
+
+    BenchmarkOptions options;
+    std::vector<BenchmarkRecord> records;
+    std::map<std::string, Roofline> rooflines;
+};
+
+} // namespace util
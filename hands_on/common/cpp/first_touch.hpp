@@ -0,0 +1,130 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       first_touch.hpp
+ *
+ * Purpose:    Host arrays whose pages are placed by the threads using them
+ *
+ *             The OS backs a page with memory of the NUMA node of the core
+ *             that writes it first. std::vector<float>(size) zeroes its
+ *             elements on the constructing thread, so all pages of a large
+ *             matrix end up on one node, and filling it afterwards touches
+ *             every page a second time.
+ *
+ *             A vector using FirstTouchAllocator default-initializes its
+ *             elements, so allocating it writes nothing. parallelRows() then
+ *             fills the rows in contiguous blocks, one per thread, thread t
+ *             pinned to the t-th CPU the process may run on. That is how
+ *             host_matvec splits its rows, and close to how a CPU device and
+ *             host_sgemm spread rows of tiles over the cores, so most pages
+ *             are local to the core that later reads them.
+ *
+ *             Without NUMA this still saves the zeroing pass and spreads the
+ *             page faults over the cores.
+ *
+ */
+
+#pragma once
+
+#include "zero_copy.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace util {
+
+// Whole pages like PageAllocator, the elements are left uninitialized when they're trivial.
+template<typename T>
+struct FirstTouchAllocator : PageAllocator<T> {
+    using value_type = T;
+
+    FirstTouchAllocator() = default;
+
+    template<typename U>
+    FirstTouchAllocator(const FirstTouchAllocator<U> &) {}
+
+    template<typename U>
+    void construct(U *pointer) noexcept(std::is_nothrow_default_constructible_v<U>) {
+        ::new(static_cast<void *>(pointer)) U;
+    }
+
+    template<typename U, typename... Args>
+    void construct(U *pointer, Args &&... args) {
+        ::new(static_cast<void *>(pointer)) U(std::forward<Args>(args)...);
+    }
+
+    template<typename U>
+    bool operator==(const FirstTouchAllocator<U> &) const { return true; }
+};
+
+template<typename T>
+using FirstTouchVector = std::vector<T, FirstTouchAllocator<T>>;
+
+// The CPUs the process may run on, in order.
+inline std::vector<int> allowedCpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+        }
+    }
+#endif
+    if (cpus.empty()) {
+        const int count = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        for (int cpu = 0; cpu < count; cpu++) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// Runs the calling thread on cpu only, does nothing where that isn't supported.
+inline void pinToCpu(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void) cpu;
+#endif
+}
+
+// Calls body(first, last) for contiguous blocks of [0, rows), one block per thread, thread t
+// pinned to the t-th allowed CPU. threads <= 0 uses one thread per allowed CPU, a single
+// thread calls body on the calling thread.
+template<typename Body>
+void parallelRows(size_t rows, Body body, int threads = 0) {
+    const std::vector<int> cpus = allowedCpus();
+    size_t count = threads > 0 ? static_cast<size_t>(threads) : cpus.size();
+    count = std::min(count, rows);
+    if (count <= 1) {
+        if (rows > 0) body(size_t(0), rows);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    workers.reserve(count);
+    for (size_t t = 0; t < count; t++) {
+        const size_t first = rows * t / count;
+        const size_t last = rows * (t + 1) / count;
+        const int cpu = cpus[t % cpus.size()];
+        workers.emplace_back([&body, first, last, cpu] {
+            pinToCpu(cpu);
+            body(first, last);
+        });
+    }
+    for (auto &worker: workers) worker.join();
+}
+
+} // namespace util
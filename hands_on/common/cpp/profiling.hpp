@@ -0,0 +1,59 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       profiling.hpp
+ *
+ * Purpose:    Read the timestamps of commands enqueued on a queue created
+ *             with CL_QUEUE_PROFILING_ENABLE
+ *
+ *             Every command goes through four device timestamps:
+ *
+ *               queued  ... enqueued by the host
+ *               submit  ... sent to the device
+ *               start   ... started executing
+ *               end     ... finished executing
+ *
+ *             start->end is the pure execution time of a kernel or a
+ *             transfer, free of enqueue overhead and host timer resolution.
+ *
+ * Note:       Must be included AFTER the relevant OpenCL header
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+#include "cl.hpp"
+
+namespace util {
+
+struct EventTimes {
+    cl_ulong queued;
+    cl_ulong submit;
+    cl_ulong start;
+    cl_ulong end;
+
+    //! Execution time of the command in seconds
+    [[nodiscard]] double seconds() const {
+        return static_cast<double>(end - start) * 1e-9;
+    }
+};
+
+inline EventTimes eventTimes(const cl::Event &event) {
+    return {
+            event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>(),
+            event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>(),
+            event.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
+            event.getProfilingInfo<CL_PROFILING_COMMAND_END>()
+    };
+}
+
+inline void printEventTimes(const std::string &label, const EventTimes &times) {
+    printf("    %-10s queued->submit %10llu ns, submit->start %10llu ns, start->end %12llu ns\n",
+           label.c_str(),
+           static_cast<unsigned long long>(times.submit - times.queued),
+           static_cast<unsigned long long>(times.start - times.submit),
+           static_cast<unsigned long long>(times.end - times.start));
+}
+
+} // namespace util
@@ -0,0 +1,144 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       program_cache.hpp
+ *
+ * Purpose:    Build OpenCL programs through an on-disk cache of device binaries
+ *
+ *             buildProgram() hashes the kernel source (including any #define
+ *             prefix), the build options and the identity of each device:
+ *             name, vendor, device version, driver version and platform
+ *             version. When every device of the context has a cached binary,
+ *             the program is created with clCreateProgramWithBinary and the
+ *             JIT is skipped. Otherwise it is built from source and
+ *             CL_PROGRAM_BINARIES are written to the cache for the next run.
+ *
+ *             The cache directory is CL_PROGRAM_CACHE_DIR if set, otherwise
+ *             .cl_program_cache in the working directory. Setting
+ *             CL_PROGRAM_CACHE_DISABLE builds every program from source.
+ *
+ * Note:       Must be included AFTER the relevant OpenCL header
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "cl.hpp"
+
+namespace util {
+
+// 64-bit FNV-1a, stable across runs and platforms unlike std::hash.
+inline uint64_t fnv1a(const std::string &data, uint64_t hash = 0xcbf29ce484222325ULL) {
+    for (unsigned char c: data) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+inline std::filesystem::path programCacheDir() {
+    const char *env = std::getenv("CL_PROGRAM_CACHE_DIR");
+    return env != nullptr ? env : ".cl_program_cache";
+}
+
+inline std::filesystem::path programCachePath(const cl::Device &device,
+                                              const std::string &source,
+                                              const std::string &options) {
+    cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+    uint64_t hash = fnv1a(source);
+    for (const std::string &part: {std::string(1, '\0'), options, std::string(1, '\0'),
+                                   device.getInfo<CL_DEVICE_NAME>(),
+                                   device.getInfo<CL_DEVICE_VENDOR>(),
+                                   device.getInfo<CL_DEVICE_VERSION>(),
+                                   device.getInfo<CL_DRIVER_VERSION>(),
+                                   platform.getInfo<CL_PLATFORM_VERSION>()}) {
+        hash = fnv1a(part, hash);
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(hash));
+    return programCacheDir() / name;
+}
+
+// Prints the build log of every device and rethrows.
+[[noreturn]] inline void reportBuildFailure(const cl::Program &program, const cl::Error &err) {
+    cl_int buildErr = CL_SUCCESS;
+    auto buildInfo = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(&buildErr);
+    for (auto &pair: buildInfo) {
+        std::cerr << pair.second << std::endl << std::endl;
+    }
+    throw err;
+}
+
+inline cl::Program buildProgramFromSource(const cl::Context &context,
+                                          const std::string &source,
+                                          const std::string &options) {
+    cl::Program program(context, source);
+    try {
+        program.build(options.c_str());
+    }
+    catch (cl::Error &err) {
+        reportBuildFailure(program, err);
+    }
+    return program;
+}
+
+inline cl::Program buildProgram(const cl::Context &context,
+                                const std::string &source,
+                                const std::string &options = "") {
+    if (std::getenv("CL_PROGRAM_CACHE_DISABLE") != nullptr) {
+        return buildProgramFromSource(context, source, options);
+    }
+
+    const auto devices = context.getInfo<CL_CONTEXT_DEVICES>();
+    cl::Program::Binaries binaries;
+    for (const auto &device: devices) {
+        std::ifstream stream(programCachePath(device, source, options), std::ios::binary);
+        if (stream.is_open()) {
+            binaries.emplace_back(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+        }
+    }
+
+    if (binaries.size() == devices.size()) {
+        try {
+            cl::Program program(context, devices, binaries);
+            program.build(devices, options.c_str());
+            return program;
+        }
+        catch (cl::Error &) {
+            // A stale or foreign binary (CL_INVALID_BINARY), rebuild from source and overwrite it.
+        }
+    }
+
+    cl::Program program = buildProgramFromSource(context, source, options);
+
+    const auto programDevices = program.getInfo<CL_PROGRAM_DEVICES>();
+    const auto built = program.getInfo<CL_PROGRAM_BINARIES>();
+    std::error_code ec;
+    std::filesystem::create_directories(programCacheDir(), ec);
+    for (size_t i = 0; i < programDevices.size() && i < built.size(); i++) {
+        if (built[i].empty()) continue;
+        auto path = programCachePath(programDevices[i], source, options);
+        // Write to a temporary file first, so a concurrent run never reads a partial binary.
+        auto tmp = path;
+        tmp += ".tmp";
+        {
+            std::ofstream stream(tmp, std::ios::binary | std::ios::trunc);
+            stream.write(reinterpret_cast<const char *>(built[i].data()),
+                         static_cast<std::streamsize>(built[i].size()));
+            if (!stream) continue;
+        }
+        std::filesystem::rename(tmp, path, ec);
+    }
+    return program;
+}
+
+} // namespace util
@@ -0,0 +1,122 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       roofline.hpp
+ *
+ * Purpose:    Measure the peak rates of a device, the roof of its roofline
+ *
+ *             A kernel moving B bytes of global memory for F floating point
+ *             operations has an arithmetic intensity of F/B and can't go
+ *             faster than min(peak GFLOPS, F/B * peak GB/s). The peaks are
+ *             measured rather than taken from a data sheet:
+ *
+ *               peak_fma     ... every work-item runs 8 independent chains of
+ *                                float4 multiply-adds on registers only
+ *               stream_triad ... a[i] = b[i] + s * c[i] over arrays much
+ *                                larger than any cache, 3 float4 per item
+ *
+ *             Both are timed by profiling events and the best of a few runs
+ *             is kept, the measurement takes a fraction of a second.
+ *
+ * Note:       Must be included AFTER the relevant OpenCL header
+ */
+
+#pragma once
+
+#include "cl.hpp"
+#include "benchmark.hpp"
+#include "profiling.hpp"
+#include "program_cache.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <string>
+
+namespace util {
+
+const std::string ROOFLINE_KERNELS = R"(
+__kernel void peak_fma(
+                const int iterations,
+                const float a,
+                __global float* restrict out)
+{
+    // Independent chains hide the latency of a multiply-add, x converges to b / (1 - a).
+    const float4 b = (float4)((float)(get_global_id(0) & 7) * 1e-3f);
+    float4 x0 = b, x1 = b + 1.0f, x2 = b + 2.0f, x3 = b + 3.0f;
+    float4 x4 = b + 4.0f, x5 = b + 5.0f, x6 = b + 6.0f, x7 = b + 7.0f;
+    for (int i = 0; i < iterations; i++) {
+        x0 = mad(x0, a, b); x1 = mad(x1, a, b); x2 = mad(x2, a, b); x3 = mad(x3, a, b);
+        x4 = mad(x4, a, b); x5 = mad(x5, a, b); x6 = mad(x6, a, b); x7 = mad(x7, a, b);
+    }
+    const float4 sum = ((x0 + x1) + (x2 + x3)) + ((x4 + x5) + (x6 + x7));
+    out[get_global_id(0)] = sum.x + sum.y + sum.z + sum.w;
+}
+
+__kernel void stream_triad(
+                const float s,
+                __global       float4* restrict a,
+                __global const float4* restrict b,
+                __global const float4* restrict c)
+{
+    const size_t i = get_global_id(0);
+    a[i] = b[i] + s * c[i];
+}
+)";
+
+// Floating point operations of a work-item of peak_fma per iteration: 8 chains of float4 multiply-adds.
+const int ROOFLINE_FLOPS_PER_ITERATION = 8 * 4 * 2;
+
+// Largest array of stream_triad, far beyond the last level cache of any device.
+const size_t ROOFLINE_STREAM_BYTES = size_t(64) << 20;
+
+// Shortest profiled time of runs launches after a warm-up one.
+inline double bestSeconds(const std::function<cl::Event()> &kernel, int runs) {
+    double best = 0.0;
+    for (int i = 0; i <= runs; i++) {
+        cl::Event event = kernel();
+        event.wait();
+        const double seconds = eventTimes(event).seconds();
+        if (i > 0 && (best == 0.0 || seconds < best)) best = seconds;    // the first run warms up
+    }
+    return best;
+}
+
+// Peak GFLOPS and GB/s of the device, runs launches of each kernel.
+inline Roofline measureRoofline(const cl::Context &context, const cl::Device &device, int runs = 3) {
+    cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+    const cl::Program program = buildProgram(context, ROOFLINE_KERNELS);
+
+    // Enough work-items to fill every compute unit several times over.
+    const size_t items = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() *
+                         std::min<size_t>(device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>(), 256) * 8;
+    cl::Buffer out(context, CL_MEM_WRITE_ONLY, sizeof(float) * items);
+    auto fma = cl::KernelFunctor<int, float, cl::Buffer>(program, "peak_fma");
+    // Longer loops until a run takes a few milliseconds, so the launch is negligible.
+    int iterations = 256;
+    double seconds = 0.0;
+    for (;;) {
+        seconds = bestSeconds([&]() {
+            return fma(cl::EnqueueArgs(queue, cl::NDRange(items)), iterations, 0.999f, out);
+        }, runs);
+        if (seconds >= 0.005 || iterations >= (1 << 20)) break;
+        iterations *= 4;
+    }
+    const double gflops = static_cast<double>(items) * iterations * ROOFLINE_FLOPS_PER_ITERATION / seconds / 1e9;
+
+    const size_t bytes = std::min(ROOFLINE_STREAM_BYTES, device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / 4);
+    const size_t vectors = bytes / (4 * sizeof(float));
+    cl::Buffer a(context, CL_MEM_WRITE_ONLY, bytes);
+    cl::Buffer b(context, CL_MEM_READ_ONLY, bytes);
+    cl::Buffer c(context, CL_MEM_READ_ONLY, bytes);
+    queue.enqueueFillBuffer(b, 1.0f, 0, bytes);
+    queue.enqueueFillBuffer(c, 2.0f, 0, bytes);
+    auto triad = cl::KernelFunctor<float, cl::Buffer, cl::Buffer, cl::Buffer>(program, "stream_triad");
+    seconds = bestSeconds([&]() {
+        return triad(cl::EnqueueArgs(queue, cl::NDRange(vectors)), 3.0f, a, b, c);
+    }, runs);
+    const double bandwidth = 3.0 * static_cast<double>(vectors) * 4 * sizeof(float) / seconds / 1e9;
+
+    return {gflops, bandwidth};
+}
+
+} // namespace util
@@ -0,0 +1,105 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       specialization_cache.hpp
+ *
+ * Purpose:    Programs specialized for a problem size, built on demand
+ *
+ *             A kernel compiled with its order as a constant (#define N) is
+ *             faster than one taking it as an argument, the compiler folds
+ *             the loop bounds and the index arithmetic. But building takes
+ *             longer than a small product, so a size seen only once is
+ *             better served by a generic program built once per variant.
+ *
+ *             get() counts the requests of every (variant, order, blksz).
+ *             Until a key was requested specializeAfter times it returns the
+ *             generic program, from then on the program built for the order.
+ *             Both are built from source(order) and source(std::nullopt), and
+ *             go through buildProgram(), so they're in the on-disk cache too.
+ *
+ * Note:       Must be included AFTER the relevant OpenCL header
+ */
+
+#pragma once
+
+#include "cl.hpp"
+#include "program_cache.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <utility>
+
+namespace util {
+
+struct Specialization {
+    cl::Program program;
+    bool specialized;    // built for the order, otherwise the generic program
+};
+
+class SpecializationCache {
+public:
+    // Source of a variant for an order, or for any order given std::nullopt.
+    using SourceGenerator = std::function<std::string(std::optional<size_t> order)>;
+
+    struct Stats {
+        size_t generic = 0;        // requests served by a generic program
+        size_t specialized = 0;    // requests served by a specialized program
+        size_t builds = 0;         // programs built, generic ones included
+    };
+
+    explicit SpecializationCache(cl::Context context, size_t specializeAfter = 2) :
+            context(std::move(context)), specializeAfter(specializeAfter) {}
+
+    Specialization get(const std::string &variant, size_t order, int blksz, const SourceGenerator &source) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const Key key{variant, order, blksz};
+        if (++requests[key] < specializeAfter) {
+            return {genericLocked(variant, blksz, source), false};
+        }
+        auto found = programs.find(key);
+        if (found == programs.end()) {
+            found = programs.emplace(key, buildProgram(context, source(order))).first;
+            counts.builds++;
+        }
+        counts.specialized++;
+        return {found->second, true};
+    }
+
+    // The generic program of a variant, for orders that are never specialized.
+    cl::Program generic(const std::string &variant, int blksz, const SourceGenerator &source) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return genericLocked(variant, blksz, source);
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counts;
+    }
+
+private:
+    using Key = std::tuple<std::string, size_t, int>;
+
+    cl::Program genericLocked(const std::string &variant, int blksz, const SourceGenerator &source) {
+        auto found = generics.find({variant, blksz});
+        if (found == generics.end()) {
+            found = generics.emplace(std::make_pair(variant, blksz), buildProgram(context, source(std::nullopt))).first;
+            counts.builds++;
+        }
+        counts.generic++;
+        return found->second;
+    }
+
+    cl::Context context;
+    size_t specializeAfter;
+    std::map<Key, size_t> requests;
+    std::map<Key, cl::Program> programs;
+    std::map<std::pair<std::string, int>, cl::Program> generics;
+    Stats counts;
+    mutable std::mutex mutex;
+};
+
+} // namespace util
@@ -0,0 +1,115 @@
+/*------------------------------------------------------------------------------
+ *
+ * Name:       zero_copy.hpp
+ *
+ * Purpose:    Buffers that share their storage with the host
+ *
+ *             On a CPU device or an integrated GPU the device memory is the
+ *             host memory, so uploads and read backs are plain memcpy's. A
+ *             buffer created with CL_MEM_USE_HOST_PTR over page-aligned host
+ *             storage (Intel wants 4096 bytes alignment and a size multiple
+ *             of 64 bytes) or with CL_MEM_ALLOC_HOST_PTR is used in place
+ *             instead. The host accesses it through enqueueMapBuffer and
+ *             enqueueUnmapMemObject, which then don't copy anything.
+ *
+ *             Whether a device works that way is reported by
+ *             CL_DEVICE_HOST_UNIFIED_MEMORY, see hasHostUnifiedMemory().
+ *
+ */
+
+#pragma once
+
+#include "cl.hpp"
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace util {
+
+// A page, the alignment Intel drivers need to use host memory in place.
+const size_t ZERO_COPY_ALIGNMENT = 4096;
+
+// Allocates whole pages, aligned on a page.
+template<typename T>
+struct PageAllocator {
+    using value_type = T;
+
+    PageAllocator() = default;
+
+    template<typename U>
+    PageAllocator(const PageAllocator<U> &) {}
+
+    T *allocate(size_t count) {
+        const size_t bytes = (sizeof(T) * count + ZERO_COPY_ALIGNMENT - 1) / ZERO_COPY_ALIGNMENT * ZERO_COPY_ALIGNMENT;
+        return static_cast<T *>(::operator new(bytes, std::align_val_t(ZERO_COPY_ALIGNMENT)));
+    }
+
+    void deallocate(T *pointer, size_t) {
+        ::operator delete(pointer, std::align_val_t(ZERO_COPY_ALIGNMENT));
+    }
+
+    template<typename U>
+    bool operator==(const PageAllocator<U> &) const { return true; }
+};
+
+template<typename T>
+using PageAlignedVector = std::vector<T, PageAllocator<T>>;
+
+inline bool hasHostUnifiedMemory(const cl::Device &device) {
+    return device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+}
+
+// Buffer whose storage is the host array. The array must outlive the buffer, and the
+// host must map the buffer to see what the device wrote.
+template<typename T>
+cl::Buffer wrapHostMemory(const cl::Context &context, cl_mem_flags flags, T *host, size_t count) {
+    return {context, flags | CL_MEM_USE_HOST_PTR, sizeof(T) * count, host};
+}
+
+template<typename T, typename Allocator>
+cl::Buffer wrapHostMemory(const cl::Context &context, cl_mem_flags flags, std::vector<T, Allocator> &host) {
+    return wrapHostMemory(context, flags, host.data(), host.size());
+}
+
+// Buffer allocated by the driver where both the host and the device reach it.
+inline cl::Buffer allocHostMemory(const cl::Context &context, cl_mem_flags flags, size_t bytes) {
+    return {context, flags | CL_MEM_ALLOC_HOST_PTR, bytes};
+}
+
+// count elements of a buffer mapped for the host, unmapped when this goes out of scope.
+template<typename T>
+class MappedBuffer {
+public:
+    MappedBuffer(const cl::CommandQueue &queue, const cl::Buffer &buffer, cl_map_flags flags, size_t count,
+                 cl::Event *event = nullptr) :
+            queue(queue),
+            buffer(buffer),
+            pointer(static_cast<T *>(this->queue.enqueueMapBuffer(this->buffer, CL_TRUE, flags, 0,
+                                                                  sizeof(T) * count, nullptr, event))),
+            count(count) {}
+
+    MappedBuffer(const MappedBuffer &) = delete;
+
+    MappedBuffer &operator=(const MappedBuffer &) = delete;
+
+    ~MappedBuffer() {
+        queue.enqueueUnmapMemObject(buffer, pointer);
+    }
+
+    T *data() { return pointer; }
+
+    T *begin() { return pointer; }
+
+    T *end() { return pointer + count; }
+
+    T &operator[](size_t i) { return pointer[i]; }
+
+private:
+    cl::CommandQueue queue;
+    cl::Buffer buffer;
+    T *pointer;
+    size_t count;
+};
+
+} // namespace util
@@ -13,11 +13,14 @@
 
 #include "../common/cpp/cl.hpp"
 #include "../common/cpp/util.hpp"
+#include "../common/cpp/benchmark.hpp"
+#include "../common/cpp/zero_copy.hpp"
 #include "../common/err_code.h"
 
 #include <vector>
 #include <cstdio>
 #include <cstdlib>
+#include <optional>
 
 #include <iostream>
 
@@ -44,14 +47,15 @@ __kernel void vadd(
    }
 })";
 
-int main() {
-    std::vector<float> h_a(LENGTH);                // a vector
-    std::vector<float> h_b(LENGTH);                // b vector
-    std::vector<float> h_c(LENGTH, 0xdeadbeef);    // c = a + b, from compute device
-    std::vector<float> h_d(LENGTH, 0xdeadbeef);
-    std::vector<float> h_e(LENGTH);
-    std::vector<float> h_f(LENGTH, 0xdeadbeef);
-    std::vector<float> h_g(LENGTH);
+int main(int argc, char *argv[]) {
+    // Page aligned, so the buffers can use the vectors in place (see zero_copy.hpp).
+    util::PageAlignedVector<float> h_a(LENGTH);                // a vector
+    util::PageAlignedVector<float> h_b(LENGTH);                // b vector
+    util::PageAlignedVector<float> h_c(LENGTH, 0xdeadbeef);    // c = a + b, from compute device
+    util::PageAlignedVector<float> h_d(LENGTH, 0xdeadbeef);
+    util::PageAlignedVector<float> h_e(LENGTH);
+    util::PageAlignedVector<float> h_f(LENGTH, 0xdeadbeef);
+    util::PageAlignedVector<float> h_g(LENGTH);
 
     cl::Buffer d_a;                        // device memory used for the input  a vector
     cl::Buffer d_b;                        // device memory used for the input  b vector
@@ -83,39 +87,62 @@ int main() {
         // Create the kernel functor
         auto vadd = cl::KernelFunctor<cl::Buffer &, cl::Buffer &, cl::Buffer &, int>(program, "vadd");
 
-        d_a = cl::Buffer(context, begin(h_a), end(h_a), true);
-        d_b = cl::Buffer(context, begin(h_b), end(h_b), true);
+        // Devices sharing memory with the host use the vectors in place, the others get copies.
+        const bool zeroCopy = util::hasHostUnifiedMemory(context.getInfo<CL_CONTEXT_DEVICES>()[0]);
+        if (zeroCopy) {
+            printf("Zero copy: the buffers use the host vectors\n");
+            d_a = util::wrapHostMemory(context, CL_MEM_READ_ONLY, h_a);
+            d_b = util::wrapHostMemory(context, CL_MEM_READ_ONLY, h_b);
+            d_e = util::wrapHostMemory(context, CL_MEM_READ_ONLY, h_e);
+            d_f = util::wrapHostMemory(context, CL_MEM_WRITE_ONLY, h_f);
+            d_g = util::wrapHostMemory(context, CL_MEM_READ_ONLY, h_g);
+        } else {
+            d_a = cl::Buffer(context, begin(h_a), end(h_a), true);
+            d_b = cl::Buffer(context, begin(h_b), end(h_b), true);
+            d_e = cl::Buffer(context, begin(h_e), end(h_e), true);
+            d_f = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * LENGTH);
+            d_g = cl::Buffer(context, begin(h_g), end(h_g), true);
+        }
         d_c = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * LENGTH);
         d_d = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * LENGTH);
-        d_e = cl::Buffer(context, begin(h_e), end(h_e), true);
-        d_f = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * LENGTH);
-        d_g = cl::Buffer(context, begin(h_g), end(h_g), true);
-
-        util::Timer timer;
-
-        vadd(cl::EnqueueArgs(queue, cl::NDRange(LENGTH)),
-             d_a,
-             d_b,
-             d_c,
-             LENGTH);
-
-        vadd(cl::EnqueueArgs(queue, cl::NDRange(LENGTH)),
-             d_c,
-             d_e,
-             d_d,
-             LENGTH);
-
-        vadd(cl::EnqueueArgs(queue, cl::NDRange(LENGTH)),
-             d_d,
-             d_g,
-             d_f,
-             LENGTH);
-
-        queue.finish();
-
-        printf("The kernels ran in %llu ms\n", timer.getTimeMilliseconds());
 
-        cl::copy(queue, d_f, begin(h_f), end(h_f));
+        util::BenchmarkRunner bench(util::BenchmarkOptions::parse(argc, argv));
+        const std::string deviceName = context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_NAME>();
+        // Every vadd reads two vectors and writes one.
+        const double bytes = 3.0 * 3.0 * sizeof(float) * LENGTH;
+
+        printf("The kernels ran in");
+        bench.measure({deviceName, "vadd x3", std::to_string(LENGTH), "GB/s", bytes}, [&]() -> util::BenchmarkSample {
+            util::Timer timer;
+
+            vadd(cl::EnqueueArgs(queue, cl::NDRange(LENGTH)),
+                 d_a,
+                 d_b,
+                 d_c,
+                 LENGTH);
+
+            vadd(cl::EnqueueArgs(queue, cl::NDRange(LENGTH)),
+                 d_c,
+                 d_e,
+                 d_d,
+                 LENGTH);
+
+            vadd(cl::EnqueueArgs(queue, cl::NDRange(LENGTH)),
+                 d_d,
+                 d_g,
+                 d_f,
+                 LENGTH);
+
+            queue.finish();
+
+            return {static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0, std::nullopt};
+        });
+        bench.write();
+
+        // With zero copy h_f is the storage of d_f, mapping it makes the result visible.
+        std::optional<util::MappedBuffer<float>> f_view;
+        if (zeroCopy) f_view.emplace(queue, d_f, CL_MAP_READ, LENGTH);
+        else cl::copy(queue, d_f, begin(h_f), end(h_f));
 
         // Test the results
         int correct = 0;
@@ -15,6 +15,7 @@
 
 #include "../common/cpp/cl.hpp"
 #include "../common/cpp/util.hpp"
+#include "../common/cpp/benchmark.hpp"
 #include "../common/err_code.h"
 
 #include <vector>
@@ -47,7 +48,7 @@ __kernel void vadd(
    }
 })";
 
-int main() {
+int main(int argc, char *argv[]) {
     std::vector<float> h_a(LENGTH);                // a vector 
     std::vector<float> h_b(LENGTH);                // b vector 	
     std::vector<float> h_c(LENGTH);                // c vector
@@ -84,18 +85,27 @@ int main() {
         d_c = cl::Buffer(context, begin(h_c), end(h_c), true);
         d_d = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * LENGTH);
 
-        util::Timer timer;
+        util::BenchmarkRunner bench(util::BenchmarkOptions::parse(argc, argv));
+        const std::string deviceName = context.getInfo<CL_CONTEXT_DEVICES>()[0].getInfo<CL_DEVICE_NAME>();
+        // The kernel reads three vectors and writes one.
+        const double bytes = 4.0 * sizeof(float) * LENGTH;
 
-        vadd(cl::EnqueueArgs(queue, cl::NDRange(LENGTH)),
-             d_a,
-             d_b,
-             d_c,
-             d_d,
-             LENGTH);
+        printf("The kernels ran in");
+        bench.measure({deviceName, "vadd3", std::to_string(LENGTH), "GB/s", bytes}, [&]() -> util::BenchmarkSample {
+            util::Timer timer;
 
-        queue.finish();
+            vadd(cl::EnqueueArgs(queue, cl::NDRange(LENGTH)),
+                 d_a,
+                 d_b,
+                 d_c,
+                 d_d,
+                 LENGTH);
 
-        printf("The kernels ran in %llu ms\n", timer.getTimeMilliseconds());
+            queue.finish();
+
+            return {static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0, std::nullopt};
+        });
+        bench.write();
 
         cl::copy(queue, d_d, begin(h_d), end(h_d));
 
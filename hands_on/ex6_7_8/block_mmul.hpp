@@ -42,15 +42,18 @@
 //
 //-------------------------------------------------------------
 
+#include "epilogue.hpp"
+
 #include <string>
 
-const std::string BLOCK_MULTIPLICATION = R"(
+const std::string BLOCK_MULTIPLICATION = GEMM_EPILOGUE + R"(
 __kernel void mmul(
                 __global const float* restrict A,
                 __global const float* restrict B,
                 __global       float* restrict C,
                 __local        float* restrict Awrk,
-                __local        float* restrict Bwrk)
+                __local        float* restrict Bwrk
+                EPILOGUE_ARGS)
 {
     int kloc, Kblk;
     float Ctmp=0.0f;
@@ -104,7 +107,165 @@ __kernel void mmul(
     }
 
     // update global C matrix
-    C[j*N+i] = Ctmp;
+    STORE_C(C, j, i, N, Ctmp);
+
+})";
+
+
+//-------------------------------------------------------------
+//
+//  Blocked multiplication of rectangular matrices
+//
+//              C(M,N) = A(M,K) * B(K,N)
+//
+//  The orders are kernel arguments and don't have to be multiples
+//  of blksz. The NDRange is rounded up to whole blocks: loads
+//  outside of A and B are replaced with zeros and work-items
+//  outside of C don't store anything.
+//
+//  The element type is `real`, see scalar_type.hpp. A and B may be
+//  stored as another type, `storage`, and are read as real with
+//  LOAD (see storageDefines()). With ACCUMULATE defined the product
+//  is added to C instead of replacing it, otherwise it goes through
+//  the epilogue, see epilogue.hpp.
+//
+//-------------------------------------------------------------
+const std::string BLOCK_MULTIPLICATION_MNK = GEMM_EPILOGUE + R"(
+#ifndef storage
+#define storage real
+#define LOAD(offset, p) (p)[offset]
+#endif
+
+__kernel void mmul(
+                const int M,
+                const int N,
+                const int K,
+                __global const storage* restrict A,
+                __global const storage* restrict B,
+                __global       real* restrict C,
+                __local        real* restrict Awrk,
+                __local        real* restrict Bwrk
+                EPILOGUE_ARGS)
+{
+    int kloc, Kblk;
+    real Ctmp=0;
+
+    //  This work-item will compute element C(j,i)
+    const int i = get_global_id(0);
+    const int j = get_global_id(1);
+
+    // C(j,i) is element C(jloc, iloc) of its block
+    const int iloc = get_local_id(0);
+    const int jloc = get_local_id(1);
+
+    // The last block along K may be partial
+    const int Num_BLK = (K+blksz-1)/blksz;
+
+    // C(Jblk,Iblk) = (sum over Kblk) A(Jblk,Kblk)*B(Kblk,Iblk)
+    for (Kblk = 0;  Kblk<Num_BLK;  Kblk++)
+    {
+       // Column of A and row of B loaded by this work-item
+       const int ka = Kblk*blksz+iloc;
+       const int kb = Kblk*blksz+jloc;
+
+       Awrk[jloc*blksz+iloc] = (j < M && ka < K) ? LOAD(j*K+ka, A) : 0;
+       Bwrk[jloc*blksz+iloc] = (kb < K && i < N) ? LOAD(kb*N+i, B) : 0;
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+
+       #pragma unroll
+       for (kloc=0; kloc<blksz; kloc++)
+          Ctmp += Awrk[jloc*blksz+kloc] * Bwrk[kloc*blksz+iloc];
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (j < M && i < N)
+#ifdef ACCUMULATE
+       C[j*N+i] += Ctmp;
+#else
+       STORE_C(C, j, i, N, Ctmp);
+#endif
 
 })";
 
+
+//-------------------------------------------------------------
+//
+//  Batched blocked multiplication of small matrices
+//
+//              C[b](M,N) = A[b](M,K) * B[b](K,N)
+//
+//  All the products of a batch are computed by one NDRange. The
+//  third dimension selects the product, the first two its block
+//  of C, so a product smaller than a block is one work-group.
+//  Loads and stores are guarded as in BLOCK_MULTIPLICATION_MNK.
+//
+//  The matrices of a batch live in single buffers. By default
+//  product b starts at b*strideA, b*strideB and b*strideC. With
+//  POINTER_ARRAY defined, offsets[3b], offsets[3b+1] and
+//  offsets[3b+2] give the start of A[b], B[b] and C[b] instead.
+//
+//-------------------------------------------------------------
+const std::string BLOCK_MULTIPLICATION_BATCHED = R"(
+__kernel void mmul(
+                const int M,
+                const int N,
+                const int K,
+                __global const float* restrict A,
+                __global const float* restrict B,
+                __global       float* restrict C,
+#ifdef POINTER_ARRAY
+                __global const int*   restrict offsets,
+#else
+                const int strideA,
+                const int strideB,
+                const int strideC,
+#endif
+                __local        float* restrict Awrk,
+                __local        float* restrict Bwrk)
+{
+    int kloc, Kblk;
+    float Ctmp=0.0f;
+
+    const int batch = get_global_id(2);
+#ifdef POINTER_ARRAY
+    const __global float* Ab = A + offsets[3*batch];
+    const __global float* Bb = B + offsets[3*batch+1];
+          __global float* Cb = C + offsets[3*batch+2];
+#else
+    const __global float* Ab = A + batch*strideA;
+    const __global float* Bb = B + batch*strideB;
+          __global float* Cb = C + batch*strideC;
+#endif
+
+    //  This work-item will compute element C(j,i) of its product
+    const int i = get_global_id(0);
+    const int j = get_global_id(1);
+
+    const int iloc = get_local_id(0);
+    const int jloc = get_local_id(1);
+
+    const int Num_BLK = (K+blksz-1)/blksz;
+
+    for (Kblk = 0;  Kblk<Num_BLK;  Kblk++)
+    {
+       const int ka = Kblk*blksz+iloc;
+       const int kb = Kblk*blksz+jloc;
+
+       Awrk[jloc*blksz+iloc] = (j < M && ka < K) ? Ab[j*K+ka] : 0.0f;
+       Bwrk[jloc*blksz+iloc] = (kb < K && i < N) ? Bb[kb*N+i] : 0.0f;
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+
+       #pragma unroll
+       for (kloc=0; kloc<blksz; kloc++)
+          Ctmp += Awrk[jloc*blksz+kloc] * Bwrk[kloc*blksz+iloc];
+
+       barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (j < M && i < N)
+       Cb[j*N+i] = Ctmp;
+
+})";
@@ -0,0 +1,135 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Device buffer pool
+//
+//  PURPOSE: Keeps device memory of a context alive between kernel variants.
+//
+//           Resident buffers hold named input operands. The first request
+//           for a name uploads the host vector, later requests with the same
+//           host storage return the uploaded buffer without a transfer.
+//           evict() forgets a name, e.g. after the host data was modified.
+//
+//           Temporaries are rounded up to a power of two and recycled by
+//           size bucket: a PooledBuffer returns its buffer to the pool when
+//           it goes out of scope, the next acquire() of the same bucket
+//           reuses it instead of calling the driver allocator.
+//
+//           In zero-copy mode, for devices sharing memory with the host,
+//           resident buffers and temporaries are allocated in host-visible
+//           memory (see zero_copy.hpp). A resident buffer is filled through
+//           a map rather than a transfer, the host vector is never aliased,
+//           so the host stays free to read and write it.
+//
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include "../common/cpp/cl.hpp"
+#include "../common/cpp/zero_copy.hpp"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+class BufferPool;
+
+class PooledBuffer {
+public:
+    PooledBuffer(BufferPool *pool, size_t bucket, cl::Buffer buffer) :
+            pool(pool), bucket(bucket), buffer(std::move(buffer)) {}
+
+    PooledBuffer(PooledBuffer &&other) noexcept:
+            pool(std::exchange(other.pool, nullptr)), bucket(other.bucket), buffer(std::move(other.buffer)) {}
+
+    PooledBuffer(const PooledBuffer &) = delete;
+
+    PooledBuffer &operator=(const PooledBuffer &) = delete;
+
+    ~PooledBuffer();
+
+    [[nodiscard]] cl::Buffer &get() { return buffer; }
+
+private:
+    BufferPool *pool;
+    size_t bucket;
+    cl::Buffer buffer;
+};
+
+class BufferPool {
+public:
+    explicit BufferPool(cl::Context context, bool zeroCopy = false) : context(std::move(context)), zeroCopy(zeroCopy) {}
+
+    // The device copy of a named read-only operand, uploaded through the queue on first use.
+    // upload receives the event of the transfer, it is left untouched when nothing was uploaded.
+    // In zero-copy mode the host copies the vector into the mapped buffer, upload is the map.
+    template<typename T, typename Allocator>
+    cl::Buffer &resident(cl::CommandQueue &queue, const std::string &name, const std::vector<T, Allocator> &host,
+                         cl::Event *upload = nullptr) {
+        const size_t bytes = sizeof(T) * host.size();
+        auto it = residents.find(name);
+        if (it != residents.end() && it->second.host == host.data() && it->second.bytes == bytes) {
+            return it->second.buffer;
+        }
+
+        cl::Buffer buffer;
+        if (zeroCopy) {
+            buffer = util::allocHostMemory(context, CL_MEM_READ_ONLY, bytes);
+            util::MappedBuffer<T> view(queue, buffer, CL_MAP_WRITE_INVALIDATE_REGION, host.size(), upload);
+            std::copy(host.begin(), host.end(), view.begin());
+        } else {
+            buffer = cl::Buffer(context, CL_MEM_READ_ONLY, bytes);
+            queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, bytes, host.data(), nullptr, upload);
+        }
+        auto &entry = residents[name];
+        entry = Resident{host.data(), bytes, std::move(buffer)};
+        return entry.buffer;
+    }
+
+    void evict(const std::string &name) {
+        residents.erase(name);
+    }
+
+    // A read-write temporary of at least the given size.
+    PooledBuffer acquire(size_t bytes) {
+        size_t bucket = 1;
+        while (bucket < bytes) bucket <<= 1;
+
+        auto &free = buckets[bucket];
+        if (!free.empty()) {
+            cl::Buffer buffer = std::move(free.back());
+            free.pop_back();
+            return {this, bucket, std::move(buffer)};
+        }
+        if (zeroCopy) return {this, bucket, util::allocHostMemory(context, CL_MEM_READ_WRITE, bucket)};
+        return {this, bucket, cl::Buffer(context, CL_MEM_READ_WRITE, bucket)};
+    }
+
+    void recycle(size_t bucket, cl::Buffer buffer) {
+        buckets[bucket].push_back(std::move(buffer));
+    }
+
+    // Releases every idle temporary.
+    void trim() {
+        buckets.clear();
+    }
+
+private:
+    struct Resident {
+        const void *host;
+        size_t bytes;
+        cl::Buffer buffer;
+    };
+
+    cl::Context context;
+    const bool zeroCopy;
+    std::map<std::string, Resident> residents;
+    std::map<size_t, std::vector<cl::Buffer>> buckets;
+};
+
+inline PooledBuffer::~PooledBuffer() {
+    if (pool != nullptr) {
+        pool->recycle(bucket, std::move(buffer));
+    }
+}
@@ -0,0 +1,198 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: GEMM epilogue
+//
+//  PURPOSE: What a product does with its result before storing it:
+//
+//              C = activation(alpha * A*B + beta * C + bias)
+//
+//           bias is a vector with one value per row or per column of C.
+//           Done after the product, every step is one more pass over C.
+//           Fused, it is applied to the accumulator of the kernel before
+//           the single store of C(row, col).
+//
+//           GEMM_EPILOGUE is put in front of the blocked and register
+//           tiled kernels, which store C through STORE_C. Without
+//           EPILOGUE defined it is a plain store and the kernels take the
+//           same arguments as before. With EPILOGUE they take alpha, beta
+//           and bias after their other arguments, and the defines of
+//           Epilogue::defines() choose the steps:
+//
+//             EPILOGUE_BETA         ... reads C, otherwise beta is ignored
+//                                       and C may hold anything
+//             EPILOGUE_BIAS_ROW     ... adds bias[row]
+//             EPILOGUE_BIAS_COLUMN  ... adds bias[col]
+//             ACTIVATION_RELU, ACTIVATION_SIGMOID, ACTIVATION_TANH
+//
+//           Without a bias the bias argument may be a null buffer.
+//
+//           EPILOGUE_PASSES has the same steps as separate kernels, the
+//           multi-pass path the fused one is compared with.
+//
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+const std::string GEMM_EPILOGUE = R"(
+#ifndef real
+#define real float
+#endif
+
+inline real activate(const real x)
+{
+#if defined(ACTIVATION_RELU)
+    return fmax(x, (real)0);
+#elif defined(ACTIVATION_SIGMOID)
+    return 1 / (1 + exp(-x));
+#elif defined(ACTIVATION_TANH)
+    return tanh(x);
+#else
+    return x;
+#endif
+}
+
+#ifdef EPILOGUE
+
+#define EPILOGUE_ARGS , const real alpha, const real beta, __global const real* restrict bias
+
+inline real epilogue(const real acc, __global const real* C, const int row, const int col, const int ld,
+                     const real alpha, const real beta, __global const real* bias)
+{
+    real value = alpha * acc;
+#ifdef EPILOGUE_BETA
+    value += beta * C[row*ld + col];
+#endif
+#if defined(EPILOGUE_BIAS_ROW)
+    value += bias[row];
+#elif defined(EPILOGUE_BIAS_COLUMN)
+    value += bias[col];
+#endif
+    return activate(value);
+}
+
+#define STORE_C(C, row, col, ld, acc) C[(row)*(ld) + (col)] = epilogue(acc, C, row, col, ld, alpha, beta, bias)
+
+#else
+
+#define EPILOGUE_ARGS
+#define STORE_C(C, row, col, ld, acc) C[(row)*(ld) + (col)] = (acc)
+
+#endif
+)";
+
+// One pass each: C = alpha*P + beta*C, C += bias, C = activation(C). Needs GEMM_EPILOGUE in front.
+const std::string EPILOGUE_PASSES = R"(
+__kernel void scale(
+                const int count,
+                const real alpha,
+                const real beta,
+                __global const real* restrict P,
+                __global       real* restrict C)
+{
+    const int i = get_global_id(0);
+    if (i < count)
+#ifdef EPILOGUE_BETA
+        C[i] = alpha * P[i] + beta * C[i];
+#else
+        C[i] = alpha * P[i];
+#endif
+}
+
+__kernel void add_bias(
+                const int M,
+                const int N,
+                __global const real* restrict bias,
+                __global       real* restrict C)
+{
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+    if (row < M && col < N)
+#ifdef EPILOGUE_BIAS_ROW
+        C[row*N + col] += bias[row];
+#else
+        C[row*N + col] += bias[col];
+#endif
+}
+
+__kernel void activation(
+                const int count,
+                __global real* restrict C)
+{
+    const int i = get_global_id(0);
+    if (i < count)
+        C[i] = activate(C[i]);
+}
+)";
+
+enum class BiasMode { None, PerRow, PerColumn };
+
+enum class Activation { None, Relu, Sigmoid, Tanh };
+
+// The steps of an epilogue. The default one stores the product as it is.
+struct Epilogue {
+    double alpha = 1.0;
+    double beta = 0.0;
+    BiasMode bias = BiasMode::None;
+    Activation activation = Activation::None;
+
+    [[nodiscard]] bool isIdentity() const {
+        return alpha == 1.0 && beta == 0.0 && bias == BiasMode::None && activation == Activation::None;
+    }
+
+    // Defines selecting the fused steps, empty for the identity.
+    [[nodiscard]] std::string defines() const {
+        if (isIdentity()) return "";
+        std::string defines = "#define EPILOGUE\n";
+        if (beta != 0.0) defines += "#define EPILOGUE_BETA\n";
+        if (bias == BiasMode::PerRow) defines += "#define EPILOGUE_BIAS_ROW\n";
+        if (bias == BiasMode::PerColumn) defines += "#define EPILOGUE_BIAS_COLUMN\n";
+        if (activation == Activation::Relu) defines += "#define ACTIVATION_RELU\n";
+        if (activation == Activation::Sigmoid) defines += "#define ACTIVATION_SIGMOID\n";
+        if (activation == Activation::Tanh) defines += "#define ACTIVATION_TANH\n";
+        return defines;
+    }
+
+    [[nodiscard]] std::string name() const {
+        const char *biases[] = {"no bias", "row bias", "column bias"};
+        const char *activations[] = {"identity", "relu", "sigmoid", "tanh"};
+        char text[128];
+        snprintf(text, sizeof(text), "alpha %g, beta %g, %s, %s", alpha, beta,
+                 biases[static_cast<int>(bias)], activations[static_cast<int>(activation)]);
+        return text;
+    }
+};
+
+// Host reference: C(M,N) = activation(alpha * P + beta * C + bias) for the product P.
+template<typename T>
+void applyEpilogue(const Epilogue &epilogue, int M, int N,
+                   const std::vector<T> &P, const std::vector<T> &bias, std::vector<T> &C) {
+    for (int row = 0; row < M; row++) {
+        for (int col = 0; col < N; col++) {
+            const size_t at = static_cast<size_t>(row) * N + col;
+            T value = static_cast<T>(epilogue.alpha) * P[at];
+            if (epilogue.beta != 0.0) value += static_cast<T>(epilogue.beta) * C[at];
+            if (epilogue.bias == BiasMode::PerRow) value += bias[row];
+            if (epilogue.bias == BiasMode::PerColumn) value += bias[col];
+            switch (epilogue.activation) {
+                case Activation::Relu:
+                    value = std::max(value, T(0));
+                    break;
+                case Activation::Sigmoid:
+                    value = 1 / (1 + std::exp(-value));
+                    break;
+                case Activation::Tanh:
+                    value = std::tanh(value);
+                    break;
+                case Activation::None:
+                    break;
+            }
+            C[at] = value;
+        }
+    }
+}
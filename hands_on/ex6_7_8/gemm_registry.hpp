@@ -0,0 +1,224 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Registry of the square matrix multiplication kernels
+//
+//  PURPOSE: A variant is a kernel mmul(A, B, C, ...) for C = A * B of order
+//           n, with everything needed to decide whether and how it runs:
+//
+//             launch(n)   ... its complete source (with the #define prefix),
+//                             NDRange and __local arguments for the order,
+//                             nothing if the variant can't do the order
+//             extensions  ... the OpenCL extensions it needs
+//
+//           The work-group and the local memory a launch asks for are
+//           compared with CL_DEVICE_MAX_WORK_ITEM_SIZES and
+//           CL_DEVICE_LOCAL_MEM_SIZE, and once built with the
+//           CL_KERNEL_WORK_GROUP_SIZE and CL_KERNEL_LOCAL_MEM_SIZE of the
+//           kernel. A kernel with large private arrays may allow no more
+//           than a single work-item per work-group on a CPU, which is
+//           only known after the build.
+//
+//           A GemmDispatcher holds the variants of a registry that a device
+//           runs, built on first use. Times are recorded per variant and
+//           order, by the benchmark or from the tuning database, and gemm()
+//           runs the fastest recorded one. When none was timed yet it runs
+//           the last one that runs: a registry lists its variants from the
+//           simplest to the most elaborate.
+//           A dispatcher isn't thread safe, it shares the kernel objects.
+//
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include "../common/cpp/cl.hpp"
+#include "../common/cpp/program_cache.hpp"
+#include "scalar_type.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct GemmLaunch {
+    std::string source;
+    cl::NDRange global;
+    cl::NDRange local;               // cl::NullRange lets the runtime choose
+    std::vector<size_t> localArgs;   // sizes in bytes of the __local arguments after A, B and C
+};
+
+struct GemmVariant {
+    std::string name;
+    std::function<std::optional<GemmLaunch>(size_t n)> launch;
+    std::vector<std::string> extensions = {};
+};
+
+// Why the device can't run a launch of kernel, nothing if it can. Without a kernel only the
+// device limits are checked, so it can be called before building.
+inline std::optional<std::string> launchMisfit(const cl::Device &device, const cl::Kernel *kernel,
+                                               const cl::NDRange &local, const std::vector<size_t> &localArgs) {
+    size_t workGroupSize = 1;
+    const auto maxItemSizes = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    for (size_t d = 0; d < local.dimensions(); d++) {
+        if (local[d] > maxItemSizes[d]) {
+            return "a work-group of " + std::to_string(local[d]) + " along dimension " + std::to_string(d) +
+                   ", the device allows " + std::to_string(maxItemSizes[d]);
+        }
+        workGroupSize *= local[d];
+    }
+
+    cl_ulong localMem = 0;
+    for (size_t bytes: localArgs) localMem += bytes;
+    if (kernel != nullptr) {
+        const size_t allowed = kernel->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+        if (local.dimensions() > 0 && workGroupSize > allowed) {
+            return "a work-group of " + std::to_string(workGroupSize) + ", the kernel allows " +
+                   std::to_string(allowed);
+        }
+        localMem += kernel->getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+    }
+    if (localMem > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()) {
+        return std::to_string(localMem) + " bytes of local memory, the device has " +
+               std::to_string(device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>());
+    }
+    return std::nullopt;
+}
+
+class GemmRegistry {
+public:
+    void add(GemmVariant variant) { entries.push_back(std::move(variant)); }
+
+    [[nodiscard]] const std::vector<GemmVariant> &variants() const { return entries; }
+
+private:
+    std::vector<GemmVariant> entries;
+};
+
+class GemmDispatcher {
+public:
+    struct Skipped {
+        std::string variant;
+        std::string reason;
+    };
+
+    GemmDispatcher(GemmRegistry registry, cl::Context context, cl::Device device) :
+            registry(std::move(registry)), context(std::move(context)), device(std::move(device)) {}
+
+    // The variants the device runs for order n, in registry order. Those it can't are added to skipped.
+    std::vector<const GemmVariant *> runnable(size_t n, std::vector<Skipped> *skipped = nullptr) {
+        std::vector<const GemmVariant *> variants;
+        for (const auto &variant: registry.variants()) {
+            const auto &prepared = prepare(variant, n);
+            if (prepared.kernel) variants.push_back(&variant);
+            else if (skipped != nullptr) skipped->push_back({variant.name, prepared.reason});
+        }
+        return variants;
+    }
+
+    // Enqueues a variant the device runs for order n, returns the kernel event.
+    cl::Event enqueue(cl::CommandQueue &queue, const GemmVariant &variant, size_t n,
+                      const cl::Buffer &A, const cl::Buffer &B, const cl::Buffer &C) {
+        auto &prepared = prepare(variant, n);
+        if (!prepared.kernel) {
+            throw std::invalid_argument("'" + variant.name + "' can't run here: " + prepared.reason);
+        }
+        auto &kernel = *prepared.kernel;
+        kernel.setArg(0, A);
+        kernel.setArg(1, B);
+        kernel.setArg(2, C);
+        const auto &launch = prepared.launch;
+        for (size_t i = 0; i < launch.localArgs.size(); i++) {
+            kernel.setArg(static_cast<cl_uint>(3 + i), cl::Local(launch.localArgs[i]));
+        }
+        cl::Event event;
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, launch.global, launch.local, nullptr, &event);
+        return event;
+    }
+
+    void record(const std::string &variant, size_t n, double seconds) { timings[{variant, n}] = seconds; }
+
+    [[nodiscard]] std::optional<double> recorded(const std::string &variant, size_t n) const {
+        auto found = timings.find({variant, n});
+        if (found == timings.end()) return std::nullopt;
+        return found->second;
+    }
+
+    // The fastest recorded variant for order n, the last one that runs if none was recorded,
+    // nullptr if the device runs none.
+    const GemmVariant *select(size_t n) {
+        const auto variants = runnable(n);
+        if (variants.empty()) return nullptr;
+        const GemmVariant *best = variants.back();
+        std::optional<double> bestSeconds;
+        for (const auto *variant: variants) {
+            const auto seconds = recorded(variant->name, n);
+            if (seconds && (!bestSeconds || *seconds < *bestSeconds)) {
+                best = variant;
+                bestSeconds = seconds;
+            }
+        }
+        return best;
+    }
+
+    // C = A * B of order n with the selected variant, returns the kernel event.
+    cl::Event gemm(cl::CommandQueue &queue, size_t n, const cl::Buffer &A, const cl::Buffer &B, const cl::Buffer &C) {
+        const GemmVariant *variant = select(n);
+        if (variant == nullptr) {
+            throw std::runtime_error("No matrix multiplication variant runs order " + std::to_string(n));
+        }
+        return enqueue(queue, *variant, n, A, B, C);
+    }
+
+private:
+    struct Prepared {
+        std::optional<cl::Kernel> kernel;    // set if the device runs it
+        GemmLaunch launch;
+        std::string reason;                  // why not otherwise
+    };
+
+    Prepared &prepare(const GemmVariant &variant, size_t n) {
+        const auto key = std::make_pair(variant.name, n);
+        auto found = prepared.find(key);
+        if (found != prepared.end()) return found->second;
+
+        Prepared entry;
+        const auto launch = variant.launch(n);
+        if (!launch) {
+            entry.reason = "order " + std::to_string(n) + " not supported";
+            return prepared[key] = entry;
+        }
+        entry.launch = *launch;
+
+        for (const auto &extension: variant.extensions) {
+            if (!hasExtension(device, extension)) {
+                entry.reason = "needs " + extension;
+                return prepared[key] = entry;
+            }
+        }
+        if (auto misfit = launchMisfit(device, nullptr, launch->local, launch->localArgs)) {
+            entry.reason = "needs " + *misfit;
+            return prepared[key] = entry;
+        }
+
+        try {
+            cl::Kernel kernel(util::buildProgram(context, launch->source), "mmul");
+            if (auto misfit = launchMisfit(device, &kernel, launch->local, launch->localArgs)) {
+                entry.reason = "needs " + *misfit;
+            } else {
+                entry.kernel = kernel;
+            }
+        } catch (cl::Error &err) {
+            entry.reason = std::string("fails to build, ") + err.what();
+        }
+        return prepared[key] = entry;
+    }
+
+    const GemmRegistry registry;
+    cl::Context context;
+    cl::Device device;
+    std::map<std::pair<std::string, size_t>, Prepared> prepared;
+    std::map<std::pair<std::string, size_t>, double> timings;
+};
@@ -0,0 +1,114 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Matrix-vector products and rank-1 update
+//
+//  PURPOSE: The level-2 operations on a row-major A(M,N):
+//
+//             gemv_n ... y(M) = alpha * A * x + beta * y
+//             gemv_t ... y(N) = alpha * A^T * x + beta * y
+//             ger    ... A += alpha * x(M) * y(N)^T
+//
+//           Every element of A is used once, so they're bound by the
+//           bandwidth of global memory and are written to read A with
+//           consecutive work-items at consecutive addresses.
+//
+//           gemv_n runs a work-group per row of A. Its GEMV_GROUP
+//           work-items stride along the row together and add up their
+//           partial sums in local memory, GEMV_GROUP is a power of two.
+//
+//           In gemv_t every element of y sums down a column, which a
+//           work-item per column would read with a stride of N. Instead a
+//           work-group owns GEMV_TILE adjacent columns, and its GEMV_LANES
+//           rows of work-items take every GEMV_LANES-th row of A, so each
+//           row of work-items reads GEMV_TILE consecutive floats. The lanes
+//           then add up their sums per column in local memory.
+//
+//           With beta == 0, y is only written and may hold anything.
+//
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <string>
+
+const std::string GEMV_N = R"(
+__kernel void gemv_n(
+                const int M,
+                const int N,
+                const float alpha,
+                const float beta,
+                __global const float* restrict A,
+                __global const float* restrict x,
+                __global       float* restrict y,
+                __local        float* restrict partial)
+{
+    const int row = get_group_id(0);
+    const int lid = get_local_id(0);
+
+    float sum = 0.0f;
+    if (row < M) {
+        __global const float* a = A + (size_t)row * N;
+        for (int col = lid; col < N; col += GEMV_GROUP)
+            sum += a[col] * x[col];
+    }
+    partial[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = GEMV_GROUP / 2; stride > 0; stride /= 2) {
+        if (lid < stride)
+            partial[lid] += partial[lid + stride];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0 && row < M)
+        y[row] = beta == 0.0f ? alpha * partial[0] : alpha * partial[0] + beta * y[row];
+}
+)";
+
+const std::string GEMV_T = R"(
+__kernel void gemv_t(
+                const int M,
+                const int N,
+                const float alpha,
+                const float beta,
+                __global const float* restrict A,
+                __global const float* restrict x,
+                __global       float* restrict y)
+{
+    __local float partial[GEMV_LANES][GEMV_TILE];
+
+    const int col = get_global_id(0);
+    const int tid = get_local_id(0);
+    const int lane = get_local_id(1);
+
+    float sum = 0.0f;
+    if (col < N) {
+        for (int row = lane; row < M; row += GEMV_LANES)
+            sum += A[(size_t)row * N + col] * x[row];
+    }
+    partial[lane][tid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lane == 0 && col < N) {
+        for (int l = 1; l < GEMV_LANES; l++)
+            sum += partial[l][tid];
+        y[col] = beta == 0.0f ? alpha * sum : alpha * sum + beta * y[col];
+    }
+}
+)";
+
+const std::string GER = R"(
+__kernel void ger(
+                const int M,
+                const int N,
+                const float alpha,
+                __global const float* restrict x,
+                __global const float* restrict y,
+                __global       float* restrict A)
+{
+    const int col = get_global_id(0);
+    const int row = get_global_id(1);
+    if (row < M && col < N)
+        A[(size_t)row * N + col] += alpha * x[row] * y[col];
+}
+)";
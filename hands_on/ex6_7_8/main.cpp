@@ -9,6 +9,9 @@
 //
 //           A and B are set to constant matrices so we
 //           can make a quick test of the multiplication.
+//           With --random they hold random values instead,
+//           and the products are checked with Freivalds'
+//           algorithm.
 //
 //------------------------------------------------------------------------------
 
@@ -18,18 +21,52 @@
 
 #include "matrix_lib.hpp"
 #include "block_mmul.hpp"
+#include "register_mmul.hpp"
+#include "tuner.hpp"
+#include "gemm_registry.hpp"
+#include "buffer_pool.hpp"
+#include "sparse_lib.hpp"
 #include "../common/cpp/util.hpp"
 #include "../common/cpp/device_picker.hpp"
+#include "../common/cpp/program_cache.hpp"
+#include "../common/cpp/profiling.hpp"
+#include "../common/cpp/benchmark.hpp"
+#include "../common/cpp/roofline.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <clblast.h>
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <limits>
+#include <optional>
+#include <random>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
 #include <vector>
 
-const size_t N = 1920;        // A[N][N], B[N][N], C[N][N]
-const size_t size = N * N;    // Number of elements in each matrix
-const size_t ITERATIONS = 5;
+// Order of the square products, --order or MATRIX_ORDER, 1920 by default. It's put in
+// the kernel sources as a constant, so it must be a multiple of every block and tile: 64.
+size_t N = 1920;              // A[N][N], B[N][N], C[N][N]
+size_t size = N * N;          // Number of elements in each matrix
+
+const int STRASSEN_MIN_CUTOFF = 256;  // Smallest cutoff of the device Strassen products
+
+// Order of the product streamed from files, --out-of-core, 4 n^2 bytes per matrix file.
+// 0 by default, which skips the product.
+int outOfCoreN = 0;
+const size_t OUT_OF_CORE_BYTES = 96 << 20;      // Device memory the out-of-core product may use
+
+const int SPARSE_ROWS = 1 << 20;  // Order of the sparse matrices
+const int SPARSE_WIDTH = 16;      // Columns of the dense matrices of the sparse SpMM
+const int SELL_SIGMA = 256;       // Rows sorted together for SELL-C-σ
+const int GEMV_ORDER = 4096;      // Order of the matrix of the GEMV and rank-1 update
+
+// Orders of a stream of products served by SquareGemm, some repeated, some seen once.
+const int SERVED_ORDERS[] = {512, 1000, 512, 768, 512, 777, 768, 1024, 512, 1024, 768, 1024};
 
 // Exercise 6. Simple
 const std::string CELL_PER_WORK_ITEM = R"(
@@ -68,6 +105,43 @@ __kernel void mmul(
     }
 })";
 
+// Exercise 6 with B transposed, so both A and Bt are read along rows.
+const std::string CELL_PER_WORK_ITEM_TRANSPOSED_B = R"(
+__kernel void mmul(
+   __global float* A,
+   __global float* Bt,
+   __global float* C) {
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+
+    if (i < N && j <N) {
+        float tmp = 0.0f;
+        for (int k = 0; k < N; k++) {
+            tmp += A[i * N + k] * Bt[j * N + k];
+        }
+        C[i * N + j] = tmp;
+    }
+})";
+
+// Exercise 7 with B transposed.
+const std::string ROW_PER_WORK_ITEM_TRANSPOSED_B = R"(
+__kernel void mmul(
+    __global float* A,
+    __global float* Bt,
+    __global float* C) {
+    int i = get_global_id(0);
+
+    if (i < N) {
+        for (int j = 0; j < N; j++) {
+            float tmp = 0.0f;
+            for (int k = 0; k < N; k++) {
+                tmp += A[i * N + k] * Bt[j * N + k];
+            }
+            C[i * N + j] = tmp;
+        }
+    }
+})";
+
 // Exercise 7. Row per work item with private memory
 const std::string ROW_PER_WORK_ITEM_PRIVATE_ROW = R"(
 __kernel void mmul(
@@ -128,206 +202,1099 @@ __kernel void mmul(
 
 class ClContext {
 public:
-    explicit ClContext(size_t deviceIndex) : device(getDeviceList()[deviceIndex]) {}
+    // With profiling every queue records device timestamps of its commands, see report().
+    // Zero copy is used when allowed and the device shares memory with the host.
+    explicit ClContext(size_t deviceIndex, bool profiling = false, bool allowZeroCopy = true) :
+            device(getDeviceList()[deviceIndex]),
+            profiling(profiling),
+            zeroCopy(allowZeroCopy && util::hasHostUnifiedMemory(device)) {}
 
     [[nodiscard]] cl::CommandQueue createQueue() const {
-        return {context, device};
+        const cl_command_queue_properties properties = profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+        return {context, device, properties};
     }
 
+    [[nodiscard]] bool isProfiling() const { return profiling; }
+
+    [[nodiscard]] bool isZeroCopy() const { return zeroCopy; }
+
     [[nodiscard]] const cl::Context &getContext() const { return context; }
 
+    [[nodiscard]] const cl::Device &getDevice() const { return device; }
+
     [[nodiscard]] const char *getName() const { return deviceName.c_str(); }
 
+    // Device copy of an input operand shared by all variants, uploaded once.
+    template<typename T, typename Allocator>
+    [[nodiscard]] cl::Buffer &resident(cl::CommandQueue &queue, const std::string &name,
+                                       const std::vector<T, Allocator> &host) const {
+        cl::Event upload;
+        auto &buffer = pool.resident(queue, name, host, &upload);
+        if (upload() != nullptr) report("write " + name, upload);
+        return buffer;
+    }
+
+    // Forgets a resident operand, e.g. after its host vector was modified.
+    void evict(const std::string &name) const {
+        pool.evict(name);
+    }
+
+    // Prints the timestamps of a command enqueued on a queue of this context.
+    void report(const std::string &label, const cl::Event &event) const {
+        if (profiling) util::printEventTimes(label, util::eventTimes(event));
+    }
+
+    // Temporary device buffer, recycled when the returned handle is destroyed.
+    [[nodiscard]] PooledBuffer acquire(size_t bytes) const {
+        return pool.acquire(bytes);
+    }
+
+    // Device buffer for a result read back into host with readBack().
+    // With zero copy it is the storage of host itself, which the host must only touch while
+    // the buffer is mapped.
+    [[nodiscard]] PooledBuffer output(HostMatrix &host) const {
+        if (!zeroCopy) return pool.acquire(sizeof(float) * host.size());
+        return {nullptr, 0, util::wrapHostMemory(context, CL_MEM_WRITE_ONLY, host)};
+    }
+
+    // Zeroes a buffer from output() on the device, so a kernel that writes nothing is caught.
+    // The host copy is left alone, it may be the unmapped storage of the buffer.
+    void clear(cl::CommandQueue &queue, const cl::Buffer &buffer, const HostMatrix &host) const {
+        queue.enqueueFillBuffer(buffer, 0.0f, 0, sizeof(float) * host.size());
+        queue.finish();
+    }
+
+    // Brings host up to date with a buffer from output(): a copy, or with zero copy a map kept
+    // in view. host holds the result as long as view is open, reset view before the buffer is
+    // used again.
+    void readBack(cl::CommandQueue &queue, const cl::Buffer &buffer, HostMatrix &host,
+                  std::optional<util::MappedBuffer<float>> &view, cl::Event *event) const {
+        if (zeroCopy) {
+            view.emplace(queue, buffer, CL_MAP_READ, host.size(), event);
+        } else {
+            queue.enqueueReadBuffer(buffer, CL_TRUE, 0, sizeof(float) * host.size(), host.data(), nullptr, event);
+        }
+    }
+
 private:
     const cl::Device device;
+    const bool profiling;
+    const bool zeroCopy;
     const std::string deviceName = getDeviceName(device);
     const cl::Context context{device};
+    // Caches device memory, so it doesn't change the observable state of the context.
+    mutable BufferPool pool{context, zeroCopy};
 };
 
-void multiplyCpuSimple(std::vector<float> &h_A, std::vector<float> &h_B, std::vector<float> &h_C) {
-    printf("Sequential, matrix mul (dot prod), order %zu on host CPU,\t", N);
-    zero_mat(N, h_C);
-    util::Timer timer;
-    double start_time = static_cast<double>(timer.getTimeMilliseconds()) / 1000.0;
+// Arithmetic intensity of C(M,N) = A(M,K) * B(K,N) if every matrix is moved once,
+// the least traffic a product can have.
+double gemmIntensity(double M, double N, double K, size_t element = sizeof(float)) {
+    return 2.0 * M * N * K / (static_cast<double>(element) * (M * K + K * N + M * N));
+}
+
+// Work of a square product of order N, the rate is reported in GFLOPS.
+util::BenchmarkCase squareCase(const std::string &device, const std::string &variant, size_t element = sizeof(float)) {
+    return {device, variant, std::to_string(N), "GFLOPS", 2.0 * N * N * N, gemmIntensity(N, N, N, element)};
+}
+
+// A timed iteration of an OpenCL variant. With profiling the kernel time is taken from its event.
+util::BenchmarkSample sample(const ClContext &clContext, double run_time, const cl::Event &kernel) {
+    if (!clContext.isProfiling()) return {run_time, std::nullopt};
+    return {run_time, util::eventTimes(kernel).seconds()};
+}
+
+// With --random, A and B hold random values instead of the constants of initmat, and
+// their products are checked with Freivalds' algorithm instead of error().
+struct RandomInputs {
+    const HostMatrix *A = nullptr;
+    const HostMatrix *B = nullptr;
+} randomInputs;
+
+// Checks a product of the main A and B, prints nothing if correct.
+void checkProduct(HostMatrix &h_C, double tolerance = 1e-5) {
+    if (randomInputs.A == nullptr) {
+        check(N, h_C);
+        return;
+    }
+    const auto result = freivalds(N, N, N, randomInputs.A->data(), randomInputs.B->data(), h_C.data(), 2, tolerance);
+    if (!result.passed)
+        printf("\n Freivalds check failed, deviation %g\n", result.deviation);
+}
+
+// Checks the product of the last iteration. With profiling the timestamps of
+// its kernel and of the read back of C are listed as well.
+void verify(const ClContext &clContext, HostMatrix &h_C, const cl::Event &kernel, const cl::Event &read) {
+    checkProduct(h_C);
+    clContext.report("kernel", kernel);
+    clContext.report("read C", read);
+}
+
+double elapsedSeconds(util::Timer &timer) {
+    return static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+}
+
+// Uniform values in [-1, 1). error() only sees the constant inputs of initmat,
+// where most Strassen intermediates vanish, so accuracy is also compared on these.
+std::vector<float> randomMatrix(size_t elements, unsigned seed) {
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+    std::vector<float> matrix(elements);
+    for (auto &value: matrix) value = distribution(generator);
+    return matrix;
+}
 
-    seq_mat_mul_sdot(N, h_A, h_B, h_C);
+// Largest deviation from the reference product, relative to its largest element.
+double maxRelativeDeviation(const std::vector<float> &C, const std::vector<float> &reference) {
+    double deviation = 0.0, scale = 0.0;
+    for (size_t i = 0; i < C.size(); i++) {
+        deviation = std::max(deviation, static_cast<double>(std::fabs(C[i] - reference[i])));
+        scale = std::max(scale, static_cast<double>(std::fabs(reference[i])));
+    }
+    return scale > 0.0 ? deviation / scale : deviation;
+}
 
-    double run_time = (static_cast<double>(timer.getTimeMilliseconds()) / 1000.0) - start_time;
-    results(N, h_C, run_time);
+void multiplyCpuSimple(util::BenchmarkRunner &bench,
+                       HostMatrix &h_A, HostMatrix &h_B, HostMatrix &h_C) {
+    printf("Sequential, matrix mul (dot prod), order %zu on host CPU,\t", N);
+    // Takes seconds per run, measured once.
+    bench.measure(squareCase("host", "Sequential (dot prod)"), [&]() -> util::BenchmarkSample {
+        zero_mat(N, h_C);
+        util::Timer timer;
+        seq_mat_mul_sdot(N, h_A, h_B, h_C);
+        return {elapsedSeconds(timer), std::nullopt};
+    }, 0, 1);
+    checkProduct(h_C);
     printf("\n");
 }
 
-void multiplyCpuBetterSimple(std::vector<float> &h_A, std::vector<float> &h_B, std::vector<float> &h_C) {
+void multiplyCpuBetterSimple(util::BenchmarkRunner &bench,
+                             HostMatrix &h_A, HostMatrix &h_B, HostMatrix &h_C) {
     printf("Better sequential, matrix mul (dot prod), order %zu on host CPU,\t", N);
-    zero_mat(N, h_C);
-    util::Timer timer;
-    double start_time = static_cast<double>(timer.getTimeMilliseconds()) / 1000.0;
-
-    better_seq_mat_mul_sdot(N, h_A, h_B, h_C);
+    bench.measure(squareCase("host", "Better sequential (dot prod)"), [&]() -> util::BenchmarkSample {
+        zero_mat(N, h_C);
+        util::Timer timer;
+        better_seq_mat_mul_sdot(N, h_A, h_B, h_C);
+        return {elapsedSeconds(timer), std::nullopt};
+    }, 0, 1);
+    checkProduct(h_C);
+    printf("\n");
+}
 
-    double run_time = (static_cast<double>(timer.getTimeMilliseconds()) / 1000.0) - start_time;
-    results(N, h_C, run_time);
+void multiplyCpuPacked(util::BenchmarkRunner &bench,
+                       HostMatrix &h_A, HostMatrix &h_B, HostMatrix &h_C) {
+    const std::string name = std::string("Packed parallel (") + host_sgemm_kernel_name() + ")";
+    printf("%s, matrix mul, order %zu on host CPU,\t", name.c_str(), N);
+    bench.measure(squareCase("host", name), [&]() -> util::BenchmarkSample {
+        zero_mat(N, h_C);
+        util::Timer timer;
+        par_mat_mul_packed(N, h_A, h_B, h_C);
+        return {elapsedSeconds(timer), std::nullopt};
+    });
+    checkProduct(h_C);
     printf("\n");
 }
 
-void multiplyCL(const ClContext &clContext,
-                const std::string &name,
-                const std::string &kernelCode,
-                const std::function<cl::EnqueueArgs(cl::CommandQueue &)> &createArgs,
-                std::vector<float> &h_A,
-                std::vector<float> &h_B,
-                std::vector<float> &h_C) {
-    printf("OpenCL, matrix mul '%s', order %zu,\t",
-           name.c_str(),
-           N);
+// Cost of Freivalds' check of the last host product, and whether it catches one
+// element of C off by 1%. The rate is the bandwidth of the check: it reads A, B and C
+// once per round.
+void checkFreivalds(util::BenchmarkRunner &bench,
+                    const HostMatrix &h_A, const HostMatrix &h_B, HostMatrix &h_C) {
+    const int rounds = 2;
+    FreivaldsResult result{};
+    printf("Freivalds check, %d rounds, order %zu on host CPU,\t", rounds, N);
+    bench.measure({"host", "Freivalds check", std::to_string(N), "GB/s", 3.0 * rounds * sizeof(float) * size},
+                  [&]() -> util::BenchmarkSample {
+        util::Timer timer;
+        result = freivalds(N, N, N, h_A.data(), h_B.data(), h_C.data(), rounds);
+        return {elapsedSeconds(timer), std::nullopt};
+    });
+
+    const size_t wrong = size / 2 + N / 3;
+    const float saved = h_C[wrong];
+    h_C[wrong] = saved * 1.01f;
+    const auto faulty = freivalds(N, N, N, h_A.data(), h_B.data(), h_C.data(), rounds);
+    h_C[wrong] = saved;
+    printf(" deviation %g (%s), an element off by 1%%: deviation %g (%s)\n",
+           result.deviation, result.passed ? "passed" : "failed",
+           faulty.deviation, faulty.passed ? "missed" : "caught");
+}
+
+// Strassen-Winograd on the host for a few cutoffs, the cutoff N being the packed product itself.
+void multiplyCpuStrassen(util::BenchmarkRunner &bench,
+                         HostMatrix &h_A, HostMatrix &h_B, HostMatrix &h_C) {
+    const auto r_A = randomMatrix(size, 1), r_B = randomMatrix(size, 2);
+    std::vector<float> reference(size), r_C(size);
+    host_sgemm(N, N, N, r_A.data(), N, r_B.data(), N, reference.data(), N);
+
+    double baseline = 0.0;
+    for (int cutoff: {static_cast<int>(N), static_cast<int>(N) / 2, static_cast<int>(N) / 4}) {
+        const std::string name = "Strassen, cutoff " + std::to_string(cutoff);
+        printf("%s, matrix mul, order %zu on host CPU,\t", name.c_str(), N);
+        const auto record = bench.measure(squareCase("host", name), [&]() -> util::BenchmarkSample {
+            zero_mat(N, h_C);
+            util::Timer timer;
+            host_strassen(N, h_A.data(), N, h_B.data(), N, h_C.data(), N, cutoff);
+            return {elapsedSeconds(timer), std::nullopt};
+        });
+        if (baseline == 0.0) baseline = record.wall.median;
+
+        checkProduct(h_C);
+        host_strassen(N, r_A.data(), N, r_B.data(), N, r_C.data(), N, cutoff);
+        printf(" speedup %.2f, max relative deviation %g\n",
+               baseline / record.wall.median, maxRelativeDeviation(r_C, reference));
+    }
+    printf("\n");
+}
 
+// Returns the median seconds of C = A * B of order N enqueued by enqueue(queue, A, B, C).
+// nameB is the resident name of the second operand.
+double multiplyCL(util::BenchmarkRunner &bench,
+                  const ClContext &clContext,
+                  const std::string &name,
+                  const std::function<cl::Event(cl::CommandQueue &, const cl::Buffer &, const cl::Buffer &,
+                                                const cl::Buffer &)> &enqueue,
+                  HostMatrix &h_A,
+                  HostMatrix &h_B,
+                  HostMatrix &h_C,
+                  const std::string &nameB = "B") {
     auto queue = clContext.createQueue();
-    auto &context = clContext.getContext();
 
-    // N is defined instead of being passed as a parameter.
-    // GPU kernels do not allow variable length arrays.
-    std::string kernel = "#define N " + std::to_string(N) + "\n" + kernelCode;
-    cl::Program program(context, kernel, true);
+    auto &d_a = clContext.resident(queue, "A", h_A);
+    auto &d_b = clContext.resident(queue, nameB, h_B);
+    auto c_buffer = clContext.output(h_C);
+    auto &d_c = c_buffer.get();
+    std::optional<util::MappedBuffer<float>> c_view;
+
+    cl::Event kernel, read;
+    printf("OpenCL, matrix mul '%s', order %zu,\t", name.c_str(), N);
+    const auto record = bench.measure(squareCase(clContext.getName(), name), [&]() {
+        c_view.reset();
+        clContext.clear(queue, d_c, h_C);
+        util::Timer timer;
 
-    auto d_a = cl::Buffer(context, h_A.begin(), h_A.end(), true);
-    auto d_b = cl::Buffer(context, h_B.begin(), h_B.end(), true);
-    auto d_c = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * size);
+        kernel = enqueue(queue, d_a, d_b, d_c);
 
-    auto mmul = cl::KernelFunctor<cl::Buffer &, cl::Buffer &, cl::Buffer &>(program, "mmul");
+        queue.finish();
 
-    zero_mat(N, h_C);
-    util::Timer timer;
-    double start_time = static_cast<double>(timer.getTimeMilliseconds()) / 1000.0;
+        double run_time = elapsedSeconds(timer);
+        clContext.readBack(queue, d_c, h_C, c_view, &read);
+        return sample(clContext, run_time, kernel);
+    });
+    verify(clContext, h_C, kernel, read);
+    return record.wall.median;
+}
 
-    mmul(createArgs(queue), d_a, d_b, d_c);
+// N is defined instead of being passed as a parameter.
+// GPU kernels do not allow variable length arrays.
+std::string defineOrder(size_t n) {
+    return "#define N " + std::to_string(n) + "\n";
+}
 
-    queue.finish();
+// The launches of the kernels for order n, nothing if the configuration doesn't divide n.
+// A local size of 0 lets the runtime choose the work-group.
 
-    double run_time = (static_cast<double>(timer.getTimeMilliseconds()) / 1000.0) - start_time;
+std::optional<GemmLaunch> cellLaunch(const std::string &kernelCode, size_t n, size_t local0 = 0, size_t local1 = 0) {
+    if (local0 == 0) return GemmLaunch{defineOrder(n) + kernelCode, cl::NDRange(n, n), cl::NullRange, {}};
+    if (n % local0 != 0 || n % local1 != 0) return std::nullopt;
+    return GemmLaunch{defineOrder(n) + kernelCode, cl::NDRange(n, n), cl::NDRange(local0, local1), {}};
+}
 
-    cl::copy(queue, d_c, h_C.begin(), h_C.end());
+// A work-item per row of C, localArgs are the sizes of the __local arguments of the kernel.
+std::optional<GemmLaunch> rowLaunch(const std::string &kernelCode, size_t n, size_t local = 0,
+                                    std::vector<size_t> localArgs = {}) {
+    if (local == 0) return GemmLaunch{defineOrder(n) + kernelCode, cl::NDRange(n), cl::NullRange, localArgs};
+    if (n % local != 0) return std::nullopt;
+    return GemmLaunch{defineOrder(n) + kernelCode, cl::NDRange(n), cl::NDRange(local), localArgs};
+}
 
-    results(N, h_C, run_time);
+// It turns out that the compiler generates much better code if we hardwire constants.
+std::optional<GemmLaunch> blockLaunch(size_t n, size_t block_size) {
+    if (n % block_size != 0) return std::nullopt;
+    return GemmLaunch{defineOrder(n) + "#define blksz " + std::to_string(block_size) + "\n" + BLOCK_MULTIPLICATION,
+                      cl::NDRange(n, n), cl::NDRange(block_size, block_size),
+                      {sizeof(float) * block_size * block_size, sizeof(float) * block_size * block_size}};
 }
 
-void multiplyCLWithLocalColumn(const ClContext &clContext,
-                               const std::string &name,
-                               const std::function<cl::EnqueueArgs(cl::CommandQueue &)> &createArgs,
-                               std::vector<float> &h_A,
-                               std::vector<float> &h_B,
-                               std::vector<float> &h_C) {
+std::optional<GemmLaunch> registerLaunch(size_t n, size_t tile_size, size_t rows_per_item, size_t cols_per_item,
+                                         size_t unroll) {
+    // Every work-item loads rows_per_item * cols_per_item / 4 float4 values of each tile.
+    if (n % tile_size != 0 || tile_size % 4 != 0 ||
+        tile_size % rows_per_item != 0 || tile_size % cols_per_item != 0 ||
+        (rows_per_item * cols_per_item) % 4 != 0 || tile_size % unroll != 0) {
+        return std::nullopt;
+    }
+    return GemmLaunch{defineOrder(n) +
+                      "#define TS " + std::to_string(tile_size) + "\n" +
+                      "#define WPTM " + std::to_string(rows_per_item) + "\n" +
+                      "#define WPTN " + std::to_string(cols_per_item) + "\n" +
+                      "#define KUNROLL " + std::to_string(unroll) + "\n" +
+                      REGISTER_TILED_MULTIPLICATION,
+                      cl::NDRange(n / cols_per_item, n / rows_per_item),
+                      cl::NDRange(tile_size / cols_per_item, tile_size / rows_per_item),
+                      {}};
+}
+
+// Every variant of the dispatcher the device runs at order N, their median seconds are
+// recorded for its selection. Those it can't run are listed with the reason.
+void multiplyVariants(util::BenchmarkRunner &bench,
+                      const ClContext &clContext,
+                      GemmDispatcher &dispatcher,
+                      HostMatrix &h_A,
+                      HostMatrix &h_B,
+                      HostMatrix &h_C,
+                      const std::string &nameB = "B") {
+    std::vector<GemmDispatcher::Skipped> skipped;
+    for (const auto *variant: dispatcher.runnable(N, &skipped)) {
+        const double seconds = multiplyCL(bench, clContext, variant->name, [&](auto &queue, auto &A, auto &B, auto &C) {
+            return dispatcher.enqueue(queue, *variant, N, A, B, C);
+        }, h_A, h_B, h_C, nameB);
+        dispatcher.record(variant->name, N, seconds);
+    }
+    for (const auto &[variant, reason]: skipped) {
+        printf("OpenCL, matrix mul '%s', order %zu,\tskipped, %s\n", variant.c_str(), N, reason.c_str());
+    }
+}
+
+// The production entry point, gemm() with the variant the dispatcher selects.
+void multiplyDispatched(util::BenchmarkRunner &bench,
+                        const ClContext &clContext,
+                        GemmDispatcher &dispatcher,
+                        HostMatrix &h_A,
+                        HostMatrix &h_B,
+                        HostMatrix &h_C) {
+    const GemmVariant *selected = dispatcher.select(N);
+    if (selected == nullptr) return;
+    multiplyCL(bench, clContext, "gemm(), dispatched to '" + selected->name + "'",
+               [&](auto &queue, auto &A, auto &B, auto &C) {
+                   return dispatcher.gemm(queue, N, A, B, C);
+               }, h_A, h_B, h_C);
+}
+
+// Exercises 6 and 7 on a transposed B. The transpose is measured on its own, on the
+// host with trans() and on the device with the tiled kernel, and compared to what
+// the transposed kernels save on one product against the plain ones, whose median
+// seconds are cellSeconds and rowSeconds.
+void multiplyCLTransposedB(util::BenchmarkRunner &bench,
+                           const ClContext &clContext,
+                           double cellSeconds,
+                           double rowSeconds,
+                           HostMatrix &h_A,
+                           HostMatrix &h_B,
+                           HostMatrix &h_C) {
     auto queue = clContext.createQueue();
     auto &context = clContext.getContext();
+    const util::BenchmarkCase copy{clContext.getName(), "", std::to_string(N), "GB/s", 2.0 * sizeof(float) * size, 0.0};
+
+    HostMatrix h_Bt(size);
+    auto benchmark = copy;
+    benchmark.device = "host";
+    benchmark.variant = "Transpose B";
+    printf("Transpose B, order %zu on host CPU,\t", N);
+    const double hostSeconds = bench.measure(benchmark, [&]() -> util::BenchmarkSample {
+        util::Timer timer;
+        trans(static_cast<int>(N), h_B, h_Bt);
+        return {elapsedSeconds(timer), std::nullopt};
+    }).wall.median;
+
+    double deviceSeconds = 0.0;
+    const DeviceTranspose transpose(context);
+    if (transpose.supports(clContext.getDevice())) {
+        auto &d_b = clContext.resident(queue, "B", h_B);
+        auto bt_buffer = clContext.acquire(sizeof(float) * size);
+        auto &d_bt = bt_buffer.get();
+        benchmark = copy;
+        benchmark.variant = "Tiled transpose B";
+        printf("OpenCL, 'Tiled transpose B', order %zu,\t", N);
+        deviceSeconds = bench.measure(benchmark, [&]() {
+            util::Timer timer;
+            cl::Event kernel = transpose.enqueue(queue, N, N, d_b, d_bt);
+            queue.finish();
+            return sample(clContext, elapsedSeconds(timer), kernel);
+        }).wall.median;
+
+        std::vector<float> d_result(size);
+        cl::copy(queue, d_bt, d_result.begin(), d_result.end());
+        if (!std::equal(d_result.begin(), d_result.end(), h_Bt.begin())) printf("\n Errors in the tiled transpose\n");
+    }
 
-    // N is defined instead of being passed as a parameter.
-    // GPU kernels do not allow variable length arrays.
-    std::string kernel = "#define N " + std::to_string(N) + "\n" + ROW_PER_WORK_ITEM_PRIVATE_ROW_LOCAL_COLUMN;
-    cl::Program program(context, kernel, true);
+    // The products read the transposed B uploaded from the host, the device one is the same matrix.
+    // They have a dispatcher of their own, gemm() must not select them for an untransposed B.
+    GemmRegistry transposed;
+    transposed.add({"C(i,j) per work item, transposed B", [](size_t n) {
+        return cellLaunch(CELL_PER_WORK_ITEM_TRANSPOSED_B, n);
+    }});
+    transposed.add({"C row per work item, transposed B", [](size_t n) {
+        return rowLaunch(ROW_PER_WORK_ITEM_TRANSPOSED_B, n);
+    }});
+    GemmDispatcher dispatcher(transposed, context, clContext.getDevice());
+    multiplyVariants(bench, clContext, dispatcher, h_A, h_Bt, h_C, "Bt");
+    const double cellTransposed = dispatcher.recorded("C(i,j) per work item, transposed B", N).value_or(0.0);
+    const double rowTransposed = dispatcher.recorded("C row per work item, transposed B", N).value_or(0.0);
+    clContext.evict("Bt");
+
+    printf("Transposed B saves %.4f seconds per 'C(i,j) per work item' and %.4f per 'C row per work item', "
+           "the transpose costs %.4f seconds on the host", cellSeconds - cellTransposed, rowSeconds - rowTransposed,
+           hostSeconds);
+    if (deviceSeconds > 0.0) printf(" and %.4f on the device", deviceSeconds);
+    printf("\n");
+}
 
-    auto d_a = cl::Buffer(context, h_A.begin(), h_A.end(), true);
-    auto d_b = cl::Buffer(context, h_B.begin(), h_B.end(), true);
-    auto d_c = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * size);
+// C = relu(alpha*A*B + beta*C + bias) on random matrices: the epilogue fused into
+// the store of the blocked and of the register tiled kernel, against the plain
+// product followed by one pass over C per step. Every iteration starts from the same C.
+void multiplyCLEpilogue(util::BenchmarkRunner &bench, const ClContext &clContext) {
+    auto queue = clContext.createQueue();
+    auto &context = clContext.getContext();
+    const Epilogue epilogue{0.5, 2.0, BiasMode::PerColumn, Activation::Relu};
+    const auto alpha = static_cast<float>(epilogue.alpha), beta = static_cast<float>(epilogue.beta);
+
+    const auto r_A = randomMatrix(size, 1), r_B = randomMatrix(size, 2), r_C = randomMatrix(size, 3);
+    const auto bias = randomMatrix(N, 4);
+    std::vector<float> product(size), reference(r_C);
+    host_sgemm(N, N, N, r_A.data(), N, r_B.data(), N, product.data(), N);
+    applyEpilogue(epilogue, N, N, product, bias, reference);
+
+    auto upload = [&](const std::vector<float> &host) {
+        cl::Buffer buffer(context, CL_MEM_READ_ONLY, sizeof(float) * host.size());
+        queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, sizeof(float) * host.size(), host.data());
+        return buffer;
+    };
+    const cl::Buffer d_a = upload(r_A), d_b = upload(r_B), d_c0 = upload(r_C), d_bias = upload(bias);
+    const cl::Buffer d_p(context, CL_MEM_READ_WRITE, sizeof(float) * size);
+    const cl::Buffer d_c(context, CL_MEM_READ_WRITE, sizeof(float) * size);
+
+    const BlockGemm plainBlock(context), fusedBlock(context, 16, false, epilogue);
+    const EpiloguePasses passes(context, epilogue);
+
+    // Register tiled, tile 32 and 4x4 per work item.
+    const std::string tiles = "#define N " + std::to_string(N) + "\n#define TS 32\n#define WPTM 4\n#define WPTN 4\n";
+    auto plainRegister = cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer>(
+            util::buildProgram(context, tiles + REGISTER_TILED_MULTIPLICATION), "mmul");
+    auto fusedRegister = cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, float, float, cl::Buffer>(
+            util::buildProgram(context, tiles + epilogue.defines() + REGISTER_TILED_MULTIPLICATION), "mmul");
+    auto registerArgs = [&]() {
+        return cl::EnqueueArgs(queue, cl::NDRange(N / 4, N / 4), cl::NDRange(8, 8));
+    };
+
+    const std::pair<std::string, std::function<void()>> launches[] = {
+            {"Block, fused epilogue",           [&]() {
+                fusedBlock.enqueue(queue, N, N, N, d_a, d_b, d_c, d_bias);
+            }},
+            {"Block, epilogue passes",          [&]() {
+                plainBlock.enqueue(queue, N, N, N, d_a, d_b, d_p);
+                passes.enqueue(queue, N, N, d_p, d_bias, d_c);
+            }},
+            {"Register tiled, fused epilogue",  [&]() {
+                fusedRegister(registerArgs(), d_a, d_b, d_c, alpha, beta, d_bias);
+            }},
+            {"Register tiled, epilogue passes", [&]() {
+                plainRegister(registerArgs(), d_a, d_b, d_p);
+                passes.enqueue(queue, N, N, d_p, d_bias, d_c);
+            }},
+    };
+
+    printf("Epilogue: %s\n", epilogue.name().c_str());
+    double seconds[std::size(launches)];
+    std::vector<float> h_C(size);
+    for (size_t l = 0; l < std::size(launches); l++) {
+        const auto &[name, launch] = launches[l];
+        printf("OpenCL, matrix mul '%s', order %zu,\t", name.c_str(), N);
+        seconds[l] = bench.measure(squareCase(clContext.getName(), name), [&]() -> util::BenchmarkSample {
+            queue.enqueueCopyBuffer(d_c0, d_c, 0, 0, sizeof(float) * size);
+            queue.finish();
+            util::Timer timer;
+            launch();
+            queue.finish();
+            return {elapsedSeconds(timer), std::nullopt};
+        }).wall.median;
+        queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeof(float) * size, h_C.data());
+        printf(" max relative deviation %g\n", maxRelativeDeviation(h_C, reference));
+    }
+    printf("Fused epilogue speedup: block %.2fx, register tiled %.2fx\n",
+           seconds[1] / seconds[0], seconds[3] / seconds[2]);
+}
 
-    auto mmul = cl::KernelFunctor<cl::Buffer &, cl::Buffer &, cl::Buffer &, cl::LocalSpaceArg>(program, "mmul");
+// A stream of products of mixed orders through SquareGemm, with the generic kernel only
+// and with the kernels specialized for the orders that come back. The cache lives for
+// the whole measurement: after the first pass every repeated order divisible by the
+// block size is specialized, orders that aren't stay generic.
+void multiplyCLOrders(util::BenchmarkRunner &bench, const ClContext &clContext) {
+    auto queue = clContext.createQueue();
+    auto &context = clContext.getContext();
 
-    for (int i = 0; i < ITERATIONS; i++) {
-        zero_mat(N, h_C);
+    const int largest = *std::max_element(std::begin(SERVED_ORDERS), std::end(SERVED_ORDERS));
+    const size_t elements = static_cast<size_t>(largest) * largest;
+    double flops = 0.0;
+    for (int n: SERVED_ORDERS) flops += 2.0 * n * n * n;
+
+    // The kernels read the first n*n elements as a row-major order n matrix. They're not the
+    // leading n x n block, but every element of A, and of B, is the same constant, so they
+    // are the same order n matrix.
+    std::vector<float> h_A(elements), h_B(elements), h_C(elements);
+    initmat(largest, h_A, h_B, h_C);
+    cl::Buffer d_a(context, CL_MEM_READ_ONLY, sizeof(float) * elements);
+    cl::Buffer d_b(context, CL_MEM_READ_ONLY, sizeof(float) * elements);
+    cl::Buffer d_c(context, CL_MEM_WRITE_ONLY, sizeof(float) * elements);
+    queue.enqueueWriteBuffer(d_a, CL_TRUE, 0, sizeof(float) * elements, h_A.data());
+    queue.enqueueWriteBuffer(d_b, CL_TRUE, 0, sizeof(float) * elements, h_B.data());
+
+    const std::pair<std::string, size_t> policies[] = {
+            {"Square block, generic order",       std::numeric_limits<size_t>::max()},
+            {"Square block, specialized repeats", 2},
+    };
+    double seconds[std::size(policies)];
+    for (size_t p = 0; p < std::size(policies); p++) {
+        const auto &[name, specializeAfter] = policies[p];
+        const SquareGemm gemm(context, 16, specializeAfter);
+        double worst = 0.0;
+
+        printf("OpenCL, matrix mul '%s', %zu orders,\t", name.c_str(), std::size(SERVED_ORDERS));
+        seconds[p] = bench.measure({clContext.getName(), name, "mixed", "GFLOPS", flops},
+                                   [&]() -> util::BenchmarkSample {
+            util::Timer timer;
+            worst = 0.0;
+            for (int n: SERVED_ORDERS) {
+                gemm.enqueue(queue, n, d_a, d_b, d_c);
+                queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeof(float) * n * n, h_C.data());
+                worst = std::max(worst, static_cast<double>(error(n, h_C)));
+            }
+            return {elapsedSeconds(timer), std::nullopt};
+        }).wall.median;
+        const auto stats = gemm.stats();
+        printf(" worst error %g, %zu generic and %zu specialized products, %zu programs built\n",
+               worst, stats.generic, stats.specialized, stats.builds);
+    }
+    printf("Specialization speedup %.2fx\n", seconds[0] / seconds[1]);
+}
+
+void multiplyCLRectangular(util::BenchmarkRunner &bench,
+                           const ClContext &clContext,
+                           const std::string &name,
+                           int M,
+                           int N,
+                           int K) {
+    auto queue = clContext.createQueue();
+    auto &context = clContext.getContext();
+
+    std::vector<float> h_A(M * K);
+    std::vector<float> h_B(K * N);
+    std::vector<float> h_C(M * N);
+    initmat(M, N, K, h_A, h_B, h_C);
+
+    const BlockGemm gemm(context);
+
+    std::vector<cl::Event> events;
+    const std::string shape = std::to_string(M) + "x" + std::to_string(N) + "x" + std::to_string(K);
+    printf("OpenCL, matrix mul '%s', %s,\t", name.c_str(), shape.c_str());
+    bench.measure({clContext.getName(), name, shape, "GFLOPS", 2.0 * M * N * K, gemmIntensity(M, N, K)}, [&]() {
+        std::fill(h_C.begin(), h_C.end(), 0.0f);
+        events.clear();
         util::Timer timer;
-        double start_time = static_cast<double>(timer.getTimeMilliseconds()) / 1000.0;
 
-        cl::LocalSpaceArg column_arg = cl::Local(sizeof(float) * N);
-        mmul(createArgs(queue), d_a, d_b, d_c, column_arg);
+        gemm.multiply(queue, M, N, K, h_A, h_B, h_C, &events);
+
+        double run_time = elapsedSeconds(timer);
+        return sample(clContext, run_time, events[2]);
+    });
+
+    check(M, N, K, h_C);
+    const char *labels[] = {"write A", "write B", "kernel", "read C"};
+    for (size_t e = 0; e < events.size(); e++) {
+        clContext.report(labels[e], events[e]);
+    }
+}
+
+// The blocked kernel on elements of type T, with operands already on the device.
+// Returns the median GFLOPS.
+template<typename T>
+double multiplyCLBlockTyped(util::BenchmarkRunner &bench, const ClContext &clContext) {
+    auto queue = clContext.createQueue();
+    auto &context = clContext.getContext();
+    const BasicBlockGemm<T> gemm(context);
+
+    std::vector<T> h_A(size), h_B(size), h_C(size);
+    initmat(N, h_A, h_B, h_C);
+    cl::Buffer d_a(context, h_A.begin(), h_A.end(), true);
+    cl::Buffer d_b(context, h_B.begin(), h_B.end(), true);
+    cl::Buffer d_c(context, CL_MEM_WRITE_ONLY, sizeof(T) * size);
 
+    const std::string name = std::string("Block, ") + ScalarType<T>::name;
+    printf("OpenCL, matrix mul '%s', order %zu,\t", name.c_str(), N);
+    const auto record = bench.measure(squareCase(clContext.getName(), name, sizeof(T)), [&]() {
+        util::Timer timer;
+        cl::Event kernel = gemm.enqueue(queue, N, N, N, d_a, d_b, d_c);
         queue.finish();
+        return sample(clContext, elapsedSeconds(timer), kernel);
+    });
+    cl::copy(queue, d_c, h_C.begin(), h_C.end());
+    check(N, h_C);
+    return record.rate();
+}
+
+// The same kernel in single and, if the device has cl_khr_fp64, double precision.
+void multiplyCLPrecisions(util::BenchmarkRunner &bench, const ClContext &clContext) {
+    const double single = multiplyCLBlockTyped<float>(bench, clContext);
+    if (!supportsScalar<double>(clContext.getDevice())) {
+        printf("No cl_khr_fp64 on '%s', double precision skipped\n", clContext.getName());
+        return;
+    }
+    const double twice = multiplyCLBlockTyped<double>(bench, clContext);
+    printf("fp64/fp32 throughput ratio on '%s': %.3f\n", clContext.getName(), twice / single);
+}
+
+// The blocked product with transfers: serialized as in multiplyCL, where A and B are
+// uploaded before the kernel and C is read after it, and streamed in row panels with
+// PipelinedGemm for a few panel heights.
+void multiplyCLPipelined(util::BenchmarkRunner &bench,
+                         const ClContext &clContext,
+                         HostMatrix &h_A,
+                         HostMatrix &h_B,
+                         HostMatrix &h_C) {
+    auto queue = clContext.createQueue();
+    auto &context = clContext.getContext();
+    const BlockGemm gemm(context);
 
-        double run_time = (static_cast<double>(timer.getTimeMilliseconds()) / 1000.0) - start_time;
+    printf("OpenCL, matrix mul 'Block, serialized transfers', order %zu,\t", N);
+    const double serialized = bench.measure(squareCase(clContext.getName(), "Block, serialized transfers"), [&]() {
+        zero_mat(N, h_C);
+        util::Timer timer;
+        cl::Buffer d_a(context, h_A.begin(), h_A.end(), true);
+        cl::Buffer d_b(context, h_B.begin(), h_B.end(), true);
+        cl::Buffer d_c(context, CL_MEM_WRITE_ONLY, sizeof(float) * size);
+        cl::Event kernel = gemm.enqueue(queue, N, N, N, d_a, d_b, d_c);
+        queue.finish();
         cl::copy(queue, d_c, h_C.begin(), h_C.end());
+        return sample(clContext, elapsedSeconds(timer), kernel);
+    }).wall.median;
+    checkProduct(h_C);
 
+    for (int panelRows: {static_cast<int>(N) / 16, static_cast<int>(N) / 8, static_cast<int>(N) / 4}) {
+        PipelinedGemm pipelined(context, clContext.getDevice(), panelRows);
+        const std::string name = "Block, streamed panels of " + std::to_string(panelRows) + " rows";
         printf("OpenCL, matrix mul '%s', order %zu,\t", name.c_str(), N);
-        results(N, h_C, run_time);
+        const double streamed = bench.measure(squareCase(clContext.getName(), name), [&]() -> util::BenchmarkSample {
+            zero_mat(N, h_C);
+            util::Timer timer;
+            pipelined.multiply(N, N, N, h_A, h_B, h_C);
+            return {elapsedSeconds(timer), std::nullopt};
+        }).wall.median;
+        checkProduct(h_C);
+        printf(" speedup %.2f over serialized transfers\n", serialized / streamed);
     }
 }
 
-void multiplyCLFastWithBLocks(const ClContext &clContext,
-                              const std::string &name,
-                              size_t block_size,
-                              std::vector<float> &h_A,
-                              std::vector<float> &h_B,
-                              std::vector<float> &h_C) {
+// The blocked product with transfers, once with float and once with half operands.
+// The half line shows the upload saved and the error it costs, the deviation from
+// the float host product on random inputs. The constant inputs are exact in half,
+// random ones are checked with a tolerance of the order of the half precision.
+void multiplyCLHalf(util::BenchmarkRunner &bench,
+                    const ClContext &clContext,
+                    HostMatrix &h_A,
+                    HostMatrix &h_B,
+                    HostMatrix &h_C) {
     auto queue = clContext.createQueue();
     auto &context = clContext.getContext();
+    const BlockGemm single(context);
+    const HalfGemm half(context);
 
-    // It turns out that the compiler generates much better code if we hardwire constants.
-    std::string kernel = "#define N " + std::to_string(N) + "\n" +
-                         "#define blksz " + std::to_string(block_size) + "\n" +
-                         BLOCK_MULTIPLICATION;
-    cl::Program program(context, kernel);
-    try {
-        program.build();
+    const auto r_A = randomMatrix(size, 1), r_B = randomMatrix(size, 2);
+    std::vector<float> reference(size), r_C(size);
+    host_sgemm(N, N, N, r_A.data(), N, r_B.data(), N, reference.data(), N);
+
+    std::vector<cl::Event> events;
+    printf("OpenCL, matrix mul 'Block, float operands, with transfers', order %zu,\t", N);
+    bench.measure(squareCase(clContext.getName(), "Block, float operands, with transfers"), [&]() {
+        zero_mat(N, h_C);
+        events.clear();
+        util::Timer timer;
+        single.multiply(queue, N, N, N, h_A, h_B, h_C, &events);
+        return sample(clContext, elapsedSeconds(timer), events[2]);
+    });
+    checkProduct(h_C);
+    single.multiply(queue, N, N, N, r_A, r_B, r_C);
+    printf(" upload %.1f MB, max relative deviation %g\n",
+           2.0 * sizeof(float) * size / 1e6, maxRelativeDeviation(r_C, reference));
+
+    // Converted once, like weights kept in half.
+    const auto half_A = to_half(h_A), half_B = to_half(h_B);
+    printf("OpenCL, matrix mul 'Block, half operands, with transfers', order %zu,\t", N);
+    bench.measure(squareCase(clContext.getName(), "Block, half operands, with transfers"), [&]() {
+        zero_mat(N, h_C);
+        events.clear();
+        util::Timer timer;
+        half.multiply(queue, N, N, N, half_A, half_B, h_C, &events);
+        return sample(clContext, elapsedSeconds(timer), events[2]);
+    });
+    checkProduct(h_C, 1e-2);
+    half.multiply(queue, N, N, N, to_half(r_A), to_half(r_B), r_C);
+    printf(" upload %.1f MB, max relative deviation %g\n",
+           2.0 * sizeof(cl_half) * size / 1e6, maxRelativeDeviation(r_C, reference));
+    const char *labels[] = {"write A", "write B", "kernel", "read C"};
+    for (size_t e = 0; e < events.size(); e++) {
+        clContext.report(labels[e], events[e]);
     }
-    catch (cl::Error &err) {
-        cl_int buildErr = CL_SUCCESS;
-        auto buildInfo = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(&buildErr);
-        for (auto &pair: buildInfo) {
-            std::cerr << pair.second << std::endl << std::endl;
+}
+
+// Sweeps batches of small square products: one batched launch with strided and
+// with indexed matrices against one launch per product.
+void multiplyCLBatched(util::BenchmarkRunner &bench, const ClContext &clContext) {
+    auto queue = clContext.createQueue();
+    auto &context = clContext.getContext();
+    const BatchedGemm batched(context);
+    const BlockGemm single(context);
+
+    for (int n: {16, 32, 64, 128}) {
+        for (int count: {16, 256, 4096}) {
+            const size_t elements = static_cast<size_t>(count) * n * n;
+            if (elements > (1 << 24)) continue;
+
+            // The batch is stacked along the rows: the A and C of every product are n x n blocks.
+            std::vector<float> h_A(elements), h_B(elements), h_C(elements);
+            initmat(count * n, n, n, h_A, h_B, h_C);
+            for (int b = 1; b < count; b++) {
+                std::copy(h_B.begin(), h_B.begin() + n * n, h_B.begin() + static_cast<size_t>(b) * n * n);
+            }
+
+            // Products in reverse order, so the offsets are really used.
+            std::vector<cl_int> h_offsets(3 * count);
+            for (int b = 0; b < count; b++) {
+                const int matrix = (count - 1 - b) * n * n;
+                h_offsets[3 * b] = h_offsets[3 * b + 1] = h_offsets[3 * b + 2] = matrix;
+            }
+
+            cl::Buffer d_a(context, h_A.begin(), h_A.end(), true);
+            cl::Buffer d_b(context, h_B.begin(), h_B.end(), true);
+            cl::Buffer d_c(context, CL_MEM_WRITE_ONLY, sizeof(float) * elements);
+            cl::Buffer d_offsets(context, h_offsets.begin(), h_offsets.end(), true);
+
+            const std::string shape = std::to_string(n) + "x" + std::to_string(n) + "x" + std::to_string(n) +
+                                      ", batch " + std::to_string(count);
+            const util::BenchmarkCase work{clContext.getName(), "", shape, "GFLOPS", 2.0 * n * n * n * count,
+                                           gemmIntensity(n, n, n)};
+
+            const std::function<cl::Event()> launches[] = {
+                    [&]() { return batched.enqueueStrided(queue, n, n, n, count, d_a, n * n, d_b, n * n, d_c, n * n); },
+                    [&]() { return batched.enqueueIndexed(queue, n, n, n, count, d_a, d_b, d_c, d_offsets); },
+            };
+            const char *names[] = {"Batched strided", "Batched pointer array"};
+            for (int v = 0; v < 2; v++) {
+                auto benchmark = work;
+                benchmark.variant = names[v];
+                queue.enqueueFillBuffer(d_c, 0.0f, 0, sizeof(float) * elements);
+                printf("OpenCL, matrix mul '%s', %s,\t", names[v], shape.c_str());
+                bench.measure(benchmark, [&]() {
+                    util::Timer timer;
+                    cl::Event kernel = launches[v]();
+                    queue.finish();
+                    return sample(clContext, elapsedSeconds(timer), kernel);
+                });
+                cl::copy(queue, d_c, h_C.begin(), h_C.end());
+                check(count * n, n, n, h_C);
+            }
+
+            // The same products as separate buffers and launches.
+            std::vector<cl::Buffer> a_list, b_list, c_list;
+            for (int b = 0; b < count; b++) {
+                const auto first = static_cast<std::ptrdiff_t>(b) * n * n;
+                a_list.emplace_back(context, h_A.begin() + first, h_A.begin() + first + n * n, true);
+                b_list.emplace_back(context, h_B.begin() + first, h_B.begin() + first + n * n, true);
+                c_list.emplace_back(context, CL_MEM_WRITE_ONLY, sizeof(float) * n * n);
+            }
+            auto benchmark = work;
+            benchmark.variant = "One launch per product";
+            printf("OpenCL, matrix mul '%s', %s,\t", benchmark.variant.c_str(), shape.c_str());
+            bench.measure(benchmark, [&]() -> util::BenchmarkSample {
+                util::Timer timer;
+                for (int b = 0; b < count; b++) {
+                    single.enqueue(queue, n, n, n, a_list[b], b_list[b], c_list[b]);
+                }
+                queue.finish();
+                return {elapsedSeconds(timer), std::nullopt};
+            });
+            for (int b = 0; b < count; b++) {
+                const auto first = static_cast<std::ptrdiff_t>(b) * n * n;
+                cl::copy(queue, c_list[b], h_C.begin() + first, h_C.begin() + first + n * n);
+            }
+            check(count * n, n, n, h_C);
         }
-        throw err;
     }
+}
 
-    auto d_a = cl::Buffer(context, h_A.begin(), h_A.end(), true);
-    auto d_b = cl::Buffer(context, h_B.begin(), h_B.end(), true);
-    auto d_c = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * size);
+// Strassen-Winograd over the blocked kernel at order N for up to three cutoffs, none
+// below STRASSEN_MIN_CUTOFF where the sums cost more than the products they save.
+// The cutoff equal to the order doesn't recurse, it is the blocked product the others
+// are compared to.
+void multiplyCLStrassen(util::BenchmarkRunner &bench, const ClContext &clContext) {
+    const int n = static_cast<int>(N);
+    const size_t elements = static_cast<size_t>(n) * n;
+    auto queue = clContext.createQueue();
+    auto &context = clContext.getContext();
 
-    auto mmul = cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg, cl::LocalSpaceArg>(
-            program, "mmul");
+    std::vector<float> h_A(elements), h_B(elements), h_C(elements);
+    initmat(n, h_A, h_B, h_C);
+    const auto r_A = randomMatrix(elements, 1), r_B = randomMatrix(elements, 2);
+    std::vector<float> reference(elements), r_C(elements);
+
+    cl::Buffer d_a(context, h_A.begin(), h_A.end(), true);
+    cl::Buffer d_b(context, h_B.begin(), h_B.end(), true);
+    cl::Buffer d_ra(context, r_A.begin(), r_A.end(), true);
+    cl::Buffer d_rb(context, r_B.begin(), r_B.end(), true);
+    cl::Buffer d_c(context, CL_MEM_WRITE_ONLY, sizeof(float) * elements);
+
+    double baseline = 0.0;
+    for (int cutoff: {n, n / 2, n / 4}) {
+        if (cutoff < n && cutoff < STRASSEN_MIN_CUTOFF) break;
+        const StrassenGemm gemm(context, cutoff);
+        const std::string name = "Strassen, cutoff " + std::to_string(cutoff);
+        printf("OpenCL, matrix mul '%s', order %d,\t", name.c_str(), n);
+        const auto record = bench.measure({clContext.getName(), name, std::to_string(n), "GFLOPS",
+                                           2.0 * n * n * n, gemmIntensity(n, n, n)}, [&]() -> util::BenchmarkSample {
+            util::Timer timer;
+            gemm.multiply(queue, n, d_a, d_b, d_c);
+            queue.finish();
+            return {elapsedSeconds(timer), std::nullopt};
+        });
+        if (baseline == 0.0) baseline = record.wall.median;
+        cl::copy(queue, d_c, h_C.begin(), h_C.end());
 
-    for (int i = 0; i < ITERATIONS; i++) {
-        zero_mat(N, h_C);
+        gemm.multiply(queue, n, d_ra, d_rb, d_c);
+        cl::copy(queue, d_c, r_C.begin(), r_C.end());
+        if (cutoff == n) reference = r_C;
+        printf(" speedup %.2f, error() %g, max relative deviation %g\n",
+               baseline / record.wall.median, error(n, h_C), maxRelativeDeviation(r_C, reference));
+    }
+}
+
+// Writes a rows x cols matrix file whose rows are all equal to row.
+void writeMatrixFile(const std::filesystem::path &path, int rows, const std::vector<float> &row) {
+    std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+    for (int i = 0; i < rows; i++) {
+        stream.write(reinterpret_cast<const char *>(row.data()), static_cast<std::streamsize>(sizeof(float) * row.size()));
+    }
+    if (!stream) throw std::runtime_error("Can't write " + path.string());
+}
+
+// A product whose matrices are files in the temporary directory, larger than the
+// device memory the product is allowed to use. The rate is the disk to device to
+// disk throughput. The files were just written, so A and B mostly come from the
+// page cache rather than from the disk. Only run when --out-of-core gives the order.
+void multiplyOutOfCore(util::BenchmarkRunner &bench, const ClContext &clContext) {
+    const int n = outOfCoreN;
+    if (n == 0) return;
+    const TemporaryFile fileA("out_of_core_A_"), fileB("out_of_core_B_"), fileC("out_of_core_C_");
+
+    // A row of A and a row of B as initmat fills them.
+    std::vector<float> a_row(n), b_row(n), c_row(n), unused(n);
+    initmat(1, 1, n, a_row, unused, c_row);
+    initmat(1, n, 1, unused, b_row, c_row);
+    writeMatrixFile(fileA.getPath(), n, a_row);
+    writeMatrixFile(fileB.getPath(), n, b_row);
+
+    {
+        const auto A = MappedFile::openRead(fileA.getPath());
+        const auto B = MappedFile::openRead(fileB.getPath());
+        auto C = MappedFile::create(fileC.getPath(), sizeof(float) * n * n);
+
+        OutOfCoreGemm gemm(clContext.getContext(), clContext.getDevice(), OUT_OF_CORE_BYTES);
+        const auto tiling = gemm.plan(n, n, n);
+        printf("Out-of-core tiles of %dx%d, slices of %d, by %s, %.1f MB uploaded for %.1f MB of A and B\n",
+               tiling.rows, tiling.cols, tiling.depth, tiling.rowsFirst ? "rows" : "columns",
+               tiling.uploaded / 1e6, 2.0 * sizeof(float) * n * n / 1e6);
+
+        OutOfCoreGemm::Traffic traffic;
+        const std::string name = "Block, out of core, " + std::to_string(OUT_OF_CORE_BYTES >> 20) + " MB on the device";
+        const double bytes = static_cast<double>(tiling.uploaded) + sizeof(float) * n * n;
+        printf("OpenCL, '%s', order %d,\t", name.c_str(), n);
+        bench.measure({clContext.getName(), name, std::to_string(n), "GB/s", bytes}, [&]() -> util::BenchmarkSample {
+            util::Timer timer;
+            traffic = gemm.multiply(n, n, n, A, B, C);
+            return {elapsedSeconds(timer), std::nullopt};
+        }, 0, 1);
+
+        // Checked a few rows at a time, like it was written.
+        for (int i = 0; i < n; i += 64) {
+            const int rows = std::min(64, n - i);
+            std::vector<float> h_C(C.floats() + static_cast<size_t>(i) * n, C.floats() + static_cast<size_t>(i + rows) * n);
+            check(rows, n, n, h_C);
+        }
+        printf("%.1f MB uploaded, %.1f MB read back\n", traffic.uploaded / 1e6, traffic.downloaded / 1e6);
+    }
+}
+
+// A sparse product writing d_y, compared with the host product. The rate is the
+// effective bandwidth: the bytes of spmm_bytes over the time, whatever the format.
+void multiplySparseCL(util::BenchmarkRunner &bench,
+                      const ClContext &clContext,
+                      cl::CommandQueue &queue,
+                      const std::string &name,
+                      const CsrMatrix &A,
+                      int width,
+                      const std::function<cl::Event()> &product,
+                      const cl::Buffer &d_y,
+                      const std::vector<float> &reference) {
+    printf("OpenCL, sparse '%s', %d rows,\t", name.c_str(), A.rows);
+    const double bytes = spmm_bytes(A, width);
+    const double intensity = 2.0 * static_cast<double>(A.nnz()) * width / bytes;
+    bench.measure({clContext.getName(), name, std::to_string(A.rows), "GB/s", bytes, intensity}, [&]() {
         util::Timer timer;
-        double start_time = static_cast<double>(timer.getTimeMilliseconds()) / 1000.0;
-
-        cl::LocalSpaceArg A_block = cl::Local(sizeof(float) * block_size * block_size);
-        cl::LocalSpaceArg B_block = cl::Local(sizeof(float) * block_size * block_size);
-        mmul(
-                cl::EnqueueArgs(
-                        queue,
-                        cl::NDRange(N, N),
-                        cl::NDRange(block_size, block_size)),
-                d_a,
-                d_b,
-                d_c,
-                A_block,
-                B_block);
+        cl::Event kernel = product();
+        kernel.wait();
+        return sample(clContext, elapsedSeconds(timer), kernel);
+    });
+    std::vector<float> y(reference.size());
+    queue.enqueueReadBuffer(d_y, CL_TRUE, 0, sizeof(float) * y.size(), y.data());
+    printf(" max relative deviation %g\n", maxRelativeDeviation(y, reference));
+}
 
-        queue.finish();
+// SpMV and SpMM on a banded matrix, where every row has the same length and
+// neighbouring rows read neighbouring parts of x, and on a power-law matrix,
+// where the reads of x are scattered and a few rows are far longer than the rest.
+void multiplySparse(util::BenchmarkRunner &bench, const ClContext &clContext) {
+    auto queue = clContext.createQueue();
+    auto &context = clContext.getContext();
+    const SparseKernels kernels(context);
+    const bool vectorRow = kernels.supportsVector(clContext.getDevice());
+
+    const std::pair<std::string, CsrMatrix> matrices[] = {
+            {"banded", banded_matrix(SPARSE_ROWS, 8)},
+            {"power-law", power_law_matrix(SPARSE_ROWS, SPARSE_ROWS, 2.5, 4, 3)},
+    };
+    for (const auto &[shape, A]: matrices) {
+        printf("Sparse %s matrix, %d rows, %zu non-zeros, longest row %d\n",
+               shape.c_str(), A.rows, A.nnz(), A.maxRowLength());
+        const DeviceCsr d_A(context, A);
+
+        const auto x = randomMatrix(A.cols, 4);
+        std::vector<float> y;
+        csr_spmv(A, x, y);
+        cl::Buffer d_x(context, CL_MEM_READ_ONLY, sizeof(float) * x.size());
+        cl::Buffer d_y(context, CL_MEM_WRITE_ONLY, sizeof(float) * y.size());
+        queue.enqueueWriteBuffer(d_x, CL_TRUE, 0, sizeof(float) * x.size(), x.data());
+
+        multiplySparseCL(bench, clContext, queue, "SpMV CSR scalar-row, " + shape, A, 1, [&]() {
+            return kernels.spmvScalar(queue, d_A, d_x, d_y);
+        }, d_y, y);
+        if (vectorRow) {
+            multiplySparseCL(bench, clContext, queue, "SpMV CSR vector-row, " + shape, A, 1, [&]() {
+                return kernels.spmvVector(queue, d_A, d_x, d_y);
+            }, d_y, y);
+        }
 
-        double run_time = (static_cast<double>(timer.getTimeMilliseconds()) / 1000.0) - start_time;
-        cl::copy(queue, d_c, h_C.begin(), h_C.end());
+        // ELL pads every row to the longest, hopeless on the power-law matrix.
+        const double ellPadding = static_cast<double>(A.maxRowLength()) * A.rows / static_cast<double>(A.nnz());
+        if (ellPadding <= 2.0) {
+            const DeviceEll d_ell(context, to_ell(A));
+            multiplySparseCL(bench, clContext, queue, "SpMV ELL, " + shape, A, 1, [&]() {
+                return kernels.spmvEll(queue, d_ell, d_x, d_y);
+            }, d_y, y);
+        } else {
+            printf("SpMV ELL skipped, the padded %s matrix would be %.0f times larger\n", shape.c_str(), ellPadding);
+        }
 
-        printf("OpenCL, matrix mul '%s', order %zu,\t", name.c_str(), N);
-        results(N, h_C, run_time);
+        const auto sell = to_sell(A, kernels.getSliceHeight(), SELL_SIGMA);
+        const DeviceSell d_sell(context, sell);
+        const std::string sellName = "SpMV SELL-" + std::to_string(sell.C) + "-" + std::to_string(sell.sigma);
+        multiplySparseCL(bench, clContext, queue, sellName + ", " + shape, A, 1, [&]() {
+            return kernels.spmvSell(queue, d_sell, d_x, d_y);
+        }, d_y, y);
+        printf("SELL padding %.2f of the non-zeros\n", static_cast<double>(sell.values.size()) / A.nnz());
+
+        const auto X = randomMatrix(static_cast<size_t>(A.cols) * SPARSE_WIDTH, 5);
+        std::vector<float> Y;
+        csr_spmm(A, SPARSE_WIDTH, X, Y);
+        cl::Buffer d_X(context, CL_MEM_READ_ONLY, sizeof(float) * X.size());
+        cl::Buffer d_Y(context, CL_MEM_WRITE_ONLY, sizeof(float) * Y.size());
+        queue.enqueueWriteBuffer(d_X, CL_TRUE, 0, sizeof(float) * X.size(), X.data());
+
+        const std::string spmm = "SpMM CSR, " + std::to_string(SPARSE_WIDTH) + " columns, ";
+        multiplySparseCL(bench, clContext, queue, spmm + "scalar-row, " + shape, A, SPARSE_WIDTH, [&]() {
+            return kernels.spmmScalar(queue, d_A, SPARSE_WIDTH, d_X, d_Y);
+        }, d_Y, Y);
+        if (vectorRow) {
+            multiplySparseCL(bench, clContext, queue, spmm + "vector-row, " + shape, A, SPARSE_WIDTH, [&]() {
+                return kernels.spmmVector(queue, d_A, SPARSE_WIDTH, d_X, d_Y);
+            }, d_Y, Y);
+        }
     }
 }
 
-void multiplyCLBlast(const ClContext &clContext,
-                     const std::string &name,
-                     std::vector<float> &h_A,
-                     std::vector<float> &h_B,
-                     std::vector<float> &h_C) {
+// A level-2 kernel rated in GB/s by the bytes it moves at least, for 2 * GEMV_ORDER^2 operations.
+void multiplyLevel2CL(util::BenchmarkRunner &bench, const ClContext &clContext, const std::string &name,
+                      double bytes, const std::function<cl::Event()> &kernel) {
+    const double intensity = 2.0 * GEMV_ORDER * GEMV_ORDER / bytes;
+    printf("OpenCL, '%s', order %d,\t", name.c_str(), GEMV_ORDER);
+    bench.measure({clContext.getName(), name, std::to_string(GEMV_ORDER), "GB/s", bytes, intensity}, [&]() {
+        util::Timer timer;
+        cl::Event event = kernel();
+        event.wait();
+        return sample(clContext, elapsedSeconds(timer), event);
+    });
+}
+
+// y = A*x and y = A^T*x, the matrix-vector products of batch size 1, and the rank-1 update A += x*y^T.
+void multiplyGemv(util::BenchmarkRunner &bench, const ClContext &clContext) {
     auto queue = clContext.createQueue();
-    const auto &context = clContext.getContext();
+    const DeviceGemv gemv(clContext.getContext());
+    if (!gemv.supports(clContext.getDevice())) {
+        printf("GEMV skipped, its work-groups don't fit the device\n");
+        return;
+    }
 
-    auto d_a = cl::Buffer(context, CL_MEM_READ_ONLY, h_A.size() * sizeof(float));
-    auto d_b = cl::Buffer(context, CL_MEM_READ_ONLY, h_B.size() * sizeof(float));
-    auto d_c = cl::Buffer(context, CL_MEM_WRITE_ONLY, h_C.size() * sizeof(float));
-    queue.enqueueWriteBuffer(d_a, CL_TRUE, 0, h_A.size() * sizeof(float), h_A.data());
-    queue.enqueueWriteBuffer(d_b, CL_TRUE, 0, h_B.size() * sizeof(float), h_B.data());
-    queue.enqueueWriteBuffer(d_c, CL_TRUE, 0, h_C.size() * sizeof(float), h_C.data());
+    const int n = GEMV_ORDER;
+    const size_t elements = static_cast<size_t>(n) * n;
+    const auto h_A = randomMatrix(elements, 1), h_x = randomMatrix(n, 2), h_y = randomMatrix(n, 3);
+    auto a_buffer = clContext.acquire(sizeof(float) * elements);
+    auto x_buffer = clContext.acquire(sizeof(float) * n);
+    auto y_buffer = clContext.acquire(sizeof(float) * n);
+    auto &d_A = a_buffer.get(), &d_x = x_buffer.get(), &d_y = y_buffer.get();
+    queue.enqueueWriteBuffer(d_A, CL_TRUE, 0, sizeof(float) * elements, h_A.data());
+    queue.enqueueWriteBuffer(d_x, CL_TRUE, 0, sizeof(float) * n, h_x.data());
+
+    std::vector<float> y(n), reference(n);
+    for (const bool transposed: {false, true}) {
+        const std::string name = transposed ? "GEMV T, coalesced column tiles" : "GEMV N, work-group per row";
+        multiplyLevel2CL(bench, clContext, name, gemv_bytes(n, n, transposed, 0.0f), [&]() {
+            return transposed ? gemv.gemvT(queue, n, n, 1.0f, d_A, d_x, 0.0f, d_y)
+                              : gemv.gemvN(queue, n, n, 1.0f, d_A, d_x, 0.0f, d_y);
+        });
+        queue.enqueueReadBuffer(d_y, CL_TRUE, 0, sizeof(float) * n, y.data());
+        host_sgemv(transposed, n, n, 1.0f, h_A.data(), h_x.data(), 0.0f, reference.data());
+        printf(" max relative deviation %g\n", maxRelativeDeviation(y, reference));
+    }
 
-    for (int i = 0; i < ITERATIONS; i++) {
-        zero_mat(N, h_C);
+    // Every iteration adds to A, the result is checked on a fresh copy.
+    queue.enqueueWriteBuffer(d_y, CL_TRUE, 0, sizeof(float) * n, h_y.data());
+    multiplyLevel2CL(bench, clContext, "GER, rank-1 update", ger_bytes(n, n), [&]() {
+        return gemv.ger(queue, n, n, 1.0f, d_x, d_y, d_A);
+    });
+    queue.enqueueWriteBuffer(d_A, CL_TRUE, 0, sizeof(float) * elements, h_A.data());
+    gemv.ger(queue, n, n, 0.5f, d_x, d_y, d_A).wait();
+    std::vector<float> A(elements), expected = h_A;
+    queue.enqueueReadBuffer(d_A, CL_TRUE, 0, sizeof(float) * elements, A.data());
+    host_sger(n, n, 0.5f, h_x.data(), h_y.data(), expected.data());
+    printf(" max relative deviation %g\n", maxRelativeDeviation(A, expected));
+}
+
+void multiplyCLBlast(util::BenchmarkRunner &bench,
+                     const ClContext &clContext,
+                     const std::string &name,
+                     HostMatrix &h_A,
+                     HostMatrix &h_B,
+                     HostMatrix &h_C) {
+    auto queue = clContext.createQueue();
+
+    auto &d_a = clContext.resident(queue, "A", h_A);
+    auto &d_b = clContext.resident(queue, "B", h_B);
+    auto c_buffer = clContext.output(h_C);
+    auto &d_c = c_buffer.get();
+    std::optional<util::MappedBuffer<float>> c_view;
+
+    cl::Event kernel, read;
+    printf("OpenCL, matrix mul '%s', order %zu,\t", name.c_str(), N);
+    bench.measure(squareCase(clContext.getName(), name), [&]() {
+        c_view.reset();
+        clContext.clear(queue, d_c, h_C);
         util::Timer timer;
-        double start_time = static_cast<double>(timer.getTimeMilliseconds()) / 1000.0;
 
         // The type of alpha and beta (float) determine the precision.
         const float alpha = 1.0f;
@@ -340,77 +1307,388 @@ void multiplyCLBlast(const ClContext &clContext,
                                     d_b(), 0, N,
                                     beta,
                                     d_c(), 0, N,
-                                    &queue());
+                                    &queue(), &kernel());
         if (status != clblast::StatusCode::kSuccess) {
             throw std::runtime_error("clblast::Gemm error");
         }
         queue.finish();
 
-        double run_time = (static_cast<double>(timer.getTimeMilliseconds()) / 1000.0) - start_time;
-        cl::copy(queue, d_c, h_C.begin(), h_C.end());
+        double run_time = elapsedSeconds(timer);
+        clContext.readBack(queue, d_c, h_C, c_view, &read);
+        return sample(clContext, run_time, kernel);
+    });
+    verify(clContext, h_C, kernel, read);
+}
 
-        printf("OpenCL, matrix mul '%s', order %zu,\t", name.c_str(), N);
-        results(N, h_C, run_time);
+// Kernel families that can be auto-tuned, see tuningCandidates().
+const std::vector<std::string> TUNED_FAMILIES = {
+        "cell", "row", "row_private", "local_column", "block", "register"
+};
+
+// Work-group sizes along a dimension of length N.
+std::vector<size_t> localSizes(size_t max) {
+    std::vector<size_t> sizes;
+    for (size_t l = 1; l <= max; l *= 2) {
+        if (N % l == 0) sizes.push_back(l);
+    }
+    if (N / 16 <= max && N % 16 == 0 && std::find(sizes.begin(), sizes.end(), N / 16) == sizes.end()) {
+        sizes.push_back(N / 16);
     }
+    return sizes;
 }
 
-void runForDevice(size_t deviceIndex,
-                  std::vector<float> &h_A,
-                  std::vector<float> &h_B,
-                  std::vector<float> &h_C) {
-    const ClContext clContext(deviceIndex);
+TuningCandidate tuningCandidate(const KernelConfig &config, const GemmLaunch &launch) {
+    return {config, launch.source, launch.global, launch.local, launch.localArgs};
+}
 
-    printf("===== Device '%s' start =====\n", clContext.getName());
-    multiplyCL(clContext, "C(i,j) per work item", CELL_PER_WORK_ITEM, [](auto queue) {
-        return cl::EnqueueArgs(queue, cl::NDRange(N, N));
-    }, h_A, h_B, h_C);
-    multiplyCL(clContext, "C row per work item, 16 units", ROW_PER_WORK_ITEM, [](auto queue) {
-        return cl::EnqueueArgs(queue, cl::NDRange(N), cl::NDRange(N / 16));
-    }, h_A, h_B, h_C);
-    multiplyCL(clContext, "C row per work item, any units", ROW_PER_WORK_ITEM, [](auto queue) {
-        return cl::EnqueueArgs(queue, cl::NDRange(N));
-    }, h_A, h_B, h_C);
-    if (deviceIndex != 0) { // Intel CPU gives CL_INVALID_WORK_GROUP_SIZE. For this kernel the work-group size is 1.
-        multiplyCL(clContext, "C row per work item private memory, 16 units",
-                   ROW_PER_WORK_ITEM_PRIVATE_ROW,
-                   [](auto queue) {
-                       return cl::EnqueueArgs(queue, cl::NDRange(N), cl::NDRange(N / 16));
-                   }, h_A, h_B, h_C);
-    }
-    multiplyCL(clContext, "C row per work item private memory, any units", ROW_PER_WORK_ITEM_PRIVATE_ROW,
-               [](auto queue) {
-                   return cl::EnqueueArgs(queue, cl::NDRange(N));
-               }, h_A, h_B, h_C);
+std::vector<TuningCandidate> registerCandidates(const std::vector<size_t> &unrolls,
+                                                const std::vector<size_t> &tiles,
+                                                const std::vector<size_t> &works) {
+    std::vector<TuningCandidate> candidates;
+    for (size_t tile: tiles) {
+        for (size_t wptm: works) {
+            for (size_t wptn: works) {
+                for (size_t unroll: unrolls) {
+                    auto launch = registerLaunch(N, tile, wptm, wptn, unroll);
+                    if (!launch) continue;
+                    KernelConfig config{.local0 = tile / wptn, .local1 = tile / wptm, .tile = tile,
+                            .wptm = wptm, .wptn = wptn, .unroll = unroll};
+                    candidates.push_back(tuningCandidate(config, *launch));
+                }
+            }
+        }
+    }
+    return candidates;
+}
+
+std::vector<TuningCandidate> tuningCandidates(const std::string &family) {
+    std::vector<TuningCandidate> candidates;
+    if (family == "cell") {
+        for (size_t l0: localSizes(64)) {
+            for (size_t l1: localSizes(64)) {
+                if (l0 * l1 < 16 || l0 * l1 > 1024) continue;
+                candidates.push_back(tuningCandidate({.local0 = l0, .local1 = l1},
+                                                     *cellLaunch(CELL_PER_WORK_ITEM, N, l0, l1)));
+            }
+        }
+    } else if (family == "row" || family == "row_private" || family == "local_column") {
+        const std::string &code = family == "row" ? ROW_PER_WORK_ITEM :
+                                  family == "row_private" ? ROW_PER_WORK_ITEM_PRIVATE_ROW :
+                                  ROW_PER_WORK_ITEM_PRIVATE_ROW_LOCAL_COLUMN;
+        std::vector<size_t> localArgs;
+        if (family == "local_column") localArgs.push_back(sizeof(float) * N);
+        for (size_t l: localSizes(1024)) {
+            candidates.push_back(tuningCandidate({.local0 = l}, *rowLaunch(code, N, l, localArgs)));
+        }
+    } else if (family == "block") {
+        for (size_t blksz: {4, 8, 16, 32}) {
+            if (auto launch = blockLaunch(N, blksz)) {
+                candidates.push_back(tuningCandidate({.local0 = blksz, .local1 = blksz, .tile = blksz}, *launch));
+            }
+        }
+    } else if (family == "register") {
+        candidates = registerCandidates({1}, {16, 32, 64, 128}, {1, 2, 4, 8});
+    }
+    return candidates;
+}
 
-    if (deviceIndex != 0) { // Intel CPU gives CL_INVALID_WORK_GROUP_SIZE. For this kernel the work-group size is 1.
-        multiplyCLWithLocalColumn(clContext, "C row per work item with local column, 16 units", [](auto queue) {
-            return cl::EnqueueArgs(queue, cl::NDRange(N), cl::NDRange(N / 16));
-        }, h_A, h_B, h_C);
+// Sweeps every family on the device and stores the winners in the database.
+void tuneDevice(const ClContext &clContext, TuningDatabase &database,
+                HostMatrix &h_A, HostMatrix &h_B) {
+    auto &context = clContext.getContext();
+    auto queue = clContext.createQueue();
+    auto &d_a = clContext.resident(queue, "A", h_A);
+    auto &d_b = clContext.resident(queue, "B", h_B);
+    auto c_buffer = clContext.acquire(sizeof(float) * size);
+    auto &d_c = c_buffer.get();
+    // The winners are checked with Freivalds' algorithm, which holds for any A and B.
+    Tuner tuner(context, clContext.getDevice(), d_a, d_b, d_c, [&](cl::CommandQueue &tuning, const cl::Buffer &C) {
+        std::vector<float> product(size);
+        tuning.enqueueReadBuffer(C, CL_TRUE, 0, sizeof(float) * size, product.data());
+        return freivalds(N, N, N, h_A.data(), h_B.data(), product.data()).passed;
+    });
+
+    for (const auto &family: TUNED_FAMILIES) {
+        auto best = tuner.sweep(family, tuningCandidates(family));
+        if (best && family == "register") {
+            // Unrolling is tuned for the best tile only, sweeping both at once multiplies the builds.
+            const auto &c = best->config;
+            auto unrolled = tuner.sweep(family, registerCandidates({2, 4, 8, 16}, {c.tile}, {c.wptm, c.wptn}));
+            if (unrolled && unrolled->seconds < best->seconds) best = unrolled;
+        }
+        if (best) {
+            printf("Tuned '%s' on '%s': %s\n", family.c_str(), clContext.getName(), best->config.describe().c_str());
+            database.store(clContext.getName(), family, N, *best);
+        }
     }
-    multiplyCLWithLocalColumn(clContext, "C row per work item with local column, any units", [](auto queue) {
-        return cl::EnqueueArgs(queue, cl::NDRange(N));
-    }, h_A, h_B, h_C);
+    database.save();
+}
 
-    if (deviceIndex != 0) { // Intel CPU gives CL_INVALID_WORK_GROUP_SIZE.
-        multiplyCLFastWithBLocks(clContext, "Block fast, block size 16", 16, h_A, h_B, h_C);
+// The variant of the configuration stored in the database for the family.
+GemmVariant tunedVariant(const std::string &family, const KernelConfig &c) {
+    const std::string tuned = ", tuned " + c.describe();
+    if (family == "cell") {
+        return {"C(i,j) per work item" + tuned, [c](size_t n) {
+            return cellLaunch(CELL_PER_WORK_ITEM, n, c.local0, c.local1);
+        }};
+    } else if (family == "row") {
+        return {"C row per work item" + tuned, [c](size_t n) {
+            return rowLaunch(ROW_PER_WORK_ITEM, n, c.local0);
+        }};
+    } else if (family == "row_private") {
+        return {"C row per work item private memory" + tuned, [c](size_t n) {
+            return rowLaunch(ROW_PER_WORK_ITEM_PRIVATE_ROW, n, c.local0);
+        }};
+    } else if (family == "local_column") {
+        return {"C row per work item with local column" + tuned, [c](size_t n) {
+            return rowLaunch(ROW_PER_WORK_ITEM_PRIVATE_ROW_LOCAL_COLUMN, n, c.local0, {sizeof(float) * n});
+        }};
+    } else if (family == "block") {
+        return {"Block fast" + tuned, [c](size_t n) { return blockLaunch(n, c.tile); }};
     }
-    multiplyCLBlast(clContext, "CLBlast", h_A, h_B, h_C);
+    return {"Register tiled" + tuned, [c](size_t n) {
+        return registerLaunch(n, c.tile, c.wptm, c.wptn, c.unroll);
+    }};
+}
+
+// The square products of a device, in the order they're benchmarked: the fixed
+// configurations, then those the database holds for the device at order N.
+GemmRegistry gemmRegistry(const TuningDatabase &database, const std::string &device) {
+    GemmRegistry registry;
+    registry.add({"C(i,j) per work item", [](size_t n) { return cellLaunch(CELL_PER_WORK_ITEM, n); }});
+    registry.add({"C row per work item, 16 units", [](size_t n) {
+        return rowLaunch(ROW_PER_WORK_ITEM, n, n / 16);
+    }});
+    registry.add({"C row per work item, any units", [](size_t n) { return rowLaunch(ROW_PER_WORK_ITEM, n); }});
+    registry.add({"C row per work item private memory, 16 units", [](size_t n) {
+        return rowLaunch(ROW_PER_WORK_ITEM_PRIVATE_ROW, n, n / 16);
+    }});
+    registry.add({"C row per work item private memory, any units", [](size_t n) {
+        return rowLaunch(ROW_PER_WORK_ITEM_PRIVATE_ROW, n);
+    }});
+    registry.add({"C row per work item with local column, 16 units", [](size_t n) {
+        return rowLaunch(ROW_PER_WORK_ITEM_PRIVATE_ROW_LOCAL_COLUMN, n, n / 16, {sizeof(float) * n});
+    }});
+    registry.add({"C row per work item with local column, any units", [](size_t n) {
+        return rowLaunch(ROW_PER_WORK_ITEM_PRIVATE_ROW_LOCAL_COLUMN, n, 0, {sizeof(float) * n});
+    }});
+    registry.add({"Block fast, block size 16", [](size_t n) { return blockLaunch(n, 16); }});
+    // Tile 64 needs 2 x 64 x 65 floats of local memory, more than the 32 KB of many GPUs,
+    // the tuner picks it where it fits.
+    registry.add({"Register tiled, tile 32, 4x4 per work item", [](size_t n) {
+        return registerLaunch(n, 32, 4, 4, 1);
+    }});
+    for (const auto &family: TUNED_FAMILIES) {
+        if (auto tuned = database.find(device, family, N)) {
+            registry.add(tunedVariant(family, tuned->config));
+        }
+    }
+    return registry;
+}
+
+// Gives the tuned variants of gemmRegistry() the time the tuner measured, so that a dispatcher
+// selects them before the benchmark has timed anything.
+void recordTunedTimes(GemmDispatcher &dispatcher, const TuningDatabase &database, const std::string &device) {
+    for (const auto &family: TUNED_FAMILIES) {
+        if (auto tuned = database.find(device, family, N)) {
+            dispatcher.record(tunedVariant(family, tuned->config).name, N, tuned->seconds);
+        }
+    }
+}
+
+// Measures the peak GFLOPS and GB/s of every device, the cases of a device that give
+// their arithmetic intensity are then also rated against its roofline.
+void calibrateRooflines(util::BenchmarkRunner &bench) {
+    for (const auto &device: getDeviceList()) {
+        const cl::Context context(device);
+        const auto roofline = util::measureRoofline(context, device);
+        const auto name = getDeviceName(device);
+        printf("Roofline of '%s': %.1f GFLOPS, %.1f GB/s, compute bound above %.2f flop/byte\n",
+               name.c_str(), roofline.gflops, roofline.bandwidth, roofline.ridge());
+        bench.setRoofline(name, roofline);
+    }
+}
+
+void runForDevice(util::BenchmarkRunner &bench,
+                  size_t deviceIndex,
+                  bool tune,
+                  bool profile,
+                  bool zeroCopy,
+                  TuningDatabase &database,
+                  HostMatrix &h_A,
+                  HostMatrix &h_B,
+                  HostMatrix &h_C) {
+    const ClContext clContext(deviceIndex, profile, zeroCopy);
+
+    printf("===== Device '%s' start =====\n", clContext.getName());
+    if (clContext.isZeroCopy()) {
+        printf("Zero copy: host unified memory, A and B are copied into host-visible buffers, "
+               "C uses the host matrix\n");
+    }
+    if (tune) {
+        tuneDevice(clContext, database, h_A, h_B);
+    }
+    GemmDispatcher dispatcher(gemmRegistry(database, clContext.getName()), clContext.getContext(),
+                              clContext.getDevice());
+    recordTunedTimes(dispatcher, database, clContext.getName());
+    multiplyVariants(bench, clContext, dispatcher, h_A, h_B, h_C);
+    multiplyDispatched(bench, clContext, dispatcher, h_A, h_B, h_C);
+    multiplyCLTransposedB(bench, clContext, dispatcher.recorded("C(i,j) per work item", N).value_or(0.0),
+                          dispatcher.recorded("C row per work item, any units", N).value_or(0.0), h_A, h_B, h_C);
+
+    // The drivers below launch 16x16 work-groups of the blocked kernels.
+    if (BlockGemm(clContext.getContext()).supports(clContext.getDevice())) {
+        multiplyCLEpilogue(bench, clContext);
+        multiplyCLOrders(bench, clContext);
+        multiplyCLRectangular(bench, clContext, "Block rectangular, with transfers", 1000, 3072, 777);
+        multiplyCLPrecisions(bench, clContext);
+        multiplyCLHalf(bench, clContext, h_A, h_B, h_C);
+        multiplyCLPipelined(bench, clContext, h_A, h_B, h_C);
+        multiplyCLBatched(bench, clContext);
+        multiplyCLStrassen(bench, clContext);
+        multiplyOutOfCore(bench, clContext);
+    }
+    multiplySparse(bench, clContext);
+    multiplyGemv(bench, clContext);
+
+    multiplyCLBlast(bench, clContext, "CLBlast", h_A, h_B, h_C);
     printf("===== Device '%s' done =====\n\n", clContext.getName());
 }
 
-int main() {
-    std::vector<float> h_A(size);
-    std::vector<float> h_B(size);
-    std::vector<float> h_C(size);
+// Replaces every CPU device by sub-devices of about 1/parts of its compute units,
+// so the multi-device path can be exercised on a machine without a GPU.
+std::vector<cl::Device> splitCpuDevices(const std::vector<cl::Device> &devices, cl_uint parts) {
+    std::vector<cl::Device> result;
+    for (auto device: devices) {
+        if (parts < 2 || !(device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU)) {
+            result.push_back(device);
+            continue;
+        }
+        const cl_uint units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+        const cl_device_partition_property properties[] = {
+                CL_DEVICE_PARTITION_EQUALLY, std::max<cl_uint>(1, units / parts), 0
+        };
+        std::vector<cl::Device> subDevices;
+        device.createSubDevices(properties, &subDevices);
+        result.insert(result.end(), subDevices.begin(), subDevices.end());
+    }
+    return result;
+}
+
+// One product computed by all devices at once, split by the 'block' GFLOPS of the
+// tuning database or, if a device has no entry, by a calibration run.
+void multiplyMultiDevice(util::BenchmarkRunner &bench,
+                         const std::vector<cl::Device> &devices,
+                         const TuningDatabase &database,
+                         HostMatrix &h_A,
+                         HostMatrix &h_B,
+                         HostMatrix &h_C) {
+    MultiDeviceGemm gemm(devices);
+    const auto used = gemm.devices();
+
+    std::vector<double> weights;
+    for (const auto &device: used) {
+        if (auto tuned = database.find(getDeviceName(device), "block", N)) {
+            weights.push_back(2.0 * N * N * N / (1000000000.0 * tuned->seconds));
+        }
+    }
+    if (weights.size() == used.size()) {
+        gemm.setWeights(weights);
+    } else {
+        weights = gemm.calibrate(N, N, N, h_A, h_B, h_C);
+    }
+
+    const auto starts = gemm.partition(N, N, N);
+    printf("===== Multi-device split =====\n");
+    for (size_t i = 0; i < used.size(); i++) {
+        printf("'%s': %.1f GFLOPS, rows %d to %d\n",
+               getDeviceName(used[i]).c_str(), weights[i], starts[i], starts[i + 1]);
+    }
+
+    const std::string name = "Block, " + std::to_string(used.size()) + " devices";
+    printf("OpenCL, matrix mul '%s', order %zu,\t", name.c_str(), N);
+    bench.measure(squareCase("all", name), [&]() -> util::BenchmarkSample {
+        zero_mat(N, h_C);
+        util::Timer timer;
+        gemm.multiply(N, N, N, h_A, h_B, h_C);
+        return {elapsedSeconds(timer), std::nullopt};
+    });
+    checkProduct(h_C);
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    // --tune sweeps the kernel configurations of every device and updates the tuning database.
+    // --profile reports the device timestamps of every kernel and transfer.
+    // --no-zero-copy copies the matrices even to devices sharing memory with the host.
+    // --fission N splits CPU devices into N sub-devices for the multi-device product.
+    // --order N sets the order of the square products, MATRIX_ORDER too (the option wins).
+    // --random fills A and B with random values and checks the products with Freivalds' algorithm.
+    // --out-of-core N adds a product of order N streamed from files in the temporary directory.
+    // The benchmark options (--warmup, --iterations, --json, --csv) are described in benchmark.hpp.
+    bool tune = false;
+    bool profile = false;
+    bool zeroCopy = true;
+    bool random = false;
+    cl_uint fission = 1;
+    cl_uint order = N;
+    cl_uint outOfCore = 0;
+    if (const char *env = std::getenv("MATRIX_ORDER"); env != nullptr && !parseUInt(env, &order)) {
+        std::cout << "Invalid MATRIX_ORDER\n";
+        return EXIT_FAILURE;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--tune")) tune = true;
+        if (!strcmp(argv[i], "--profile")) profile = true;
+        if (!strcmp(argv[i], "--no-zero-copy")) zeroCopy = false;
+        if (!strcmp(argv[i], "--random")) random = true;
+        if (!strcmp(argv[i], "--fission") && (++i >= argc || !parseUInt(argv[i], &fission))) {
+            std::cout << "Invalid number of sub-devices\n";
+            return EXIT_FAILURE;
+        }
+        if (!strcmp(argv[i], "--order") && (++i >= argc || !parseUInt(argv[i], &order))) {
+            std::cout << "Invalid order\n";
+            return EXIT_FAILURE;
+        }
+        if (!strcmp(argv[i], "--out-of-core") && (++i >= argc || !parseUInt(argv[i], &outOfCore))) {
+            std::cout << "Invalid out-of-core order\n";
+            return EXIT_FAILURE;
+        }
+    }
+    if (order == 0 || order % 64 != 0) {
+        std::cout << "The order must be a positive multiple of 64\n";
+        return EXIT_FAILURE;
+    }
+    N = order;
+    size = N * N;
+    outOfCoreN = static_cast<int>(outOfCore);
+    TuningDatabase database;
+    util::BenchmarkRunner bench(util::BenchmarkOptions::parse(argc, argv));
+
+    // Allocated without zeroing, initmat writes every page first from the thread using its rows.
+    HostMatrix h_A(size);
+    HostMatrix h_B(size);
+    HostMatrix h_C(size);
     initmat(N, h_A, h_B, h_C);
+    if (random) {
+        const auto r_A = randomMatrix(size, 1), r_B = randomMatrix(size, 2);
+        std::copy(r_A.begin(), r_A.end(), h_A.begin());
+        std::copy(r_B.begin(), r_B.end(), h_B.begin());
+        randomInputs = {&h_A, &h_B};
+    }
 
-    multiplyCpuSimple(h_A, h_B, h_C);
-    multiplyCpuBetterSimple(h_A, h_B, h_C);
+    multiplyCpuSimple(bench, h_A, h_B, h_C);
+    multiplyCpuBetterSimple(bench, h_A, h_B, h_C);
+    multiplyCpuPacked(bench, h_A, h_B, h_C);
+    checkFreivalds(bench, h_A, h_B, h_C);
+    multiplyCpuStrassen(bench, h_A, h_B, h_C);
 
     try {
+        calibrateRooflines(bench);
         for (int i = 0; i <= 2; i++) {
-            runForDevice(i, h_A, h_B, h_C);
+            runForDevice(bench, i, tune, profile, zeroCopy, database, h_A, h_B, h_C);
         }
+        multiplyMultiDevice(bench, splitCpuDevices(getDeviceList(), fission), database, h_A, h_B, h_C);
     } catch (cl::Error &err) {
         std::cout << "Exception\n";
         std::cerr << "ERROR: "
@@ -420,6 +1698,7 @@ int main() {
                   << ")"
                   << std::endl;
     }
+    bench.write();
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,127 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Memory-mapped matrix files
+//
+//  PURPOSE: A file of raw row-major floats mapped into the address space,
+//           so a matrix larger than the host memory can be read and written
+//           in tiles: the kernel pages the touched parts in and out.
+//
+//           openRead() maps an existing file read-only, create() sizes a
+//           new file and maps it read-write. flush() starts the write back
+//           of a byte range without waiting for it.
+//
+//           A TemporaryFile names a new file of its own in the temporary
+//           directory, so concurrent runs don't share files, and removes it
+//           when it goes out of scope, even if an exception does.
+//
+//           POSIX only (mmap, msync, mkstemp).
+//
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class MappedFile {
+public:
+    static MappedFile openRead(const std::string &path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) fail("open", path);
+        struct stat info{};
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            fail("stat", path);
+        }
+        return {fd, path, static_cast<size_t>(info.st_size), PROT_READ};
+    }
+
+    static MappedFile create(const std::string &path, size_t bytes) {
+        const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) fail("create", path);
+        if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+            close(fd);
+            fail("resize", path);
+        }
+        return {fd, path, bytes, PROT_READ | PROT_WRITE};
+    }
+
+    MappedFile(MappedFile &&other) noexcept:
+            data(std::exchange(other.data, nullptr)), bytes(std::exchange(other.bytes, 0)) {}
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        if (data != nullptr) munmap(data, bytes);
+    }
+
+    [[nodiscard]] size_t size() const { return bytes; }
+
+    [[nodiscard]] const float *floats() const { return static_cast<const float *>(data); }
+
+    [[nodiscard]] float *floats() { return static_cast<float *>(data); }
+
+    // Schedules the write back of [offset, offset + length) to the file.
+    void flush(size_t offset, size_t length) {
+        const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const size_t start = offset / page * page;
+        msync(static_cast<char *>(data) + start, offset + length - start, MS_ASYNC);
+    }
+
+private:
+    MappedFile(int fd, const std::string &path, size_t bytes, int protection) : bytes(bytes) {
+        if (bytes > 0) {
+            data = mmap(nullptr, bytes, protection, MAP_SHARED, fd, 0);
+        }
+        const int mapError = errno;
+        close(fd);
+        if (data == MAP_FAILED) {
+            data = nullptr;
+            errno = mapError;
+            fail("map", path);
+        }
+    }
+
+    [[noreturn]] static void fail(const std::string &what, const std::string &path) {
+        throw std::runtime_error("Can't " + what + " " + path + ": " + std::strerror(errno));
+    }
+
+    void *data = nullptr;
+    size_t bytes;
+};
+
+class TemporaryFile {
+public:
+    // Creates an empty file named prefix followed by 6 unique characters.
+    explicit TemporaryFile(const std::string &prefix) :
+            path((std::filesystem::temp_directory_path() / (prefix + "XXXXXX")).string()) {
+        const int fd = mkstemp(path.data());
+        if (fd < 0) throw std::runtime_error("Can't create " + path + ": " + std::strerror(errno));
+        close(fd);
+    }
+
+    TemporaryFile(const TemporaryFile &) = delete;
+
+    TemporaryFile &operator=(const TemporaryFile &) = delete;
+
+    ~TemporaryFile() {
+        unlink(path.c_str());
+    }
+
+    [[nodiscard]] const std::string &getPath() const { return path; }
+
+private:
+    std::string path;
+};
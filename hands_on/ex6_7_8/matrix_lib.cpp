@@ -6,7 +6,8 @@
 //           matrices used with the multiplcation driver.
 //
 //  USAGE:   The matrices are square and the order is
-//           set as a defined constant, ORDER.
+//           passed as an argument, N. The M, N, K
+//           overloads work with C(M,N) = A(M,K) * B(K,N).
 //
 //  HISTORY: Written by Tim Mattson, August 2010
 //           Modified by Simon McIntosh-Smith, September 2011
@@ -17,10 +18,39 @@
 //------------------------------------------------------------------------------
 
 #include "matrix_lib.hpp"
+#include "block_mmul.hpp"
+#include "gemv.hpp"
+#include "strassen.hpp"
+#include "transpose.hpp"
+#include "../common/cpp/program_cache.hpp"
+#include "../common/cpp/util.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HOST_SGEMM_X86
+#endif
 
 const float AVAL = 3.0;    // A elements are constant and equal to AVAL
 const float BVAL = 5.0;    // B elements are constant and equal to BVAL
 const float TOL = 0.001;   // tolerance used in floating point comparisons
+
+// Below this many elements a matrix is filled, or multiplied by a vector, by the calling thread.
+const size_t PARALLEL_ROWS_ELEMENTS = size_t(1) << 18;
 //------------------------------------------------------------------------------
 //
 //  Function to compute the matrix product (sequential algorithm, dot prod)
@@ -29,10 +59,12 @@ const float TOL = 0.001;   // tolerance used in floating point comparisons
 
 
 
-void seq_mat_mul_sdot(int N, std::vector<float> &A, std::vector<float> &B, std::vector<float> &C) {
+template<typename T, typename Allocator>
+void seq_mat_mul_sdot(int N, std::vector<T, Allocator> &A, std::vector<T, Allocator> &B,
+                      std::vector<T, Allocator> &C) {
     for (int i = 0; i < N; i++) {
         for (int j = 0; j < N; j++) {
-            float tmp = 0.0f;
+            T tmp = 0;
             for (int k = 0; k < N; k++) {
                 /* C(i,j) = sum(over k) A(i,k) * B(k,j) */
                 tmp += A[i * N + k] * B[k * N + j];
@@ -51,7 +83,9 @@ void seq_mat_mul_sdot(int N, std::vector<float> &A, std::vector<float> &B, std::
 // 1*5+2*7 1*6+2*8
 // 3*5+4*7 3*6+4*8
 
-void better_seq_mat_mul_sdot(int N, std::vector<float> &A, std::vector<float> &B, std::vector<float> &C) {
+template<typename T, typename Allocator>
+void better_seq_mat_mul_sdot(int N, std::vector<T, Allocator> &A, std::vector<T, Allocator> &B,
+                             std::vector<T, Allocator> &C) {
     for (int i = 0; i < N; i++) {
         for (int k = 0; k < N; k++) {
             for (int j = 0; j < N; j++) {
@@ -61,21 +95,431 @@ void better_seq_mat_mul_sdot(int N, std::vector<float> &A, std::vector<float> &B
     }
 }
 
+//------------------------------------------------------------------------------
+//
+//  Packed, multi-threaded host product (see matrix_lib.hpp)
+//
+//  C is split into MC x NC macro-tiles which the threads take from a shared
+//  counter. For every KC slice a thread packs its A block into MR row panels
+//  and the B block into NR column panels, so that the micro-kernel streams
+//  both operands from contiguous, aligned memory. Partial panels are padded
+//  with zeros and partial micro-tiles go through a temporary tile.
+//
+//------------------------------------------------------------------------------
+namespace {
+
+const int MC = 96;     // rows of a macro-tile, a multiple of every MR
+const int KC = 256;    // depth of a packed slice
+const int NC = 512;    // columns of a macro-tile, a multiple of every NR
+const size_t ALIGNMENT = 64;
+
+using MicroKernel = void (*)(int kc, const float *Ap, const float *Bp, float *C, int ldc, bool accumulate);
+
+struct MicroKernelInfo {
+    const char *name;
+    int mr;
+    int nr;
+    MicroKernel kernel;
+};
+
+struct AlignedDelete {
+    void operator()(float *p) const { ::operator delete[](p, std::align_val_t(ALIGNMENT)); }
+};
+
+using AlignedBuffer = std::unique_ptr<float[], AlignedDelete>;
+
+AlignedBuffer aligned_floats(size_t count) {
+    return AlignedBuffer(static_cast<float *>(::operator new[](sizeof(float) * count, std::align_val_t(ALIGNMENT))));
+}
+
+template<int MR, int NR>
+void micro_kernel_generic(int kc, const float *Ap, const float *Bp, float *C, int ldc, bool accumulate) {
+    float acc[MR][NR] = {};
+    for (int k = 0; k < kc; k++) {
+        for (int r = 0; r < MR; r++) {
+            const float a = Ap[k * MR + r];
+            for (int c = 0; c < NR; c++) {
+                acc[r][c] += a * Bp[k * NR + c];
+            }
+        }
+    }
+    for (int r = 0; r < MR; r++) {
+        for (int c = 0; c < NR; c++) {
+            C[r * ldc + c] = accumulate ? C[r * ldc + c] + acc[r][c] : acc[r][c];
+        }
+    }
+}
+
+#ifdef HOST_SGEMM_X86
+// 6x16 tile: 12 ymm accumulators, two B loads and six A broadcasts per k.
+__attribute__((target("avx2,fma")))
+void micro_kernel_avx2(int kc, const float *Ap, const float *Bp, float *C, int ldc, bool accumulate) {
+    const int MR = 6;
+    __m256 acc[MR][2];
+    for (int r = 0; r < MR; r++) {
+        acc[r][0] = _mm256_setzero_ps();
+        acc[r][1] = _mm256_setzero_ps();
+    }
+    for (int k = 0; k < kc; k++) {
+        const __m256 b0 = _mm256_load_ps(Bp + k * 16);
+        const __m256 b1 = _mm256_load_ps(Bp + k * 16 + 8);
+        for (int r = 0; r < MR; r++) {
+            const __m256 a = _mm256_broadcast_ss(Ap + k * MR + r);
+            acc[r][0] = _mm256_fmadd_ps(a, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(a, b1, acc[r][1]);
+        }
+    }
+    for (int r = 0; r < MR; r++) {
+        float *c = C + r * ldc;
+        if (accumulate) {
+            acc[r][0] = _mm256_add_ps(acc[r][0], _mm256_loadu_ps(c));
+            acc[r][1] = _mm256_add_ps(acc[r][1], _mm256_loadu_ps(c + 8));
+        }
+        _mm256_storeu_ps(c, acc[r][0]);
+        _mm256_storeu_ps(c + 8, acc[r][1]);
+    }
+}
+
+// 8x32 tile: 16 zmm accumulators, two B loads and eight A broadcasts per k.
+__attribute__((target("avx512f")))
+void micro_kernel_avx512(int kc, const float *Ap, const float *Bp, float *C, int ldc, bool accumulate) {
+    const int MR = 8;
+    __m512 acc[MR][2];
+    for (int r = 0; r < MR; r++) {
+        acc[r][0] = _mm512_setzero_ps();
+        acc[r][1] = _mm512_setzero_ps();
+    }
+    for (int k = 0; k < kc; k++) {
+        const __m512 b0 = _mm512_load_ps(Bp + k * 32);
+        const __m512 b1 = _mm512_load_ps(Bp + k * 32 + 16);
+        for (int r = 0; r < MR; r++) {
+            const __m512 a = _mm512_set1_ps(Ap[k * MR + r]);
+            acc[r][0] = _mm512_fmadd_ps(a, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_ps(a, b1, acc[r][1]);
+        }
+    }
+    for (int r = 0; r < MR; r++) {
+        float *c = C + r * ldc;
+        if (accumulate) {
+            acc[r][0] = _mm512_add_ps(acc[r][0], _mm512_loadu_ps(c));
+            acc[r][1] = _mm512_add_ps(acc[r][1], _mm512_loadu_ps(c + 16));
+        }
+        _mm512_storeu_ps(c, acc[r][0]);
+        _mm512_storeu_ps(c + 16, acc[r][1]);
+    }
+}
+#endif
+
+const MicroKernelInfo &select_micro_kernel() {
+    static const MicroKernelInfo info = [] {
+#ifdef HOST_SGEMM_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return MicroKernelInfo{"avx512", 8, 32, micro_kernel_avx512};
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return MicroKernelInfo{"avx2", 6, 16, micro_kernel_avx2};
+        }
+#endif
+        return MicroKernelInfo{"generic", 4, 16, micro_kernel_generic<4, 16>};
+    }();
+    return info;
+}
+
+// Packs A(mc,kc) into row panels of mr: Ap[panel][k][r].
+void pack_a(int mc, int kc, int mr, const float *A, int lda, float *Ap) {
+    for (int i = 0; i < mc; i += mr) {
+        const int rows = std::min(mr, mc - i);
+        for (int k = 0; k < kc; k++) {
+            for (int r = 0; r < mr; r++) {
+                *Ap++ = r < rows ? A[(i + r) * lda + k] : 0.0f;
+            }
+        }
+    }
+}
+
+// Packs B(kc,nc) into column panels of nr: Bp[panel][k][c].
+void pack_b(int kc, int nc, int nr, const float *B, int ldb, float *Bp) {
+    for (int j = 0; j < nc; j += nr) {
+        const int cols = std::min(nr, nc - j);
+        for (int k = 0; k < kc; k++) {
+            const float *b = B + k * ldb + j;
+            for (int c = 0; c < nr; c++) {
+                *Bp++ = c < cols ? b[c] : 0.0f;
+            }
+        }
+    }
+}
+
+}
+
+const char *host_sgemm_kernel_name() {
+    return select_micro_kernel().name;
+}
+
+void host_sgemm(int M, int N, int K, const float *A, int lda, const float *B, int ldb, float *C, int ldc,
+                int threads) {
+    const auto &micro = select_micro_kernel();
+    const int mr = micro.mr;
+    const int nr = micro.nr;
+
+    if (K == 0) {
+        for (int i = 0; i < M; i++)
+            std::fill(C + i * ldc, C + i * ldc + N, 0.0f);
+        return;
+    }
+
+    const int tilesM = (M + MC - 1) / MC;
+    const int tilesN = (N + NC - 1) / NC;
+    const int tiles = tilesM * tilesN;
+    if (threads <= 0) {
+        threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    }
+    threads = std::min(threads, tiles);
+
+    std::atomic<int> next_tile{0};
+    auto worker = [&] {
+        auto Ap = aligned_floats(static_cast<size_t>(MC) * KC);
+        auto Bp = aligned_floats(static_cast<size_t>(KC) * NC);
+        auto tmp = aligned_floats(static_cast<size_t>(mr) * nr);
+
+        for (int tile = next_tile++; tile < tiles; tile = next_tile++) {
+            const int ic = (tile / tilesN) * MC;
+            const int jc = (tile % tilesN) * NC;
+            const int mc = std::min(MC, M - ic);
+            const int nc = std::min(NC, N - jc);
+
+            for (int pc = 0; pc < K; pc += KC) {
+                const int kc = std::min(KC, K - pc);
+                pack_b(kc, nc, nr, B + pc * ldb + jc, ldb, Bp.get());
+                pack_a(mc, kc, mr, A + ic * lda + pc, lda, Ap.get());
+
+                for (int jr = 0; jr < nc; jr += nr) {
+                    const int cols = std::min(nr, nc - jr);
+                    for (int ir = 0; ir < mc; ir += mr) {
+                        const int rows = std::min(mr, mc - ir);
+                        const float *a = Ap.get() + ir * kc;
+                        const float *b = Bp.get() + jr * kc;
+                        float *c = C + (ic + ir) * ldc + jc + jr;
+
+                        if (rows == mr && cols == nr) {
+                            micro.kernel(kc, a, b, c, ldc, pc != 0);
+                        } else {
+                            micro.kernel(kc, a, b, tmp.get(), nr, false);
+                            for (int r = 0; r < rows; r++) {
+                                for (int j = 0; j < cols; j++) {
+                                    c[r * ldc + j] = pc != 0 ? c[r * ldc + j] + tmp[r * nr + j] : tmp[r * nr + j];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread: pool) {
+        thread.join();
+    }
+}
+
+void par_mat_mul_packed(int N, std::span<const float> A, std::span<const float> B, std::span<float> C) {
+    host_sgemm(N, N, N, A.data(), N, B.data(), N, C.data(), N);
+}
+
+void host_strassen(int N, const float *A, int lda, const float *B, int ldb, float *C, int ldc, int cutoff) {
+    if (N <= cutoff || N % 2 != 0) {
+        host_sgemm(N, N, N, A, lda, B, ldb, C, ldc);
+        return;
+    }
+
+    const int h = N / 2;
+    // Z = X + sign * Y on h x h blocks, Z may be X or Y.
+    auto add = [h](const float *X, int ldx, float sign, const float *Y, int ldy, float *Z, int ldz) {
+        for (int i = 0; i < h; i++)
+            for (int j = 0; j < h; j++)
+                Z[i * ldz + j] = X[i * ldx + j] + sign * Y[i * ldy + j];
+    };
+
+    const float *A11 = A, *A12 = A + h, *A21 = A + h * lda, *A22 = A21 + h;
+    const float *B11 = B, *B12 = B + h, *B21 = B + h * ldb, *B22 = B21 + h;
+    float *C11 = C, *C12 = C + h, *C21 = C + h * ldc, *C22 = C21 + h;
+
+    // S1..S4, T1..T4 and P1..P7, contiguous h x h blocks.
+    std::vector<float> work(static_cast<size_t>(15) * h * h);
+    float *blocks[15];
+    for (int b = 0; b < 15; b++) blocks[b] = work.data() + static_cast<size_t>(b) * h * h;
+    float *S1 = blocks[0], *S2 = blocks[1], *S3 = blocks[2], *S4 = blocks[3];
+    float *T1 = blocks[4], *T2 = blocks[5], *T3 = blocks[6], *T4 = blocks[7];
+    float *P1 = blocks[8], *P2 = blocks[9], *P3 = blocks[10], *P4 = blocks[11];
+    float *P5 = blocks[12], *P6 = blocks[13], *P7 = blocks[14];
+
+    add(A21, lda, 1.0f, A22, lda, S1, h);
+    add(S1, h, -1.0f, A11, lda, S2, h);
+    add(A11, lda, -1.0f, A21, lda, S3, h);
+    add(A12, lda, -1.0f, S2, h, S4, h);
+    add(B12, ldb, -1.0f, B11, ldb, T1, h);
+    add(B22, ldb, -1.0f, T1, h, T2, h);
+    add(B22, ldb, -1.0f, B12, ldb, T3, h);
+    add(T2, h, -1.0f, B21, ldb, T4, h);
+
+    host_strassen(h, A11, lda, B11, ldb, P1, h, cutoff);
+    host_strassen(h, A12, lda, B21, ldb, P2, h, cutoff);
+    host_strassen(h, S4, h, B22, ldb, P3, h, cutoff);
+    host_strassen(h, A22, lda, T4, h, P4, h, cutoff);
+    host_strassen(h, S1, h, T1, h, P5, h, cutoff);
+    host_strassen(h, S2, h, T2, h, P6, h, cutoff);
+    host_strassen(h, S3, h, T3, h, P7, h, cutoff);
+
+    add(P1, h, 1.0f, P2, h, C11, ldc);
+    add(P1, h, 1.0f, P6, h, P6, h);       // U2
+    add(P6, h, 1.0f, P7, h, P7, h);       // U3
+    add(P7, h, 1.0f, P5, h, C22, ldc);
+    add(P6, h, 1.0f, P5, h, P5, h);       // U4
+    add(P5, h, 1.0f, P3, h, C12, ldc);
+    add(P7, h, -1.0f, P4, h, C21, ldc);
+}
+
+//------------------------------------------------------------------------------
+//
+//  Freivalds' check (see matrix_lib.hpp)
+//
+//------------------------------------------------------------------------------
+namespace {
+
+using DotKernel = double (*)(const float *row, const double *x, int n);
+
+double dot_generic(const float *row, const double *x, int n) {
+    double sum[4] = {};
+    int k = 0;
+    for (; k + 4 <= n; k += 4)
+        for (int l = 0; l < 4; l++)
+            sum[l] += row[k + l] * x[k + l];
+    for (; k < n; k++)
+        sum[0] += row[k] * x[k];
+    return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+#ifdef HOST_SGEMM_X86
+// Eight floats widened to two vectors of four doubles per step.
+__attribute__((target("avx2,fma")))
+double dot_avx2(const float *row, const double *x, int n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int k = 0;
+    for (; k + 8 <= n; k += 8) {
+        const __m256 v = _mm256_loadu_ps(row + k);
+        acc0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), _mm256_loadu_pd(x + k), acc0);
+        acc1 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)), _mm256_loadu_pd(x + k + 4), acc1);
+    }
+    const __m256d acc = _mm256_add_pd(acc0, acc1);
+    __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    pair = _mm_add_sd(pair, _mm_unpackhi_pd(pair, pair));
+    double sum = _mm_cvtsd_f64(pair);
+    for (; k < n; k++)
+        sum += row[k] * x[k];
+    return sum;
+}
+#endif
+
+DotKernel select_dot_kernel() {
+    static const DotKernel kernel = [] {
+#ifdef HOST_SGEMM_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return dot_avx2;
+        }
+#endif
+        return dot_generic;
+    }();
+    return kernel;
+}
+
+// y = X(rows,cols) * x for a row-major X, the rows split like fill_rows() splits them,
+// so each thread reads the pages it touched first.
+void host_matvec(int rows, int cols, const float *X, const double *x, double *y) {
+    const DotKernel dot = select_dot_kernel();
+    const size_t elements = static_cast<size_t>(rows) * cols;
+    util::parallelRows(rows, [=](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++)
+            y[i] = dot(X + i * cols, x, cols);
+    }, elements < PARALLEL_ROWS_ELEMENTS ? 1 : 0);
+}
+
+// Whether value is infinite or NaN, read from its exponent bits: with -ffast-math the compiler
+// may take std::isnan as false and drop comparisons that see NaN.
+bool nonFinite(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return (bits & 0x7ff0000000000000) == 0x7ff0000000000000;
+}
+
+} // namespace
+
+FreivaldsResult freivalds(int M, int N, int K, const float *A, const float *B, const float *C,
+                          int rounds, double tolerance, unsigned seed) {
+    std::mt19937 generator(seed);
+    std::bernoulli_distribution sign;
+    std::vector<double> r(N), Br(K), ABr(M), Cr(M);
+
+    FreivaldsResult result{true, 0.0};
+    for (int round = 0; round < rounds; round++) {
+        for (auto &value: r) value = sign(generator) ? 1.0 : -1.0;
+        host_matvec(K, N, B, r.data(), Br.data());
+        host_matvec(M, K, A, Br.data(), ABr.data());
+        host_matvec(M, N, C, r.data(), Cr.data());
+
+        // Infinite or NaN differences must fail the check, std::max would drop NaN.
+        bool finite = true;
+        double difference = 0.0, scale = 0.0;
+        for (int i = 0; i < M; i++) {
+            const double d = std::fabs(ABr[i] - Cr[i]);
+            if (nonFinite(d)) finite = false;
+            else difference = std::max(difference, d);
+            scale = std::max(scale, std::fabs(ABr[i]));
+        }
+        const double deviation = scale > 0.0 ? difference / scale : difference;
+        if (!finite) result.deviation = std::numeric_limits<double>::quiet_NaN();
+        else if (!nonFinite(result.deviation)) result.deviation = std::max(result.deviation, deviation);
+        result.passed = result.passed && finite && deviation <= tolerance;
+    }
+    return result;
+}
+
 //------------------------------------------------------------------------------
 //
 //  Function to initialize the input matrices A and B
 //
 //------------------------------------------------------------------------------
-void initmat(int N, std::vector<float> &A, std::vector<float> &B, std::vector<float> &C) {
-    for (int i = 0; i < N; i++)
-        for (int j = 0; j < N; j++)
-            A[i * N + j] = AVAL;
+namespace {
 
-    for (int i = 0; i < N; i++)
-        for (int j = 0; j < N; j++)
-            B[i * N + j] = BVAL;
+// X(rows,cols) = value, rows split over the cores as in util::parallelRows.
+template<typename T>
+void fill_rows(int rows, int cols, T *X, T value) {
+    const size_t elements = static_cast<size_t>(rows) * cols;
+    util::parallelRows(rows, [=](size_t first, size_t last) {
+        std::fill(X + first * cols, X + last * cols, value);
+    }, elements < PARALLEL_ROWS_ELEMENTS ? 1 : 0);
+}
+
+} // namespace
 
-    zero_mat(N, C);
+template<typename T, typename Allocator>
+void initmat(int N, std::vector<T, Allocator> &A, std::vector<T, Allocator> &B, std::vector<T, Allocator> &C) {
+    initmat(N, N, N, A, B, C);
+}
+
+template<typename T, typename Allocator>
+void initmat(int M, int N, int K, std::vector<T, Allocator> &A, std::vector<T, Allocator> &B,
+             std::vector<T, Allocator> &C) {
+    fill_rows(M, K, A.data(), static_cast<T>(AVAL));
+    fill_rows(K, N, B.data(), static_cast<T>(BVAL));
+    fill_rows(M, N, C.data(), T(0));
 }
 
 //------------------------------------------------------------------------------
@@ -83,10 +527,9 @@ void initmat(int N, std::vector<float> &A, std::vector<float> &B, std::vector<fl
 //  Function to set a matrix to zero
 //
 //------------------------------------------------------------------------------
-void zero_mat(int N, std::vector<float> &C) {
-    for (int i = 0; i < N; i++)
-        for (int j = 0; j < N; j++)
-            C[i * N + j] = 0.0f;
+template<typename T, typename Allocator>
+void zero_mat(int N, std::vector<T, Allocator> &C) {
+    fill_rows(N, N, C.data(), T(0));
 }
 
 //------------------------------------------------------------------------------
@@ -94,7 +537,8 @@ void zero_mat(int N, std::vector<float> &C) {
 //  Function to fill Btrans(N,N) with transpose of B(N,N)
 //
 //------------------------------------------------------------------------------
-void trans(int N, std::vector<float> &B, std::vector<float> &Btrans) {
+template<typename T, typename Allocator>
+void trans(int N, std::vector<T, Allocator> &B, std::vector<T, Allocator> &Btrans) {
     int i, j;
 
     for (i = 0; i < N; i++)
@@ -102,18 +546,80 @@ void trans(int N, std::vector<float> &B, std::vector<float> &Btrans) {
             Btrans[j * N + i] = B[i * N + j];
 }
 
+//------------------------------------------------------------------------------
+//
+//  Functions to convert between float and IEEE half
+//
+//------------------------------------------------------------------------------
+cl_half float_to_half(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const auto sign = static_cast<cl_half>((bits >> 16) & 0x8000);
+    const uint32_t magnitude = bits & 0x7fffffff;
+
+    if (magnitude >= 0x7f800000) {                 // infinity or NaN, keep NaN quiet
+        return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x0200 : 0);
+    }
+    if (magnitude >= 0x477ff000) {                 // 65520 and above round to infinity
+        return sign | 0x7c00;
+    }
+    if (magnitude < 0x38800000) {                  // below 2^-14: subnormal half, in units of 2^-24
+        float absolute;
+        std::memcpy(&absolute, &magnitude, sizeof(absolute));
+        return sign | static_cast<cl_half>(std::nearbyint(absolute * 16777216.0f));
+    }
+    // Rebias the exponent from 127 to 15 and round the 13 dropped bits to nearest even.
+    uint32_t rebiased = magnitude - 0x38000000;
+    rebiased += 0x0fff + ((rebiased >> 13) & 1);
+    return sign | static_cast<cl_half>(rebiased >> 13);
+}
+
+float half_to_float(cl_half value) {
+    const uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+    const uint32_t exponent = (value >> 10) & 0x1f;
+    const uint32_t mantissa = value & 0x03ff;
+
+    if (exponent == 0) {                           // zero or subnormal
+        const float magnitude = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -magnitude : magnitude;
+    }
+    uint32_t bits = sign | (mantissa << 13);
+    bits |= exponent == 0x1f ? 0x7f800000 : (exponent + 112) << 23;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+std::vector<cl_half> to_half(std::span<const float> values) {
+    std::vector<cl_half> result(values.size());
+    std::transform(values.begin(), values.end(), result.begin(), float_to_half);
+    return result;
+}
+
+std::vector<float> to_float(const std::vector<cl_half> &values) {
+    std::vector<float> result(values.size());
+    std::transform(values.begin(), values.end(), result.begin(), half_to_float);
+    return result;
+}
+
 //------------------------------------------------------------------------------
 //
 //  Function to compute errors of the product matrix
 //
 //------------------------------------------------------------------------------
-float error(int N, std::vector<float> &C) {
+template<typename T, typename Allocator>
+T error(int N, std::vector<T, Allocator> &C) {
+    return error(N, N, N, C);
+}
+
+template<typename T, typename Allocator>
+T error(int M, int N, int K, std::vector<T, Allocator> &C) {
     int i, j;
-    float cval, errsq, err;
-    cval = (float) N * AVAL * BVAL;
-    errsq = 0.0f;
+    T cval, errsq, err;
+    cval = (T) K * AVAL * BVAL;
+    errsq = 0;
 
-    for (i = 0; i < N; i++) {
+    for (i = 0; i < M; i++) {
         for (j = 0; j < N; j++) {
             err = C[i * N + j] - cval;
             errsq += err * err;
@@ -124,14 +630,826 @@ float error(int N, std::vector<float> &C) {
 
 //------------------------------------------------------------------------------
 //
-//  Function to analyze and output results
+//  Function to report errors of the product matrix
 //
 //------------------------------------------------------------------------------
-void results(int N, std::vector<float> &C, double run_time) {
-    float mflops = 2.0 * N * N * N / (1000000.0f * run_time);
-    printf(" %.4f seconds at %.1f MFLOPS \n", run_time, mflops);
-    float errsq = error(N, C);
+template<typename T, typename Allocator>
+void check(int N, std::vector<T, Allocator> &C) {
+    check(N, N, N, C);
+}
+
+template<typename T, typename Allocator>
+void check(int M, int N, int K, std::vector<T, Allocator> &C) {
+    T errsq = error(M, N, K, C);
     if (std::isnan(errsq) || errsq > TOL)
         printf("\n Errors in multiplication: %f\n", errsq);
 }
 
+//------------------------------------------------------------------------------
+//
+//  Function to analyze and output results
+//
+//------------------------------------------------------------------------------
+template<typename T, typename Allocator>
+void results(int N, std::vector<T, Allocator> &C, double run_time) {
+    results(N, N, N, C, run_time);
+}
+
+template<typename T, typename Allocator>
+void results(int M, int N, int K, std::vector<T, Allocator> &C, double run_time) {
+    float mflops = 2.0 * M * N * K / (1000000.0f * run_time);
+    printf(" %.4f seconds at %.1f MFLOPS \n", run_time, mflops);
+    check(M, N, K, C);
+}
+
+#define INSTANTIATE_MATRIX_FUNCTIONS(T, Allocator)                                                          \
+    template void seq_mat_mul_sdot(int, std::vector<T, Allocator> &, std::vector<T, Allocator> &,           \
+                                   std::vector<T, Allocator> &);                                            \
+    template void better_seq_mat_mul_sdot(int, std::vector<T, Allocator> &, std::vector<T, Allocator> &,    \
+                                          std::vector<T, Allocator> &);                                     \
+    template void initmat(int, std::vector<T, Allocator> &, std::vector<T, Allocator> &,                    \
+                          std::vector<T, Allocator> &);                                                     \
+    template void initmat(int, int, int, std::vector<T, Allocator> &, std::vector<T, Allocator> &,          \
+                          std::vector<T, Allocator> &);                                                     \
+    template void zero_mat(int, std::vector<T, Allocator> &);                                               \
+    template void trans(int, std::vector<T, Allocator> &, std::vector<T, Allocator> &);                     \
+    template T error(int, std::vector<T, Allocator> &);                                                     \
+    template T error(int, int, int, std::vector<T, Allocator> &);                                           \
+    template void check(int, std::vector<T, Allocator> &);                                                  \
+    template void check(int, int, int, std::vector<T, Allocator> &);                                        \
+    template void results(int, std::vector<T, Allocator> &, double);                                        \
+    template void results(int, int, int, std::vector<T, Allocator> &, double);
+
+INSTANTIATE_MATRIX_FUNCTIONS(float, std::allocator<float>)
+INSTANTIATE_MATRIX_FUNCTIONS(double, std::allocator<double>)
+INSTANTIATE_MATRIX_FUNCTIONS(float, util::FirstTouchAllocator<float>)
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL product of rectangular matrices
+//
+//------------------------------------------------------------------------------
+template<typename T, typename Storage>
+BasicBlockGemm<T, Storage>::BasicBlockGemm(const cl::Context &context, int blksz, bool accumulate,
+                                           const Epilogue &epilogue) :
+        blksz(blksz),
+        epilogue(epilogue),
+        context(context),
+        kernel(util::buildProgram(context, scalarDefines<T>() + storageDefines<Storage>() +
+                                           "#define blksz " + std::to_string(blksz) + "\n" +
+                                           (accumulate ? "#define ACCUMULATE\n" : "") + epilogue.defines() +
+                                           BLOCK_MULTIPLICATION_MNK), "mmul") {
+    if (accumulate && !epilogue.isIdentity()) {
+        throw std::invalid_argument("An accumulating product has no epilogue");
+    }
+}
+
+template<typename T, typename Storage>
+cl::Event BasicBlockGemm<T, Storage>::enqueue(cl::CommandQueue &queue, int M, int N, int K,
+                                              const cl::Buffer &A, const cl::Buffer &B, const cl::Buffer &C,
+                                              const cl::Buffer &bias) const {
+    // Round the NDRange up to whole blocks, the kernel skips work-items outside of C.
+    size_t rows = (M + blksz - 1) / blksz * blksz;
+    size_t cols = (N + blksz - 1) / blksz * blksz;
+    auto args = cl::EnqueueArgs(queue, cl::NDRange(cols, rows), cl::NDRange(blksz, blksz));
+
+    if (epilogue.isIdentity()) {
+        auto mmul = cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer,
+                cl::LocalSpaceArg, cl::LocalSpaceArg>(kernel);
+        return mmul(args, M, N, K, A, B, C,
+                    cl::Local(sizeof(T) * blksz * blksz),
+                    cl::Local(sizeof(T) * blksz * blksz));
+    }
+    auto mmul = cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer,
+            cl::LocalSpaceArg, cl::LocalSpaceArg, T, T, cl::Buffer>(kernel);
+    return mmul(args, M, N, K, A, B, C,
+                cl::Local(sizeof(T) * blksz * blksz),
+                cl::Local(sizeof(T) * blksz * blksz),
+                static_cast<T>(epilogue.alpha), static_cast<T>(epilogue.beta), bias);
+}
+
+template<typename T, typename Storage>
+void BasicBlockGemm<T, Storage>::multiply(cl::CommandQueue &queue, int M, int N, int K,
+                                          std::span<const Storage> A, std::span<const Storage> B, std::span<T> C,
+                                          std::vector<cl::Event> *events) const {
+    auto d_a = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(Storage) * M * K);
+    auto d_b = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(Storage) * K * N);
+    auto d_c = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(T) * M * N);
+    cl::Event write_a, write_b, read_c;
+    queue.enqueueWriteBuffer(d_a, CL_FALSE, 0, sizeof(Storage) * M * K, A.data(), nullptr, &write_a);
+    queue.enqueueWriteBuffer(d_b, CL_FALSE, 0, sizeof(Storage) * K * N, B.data(), nullptr, &write_b);
+
+    cl::Event kernel = enqueue(queue, M, N, K, d_a, d_b, d_c);
+
+    queue.enqueueReadBuffer(d_c, CL_TRUE, 0, sizeof(T) * M * N, C.data(), nullptr, &read_c);
+
+    if (events != nullptr) {
+        events->insert(events->end(), {write_a, write_b, kernel, read_c});
+    }
+}
+
+template<typename T, typename Storage>
+bool BasicBlockGemm<T, Storage>::supports(const cl::Device &device) const {
+    return static_cast<size_t>(blksz * blksz) <= kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+}
+
+template class BasicBlockGemm<float>;
+template class BasicBlockGemm<double>;
+template class BasicBlockGemm<float, cl_half>;
+
+//------------------------------------------------------------------------------
+//
+//  The epilogue as separate passes
+//
+//------------------------------------------------------------------------------
+EpiloguePasses::EpiloguePasses(const cl::Context &context, const Epilogue &epilogue) :
+        epilogue(epilogue) {
+    const auto program = util::buildProgram(context, epilogue.defines() + GEMM_EPILOGUE + EPILOGUE_PASSES);
+    scale = cl::Kernel(program, "scale");
+    addBias = cl::Kernel(program, "add_bias");
+    activation = cl::Kernel(program, "activation");
+}
+
+std::vector<cl::Event> EpiloguePasses::enqueue(cl::CommandQueue &queue, int M, int N,
+                                               const cl::Buffer &P, const cl::Buffer &bias,
+                                               const cl::Buffer &C) const {
+    const int count = M * N;
+    std::vector<cl::Event> events;
+
+    if (epilogue.alpha != 1.0 || epilogue.beta != 0.0 || P() != C()) {
+        auto pass = cl::KernelFunctor<int, float, float, cl::Buffer, cl::Buffer>(scale);
+        events.push_back(pass(cl::EnqueueArgs(queue, cl::NDRange(count)), count,
+                               static_cast<float>(epilogue.alpha), static_cast<float>(epilogue.beta), P, C));
+    }
+    if (epilogue.bias != BiasMode::None) {
+        auto pass = cl::KernelFunctor<int, int, cl::Buffer, cl::Buffer>(addBias);
+        events.push_back(pass(cl::EnqueueArgs(queue, cl::NDRange(N, M)), M, N, bias, C));
+    }
+    if (epilogue.activation != Activation::None) {
+        auto pass = cl::KernelFunctor<int, cl::Buffer>(activation);
+        events.push_back(pass(cl::EnqueueArgs(queue, cl::NDRange(count)), count, C));
+    }
+    return events;
+}
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL product of square matrices of any order
+//
+//------------------------------------------------------------------------------
+SquareGemm::SquareGemm(const cl::Context &context, int blksz, size_t specializeAfter) :
+        blksz(blksz),
+        cache(context, specializeAfter) {
+}
+
+cl::Event SquareGemm::enqueue(cl::CommandQueue &queue, int n,
+                              const cl::Buffer &A, const cl::Buffer &B, const cl::Buffer &C,
+                              bool *specialized) const {
+    const std::string blocks = "#define blksz " + std::to_string(blksz) + "\n";
+    auto source = [&blocks](std::optional<size_t> order) {
+        if (!order) return scalarDefines<float>() + blocks + BLOCK_MULTIPLICATION_MNK;
+        return "#define N " + std::to_string(*order) + "\n" + blocks + BLOCK_MULTIPLICATION;
+    };
+    const auto program = n % blksz == 0
+                         ? cache.get("block", n, blksz, source)
+                         : util::Specialization{cache.generic("block", blksz, source), false};
+    if (specialized != nullptr) *specialized = program.specialized;
+
+    const auto block = cl::Local(sizeof(float) * blksz * blksz);
+    if (program.specialized) {
+        auto mmul = cl::KernelFunctor<cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg, cl::LocalSpaceArg>(
+                kernel(program.program));
+        return mmul(cl::EnqueueArgs(queue, cl::NDRange(n, n), cl::NDRange(blksz, blksz)), A, B, C, block, block);
+    }
+
+    // Rounded up to whole blocks, as in BasicBlockGemm.
+    const size_t padded = (n + blksz - 1) / blksz * blksz;
+    auto mmul = cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer,
+            cl::LocalSpaceArg, cl::LocalSpaceArg>(kernel(program.program));
+    return mmul(cl::EnqueueArgs(queue, cl::NDRange(padded, padded), cl::NDRange(blksz, blksz)),
+                n, n, n, A, B, C, block, block);
+}
+
+cl::Kernel SquareGemm::kernel(const cl::Program &program) const {
+    // The cache keeps its programs, so their handles aren't reused while this lives.
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = kernels.find(program());
+    if (found == kernels.end()) found = kernels.emplace(program(), cl::Kernel(program, "mmul")).first;
+    return found->second;
+}
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL product streamed in row panels
+//
+//------------------------------------------------------------------------------
+PipelinedGemm::PipelinedGemm(const cl::Context &context, const cl::Device &device, int panelRows, int slots,
+                             int blksz) :
+        panelRows(panelRows),
+        slots(std::max(2, slots)),
+        context(context),
+        upload(context, device),
+        compute(context, device),
+        download(context, device),
+        gemm(context, blksz) {
+}
+
+void PipelinedGemm::multiply(int M, int N, int K, std::span<const float> A, std::span<const float> B,
+                             std::span<float> C) {
+    const int panels = (M + panelRows - 1) / panelRows;
+    const int used = std::min(slots, panels);
+
+    cl::Buffer d_b(context, CL_MEM_READ_ONLY, sizeof(float) * K * N);
+    std::vector<cl::Buffer> a_slots, c_slots;
+    for (int s = 0; s < used; s++) {
+        a_slots.emplace_back(context, CL_MEM_READ_ONLY, sizeof(float) * panelRows * K);
+        c_slots.emplace_back(context, CL_MEM_WRITE_ONLY, sizeof(float) * panelRows * N);
+    }
+
+    cl::Event write_b;
+    upload.enqueueWriteBuffer(d_b, CL_FALSE, 0, sizeof(float) * K * N, B.data(), nullptr, &write_b);
+    upload.flush();
+
+    std::vector<cl::Event> written(panels), computed(panels), read(panels);
+    for (int p = 0; p < panels; p++) {
+        const int slot = p % used;
+        const int start = p * panelRows;
+        const int rows = std::min(panelRows, M - start);
+
+        // A slot is reused once the kernel of the panel before has read it.
+        std::vector<cl::Event> a_free;
+        if (p >= used) a_free.push_back(computed[p - used]);
+        upload.enqueueWriteBuffer(a_slots[slot], CL_FALSE, 0, sizeof(float) * rows * K,
+                                  A.data() + static_cast<size_t>(start) * K,
+                                  a_free.empty() ? nullptr : &a_free, &written[p]);
+
+        // C slot is reused once the panel before was read back.
+        std::vector<cl::Event> ready{written[p], write_b};
+        if (p >= used) ready.push_back(read[p - used]);
+        compute.enqueueBarrierWithWaitList(&ready);
+        computed[p] = gemm.enqueue(compute, rows, N, K, a_slots[slot], d_b, c_slots[slot]);
+
+        std::vector<cl::Event> c_done{computed[p]};
+        download.enqueueReadBuffer(c_slots[slot], CL_FALSE, 0, sizeof(float) * rows * N,
+                                   C.data() + static_cast<size_t>(start) * N, &c_done, &read[p]);
+
+        // Submit now, so the device starts on the panel while the next one is enqueued.
+        upload.flush();
+        compute.flush();
+        download.flush();
+    }
+    download.finish();
+}
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL product of matrices in files
+//
+//------------------------------------------------------------------------------
+namespace {
+
+struct OutOfCoreStep {
+    int row;      // first row of the C tile
+    int col;      // first column of the C tile
+    int depth;    // first column of A and row of B of the slice
+};
+
+// The steps of a product in execution order. Consecutive C tiles are neighbours and
+// the slices of consecutive tiles run in opposite directions, so the tiles of A or B
+// at the turns are still in their buffers.
+std::vector<OutOfCoreStep> outOfCoreOrder(int M, int N, int K, const OutOfCoreGemm::Tiling &tiling) {
+    const int tileRows = (M + tiling.rows - 1) / tiling.rows;
+    const int tileCols = (N + tiling.cols - 1) / tiling.cols;
+    const int slices = (K + tiling.depth - 1) / tiling.depth;
+    const int outer = tiling.rowsFirst ? tileRows : tileCols;
+    const int inner = tiling.rowsFirst ? tileCols : tileRows;
+
+    std::vector<OutOfCoreStep> steps;
+    bool forward = true;
+    for (int o = 0; o < outer; o++) {
+        for (int n = 0; n < inner; n++) {
+            const int in = o % 2 == 0 ? n : inner - 1 - n;
+            const int row = (tiling.rowsFirst ? o : in) * tiling.rows;
+            const int col = (tiling.rowsFirst ? in : o) * tiling.cols;
+            for (int d = 0; d < slices; d++) {
+                steps.push_back({row, col, (forward ? d : slices - 1 - d) * tiling.depth});
+            }
+            forward = !forward;
+        }
+    }
+    return steps;
+}
+
+// Bytes of A and B uploaded by the steps, a tile is uploaded when it isn't the one in its buffer.
+size_t outOfCoreUploads(int M, int N, int K, const OutOfCoreGemm::Tiling &tiling,
+                        const std::vector<OutOfCoreStep> &steps) {
+    size_t bytes = 0;
+    std::pair<int, int> a{-1, -1}, b{-1, -1};
+    for (const auto &step: steps) {
+        const size_t rows = std::min(tiling.rows, M - step.row);
+        const size_t cols = std::min(tiling.cols, N - step.col);
+        const size_t depth = std::min(tiling.depth, K - step.depth);
+        if (a != std::make_pair(step.row, step.depth)) {
+            a = {step.row, step.depth};
+            bytes += sizeof(float) * rows * depth;
+        }
+        if (b != std::make_pair(step.depth, step.col)) {
+            b = {step.depth, step.col};
+            bytes += sizeof(float) * depth * cols;
+        }
+    }
+    return bytes;
+}
+
+} // namespace
+
+OutOfCoreGemm::OutOfCoreGemm(const cl::Context &context, const cl::Device &device, size_t deviceBytes, int blksz) :
+        deviceBytes(deviceBytes),
+        maxAlloc(device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()),
+        blksz(blksz),
+        context(context),
+        queue(context, device),
+        assign(context, blksz),
+        accumulate(context, blksz, true) {
+}
+
+OutOfCoreGemm::Tiling OutOfCoreGemm::plan(int M, int N, int K) const {
+    auto fits = [&](size_t rows, size_t cols, size_t depth) {
+        const size_t a = sizeof(float) * rows * depth;
+        const size_t b = sizeof(float) * depth * cols;
+        const size_t c = sizeof(float) * rows * cols;
+        return a + b + c <= deviceBytes && std::max({a, b, c}) <= maxAlloc;
+    };
+
+    // The largest square C tile, in whole blocks, with full-depth panels and with square slices.
+    std::vector<Tiling> candidates;
+    const int largest = (std::max({M, N, K}) + blksz - 1) / blksz * blksz;
+    for (bool fullDepth: {true, false}) {
+        for (int t = largest; t >= blksz; t -= blksz) {
+            const int rows = std::min(t, M), cols = std::min(t, N), depth = fullDepth ? K : std::min(t, K);
+            if (fits(rows, cols, depth)) {
+                candidates.push_back({rows, cols, depth, true, 0});
+                candidates.push_back({rows, cols, depth, false, 0});
+                break;
+            }
+        }
+    }
+    if (candidates.empty()) {
+        throw std::runtime_error("Out-of-core GEMM: " + std::to_string(deviceBytes) +
+                                 " bytes of device memory don't hold one tile");
+    }
+
+    for (auto &tiling: candidates) {
+        tiling.uploaded = outOfCoreUploads(M, N, K, tiling, outOfCoreOrder(M, N, K, tiling));
+    }
+    return *std::min_element(candidates.begin(), candidates.end(), [](const Tiling &x, const Tiling &y) {
+        return x.uploaded < y.uploaded;
+    });
+}
+
+OutOfCoreGemm::Traffic OutOfCoreGemm::multiply(int M, int N, int K,
+                                               const MappedFile &A, const MappedFile &B, MappedFile &C) {
+    if (A.size() < sizeof(float) * M * K || B.size() < sizeof(float) * K * N || C.size() < sizeof(float) * M * N) {
+        throw std::runtime_error("Out-of-core GEMM: a file is smaller than its matrix");
+    }
+    const Tiling tiling = plan(M, N, K);
+    const auto steps = outOfCoreOrder(M, N, K, tiling);
+
+    cl::Buffer d_a(context, CL_MEM_READ_ONLY, sizeof(float) * tiling.rows * tiling.depth);
+    cl::Buffer d_b(context, CL_MEM_READ_ONLY, sizeof(float) * tiling.depth * tiling.cols);
+    cl::Buffer d_c(context, CL_MEM_READ_WRITE, sizeof(float) * tiling.rows * tiling.cols);
+
+    Traffic traffic;
+    std::pair<int, int> a{-1, -1}, b{-1, -1};
+    for (size_t s = 0; s < steps.size(); s++) {
+        const auto &step = steps[s];
+        const size_t rows = std::min(tiling.rows, M - step.row);
+        const size_t cols = std::min(tiling.cols, N - step.col);
+        const size_t depth = std::min(tiling.depth, K - step.depth);
+
+        // Tiles are copied from the mappings row by row, into compact buffers.
+        if (a != std::make_pair(step.row, step.depth)) {
+            a = {step.row, step.depth};
+            queue.enqueueWriteBufferRect(d_a, CL_FALSE, {0, 0, 0},
+                                         {sizeof(float) * step.depth, static_cast<size_t>(step.row), 0},
+                                         {sizeof(float) * depth, rows, 1},
+                                         sizeof(float) * depth, 0, sizeof(float) * K, 0, A.floats());
+            traffic.uploaded += sizeof(float) * rows * depth;
+        }
+        if (b != std::make_pair(step.depth, step.col)) {
+            b = {step.depth, step.col};
+            queue.enqueueWriteBufferRect(d_b, CL_FALSE, {0, 0, 0},
+                                         {sizeof(float) * step.col, static_cast<size_t>(step.depth), 0},
+                                         {sizeof(float) * cols, depth, 1},
+                                         sizeof(float) * cols, 0, sizeof(float) * N, 0, B.floats());
+            traffic.uploaded += sizeof(float) * depth * cols;
+        }
+
+        const bool first = s == 0 || steps[s - 1].row != step.row || steps[s - 1].col != step.col;
+        const bool last = s + 1 == steps.size() || steps[s + 1].row != step.row || steps[s + 1].col != step.col;
+        (first ? assign : accumulate).enqueue(queue, static_cast<int>(rows), static_cast<int>(cols),
+                                              static_cast<int>(depth), d_a, d_b, d_c);
+
+        if (last) {
+            queue.enqueueReadBufferRect(d_c, CL_TRUE, {0, 0, 0},
+                                        {sizeof(float) * step.col, static_cast<size_t>(step.row), 0},
+                                        {sizeof(float) * cols, rows, 1},
+                                        sizeof(float) * cols, 0, sizeof(float) * N, 0, C.floats());
+            C.flush(sizeof(float) * step.row * N, sizeof(float) * rows * N);
+            traffic.downloaded += sizeof(float) * rows * cols;
+        }
+    }
+    queue.finish();
+    return traffic;
+}
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL tiled transpose
+//
+//------------------------------------------------------------------------------
+DeviceTranspose::DeviceTranspose(const cl::Context &context, int tile) :
+        tile(tile),
+        kernel(util::buildProgram(context, "#define TILE " + std::to_string(tile) + "\n" + TILED_TRANSPOSE),
+               "transpose") {
+}
+
+cl::Event DeviceTranspose::enqueue(cl::CommandQueue &queue, int rows, int cols,
+                                   const cl::Buffer &B, const cl::Buffer &Bt) const {
+    auto transpose = cl::KernelFunctor<int, int, cl::Buffer, cl::Buffer>(kernel);
+
+    size_t height = (rows + tile - 1) / tile * tile;
+    size_t width = (cols + tile - 1) / tile * tile;
+
+    return transpose(
+            cl::EnqueueArgs(
+                    queue,
+                    cl::NDRange(width, height),
+                    cl::NDRange(tile, tile)),
+            rows, cols, B, Bt);
+}
+
+bool DeviceTranspose::supports(const cl::Device &device) const {
+    return static_cast<size_t>(tile * tile) <= kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+}
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL matrix-vector products and rank-1 update
+//
+//------------------------------------------------------------------------------
+DeviceGemv::DeviceGemv(const cl::Context &context, int group, int tile, int lanes) :
+        group(group),
+        tile(tile),
+        lanes(lanes) {
+    if (group <= 0 || (group & (group - 1)) != 0) {
+        throw std::invalid_argument("The work-group of gemv_n must be a power of two");
+    }
+    const auto program = util::buildProgram(context, "#define GEMV_GROUP " + std::to_string(group) + "\n" +
+                                                     "#define GEMV_TILE " + std::to_string(tile) + "\n" +
+                                                     "#define GEMV_LANES " + std::to_string(lanes) + "\n" +
+                                                     GEMV_N + GEMV_T + GER);
+    gemvNKernel = cl::Kernel(program, "gemv_n");
+    gemvTKernel = cl::Kernel(program, "gemv_t");
+    gerKernel = cl::Kernel(program, "ger");
+}
+
+cl::Event DeviceGemv::gemvN(cl::CommandQueue &queue, int M, int N, float alpha, const cl::Buffer &A,
+                            const cl::Buffer &x, float beta, const cl::Buffer &y) const {
+    auto gemv = cl::KernelFunctor<int, int, float, float, cl::Buffer, cl::Buffer, cl::Buffer,
+            cl::LocalSpaceArg>(gemvNKernel);
+    return gemv(cl::EnqueueArgs(queue, cl::NDRange(static_cast<size_t>(M) * group), cl::NDRange(group)),
+                M, N, alpha, beta, A, x, y, cl::Local(sizeof(float) * group));
+}
+
+cl::Event DeviceGemv::gemvT(cl::CommandQueue &queue, int M, int N, float alpha, const cl::Buffer &A,
+                            const cl::Buffer &x, float beta, const cl::Buffer &y) const {
+    auto gemv = cl::KernelFunctor<int, int, float, float, cl::Buffer, cl::Buffer, cl::Buffer>(gemvTKernel);
+    const size_t width = (N + tile - 1) / tile * tile;
+    return gemv(cl::EnqueueArgs(queue, cl::NDRange(width, lanes), cl::NDRange(tile, lanes)),
+                M, N, alpha, beta, A, x, y);
+}
+
+cl::Event DeviceGemv::ger(cl::CommandQueue &queue, int M, int N, float alpha, const cl::Buffer &x,
+                          const cl::Buffer &y, const cl::Buffer &A) const {
+    auto ger = cl::KernelFunctor<int, int, float, cl::Buffer, cl::Buffer, cl::Buffer>(gerKernel);
+    // Rows of tile consecutive columns, like the reads of gemv_t.
+    const size_t width = (N + tile - 1) / tile * tile;
+    const size_t height = (M + lanes - 1) / lanes * lanes;
+    return ger(cl::EnqueueArgs(queue, cl::NDRange(width, height), cl::NDRange(tile, lanes)),
+               M, N, alpha, x, y, A);
+}
+
+bool DeviceGemv::supports(const cl::Device &device) const {
+    const size_t rows = gemvNKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+    const size_t columns = gemvTKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+    const size_t updates = gerKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+    return static_cast<size_t>(group) <= rows && static_cast<size_t>(tile * lanes) <= std::min(columns, updates);
+}
+
+// A once, x once, y written and with beta != 0 read too.
+double gemv_bytes(int M, int N, bool transposed, float beta) {
+    const double in = transposed ? M : N;
+    const double out = transposed ? N : M;
+    return sizeof(float) * (static_cast<double>(M) * N + in + out * (beta != 0.0f ? 2 : 1));
+}
+
+// A read and written, x and y read once.
+double ger_bytes(int M, int N) {
+    return sizeof(float) * (2.0 * M * N + M + N);
+}
+
+void host_sgemv(bool transposed, int M, int N, float alpha, const float *A, const float *x, float beta, float *y) {
+    // Both walk A along its rows, the transposed product adds every row to all the sums.
+    std::vector<double> sums(transposed ? N : M, 0.0);
+    for (int i = 0; i < M; i++) {
+        const float *row = A + static_cast<size_t>(i) * N;
+        for (int j = 0; j < N; j++) {
+            if (transposed) sums[j] += static_cast<double>(row[j]) * x[i];
+            else sums[i] += static_cast<double>(row[j]) * x[j];
+        }
+    }
+    for (size_t i = 0; i < sums.size(); i++) {
+        y[i] = static_cast<float>(alpha * sums[i] + (beta != 0.0f ? beta * y[i] : 0.0));
+    }
+}
+
+void host_sger(int M, int N, float alpha, const float *x, const float *y, float *A) {
+    for (int i = 0; i < M; i++)
+        for (int j = 0; j < N; j++)
+            A[static_cast<size_t>(i) * N + j] += alpha * x[i] * y[j];
+}
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL products of a batch of small matrices
+//
+//------------------------------------------------------------------------------
+BatchedGemm::BatchedGemm(const cl::Context &context, int blksz) :
+        blksz(blksz),
+        strided(util::buildProgram(context, "#define blksz " + std::to_string(blksz) + "\n" +
+                                            BLOCK_MULTIPLICATION_BATCHED), "mmul"),
+        indexed(util::buildProgram(context, "#define blksz " + std::to_string(blksz) + "\n" +
+                                            "#define POINTER_ARRAY\n" + BLOCK_MULTIPLICATION_BATCHED), "mmul") {
+}
+
+cl::NDRange BatchedGemm::global(int M, int N, int batch) const {
+    size_t rows = (M + blksz - 1) / blksz * blksz;
+    size_t cols = (N + blksz - 1) / blksz * blksz;
+    return {cols, rows, static_cast<size_t>(batch)};
+}
+
+cl::Event BatchedGemm::enqueueStrided(cl::CommandQueue &queue, int M, int N, int K, int batch,
+                                      const cl::Buffer &A, int strideA,
+                                      const cl::Buffer &B, int strideB,
+                                      const cl::Buffer &C, int strideC) const {
+    auto mmul = cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer, int, int, int,
+            cl::LocalSpaceArg, cl::LocalSpaceArg>(strided);
+    return mmul(
+            cl::EnqueueArgs(
+                    queue,
+                    global(M, N, batch),
+                    cl::NDRange(blksz, blksz, 1)),
+            M, N, K,
+            A, B, C,
+            strideA, strideB, strideC,
+            cl::Local(sizeof(float) * blksz * blksz),
+            cl::Local(sizeof(float) * blksz * blksz));
+}
+
+cl::Event BatchedGemm::enqueueIndexed(cl::CommandQueue &queue, int M, int N, int K, int batch,
+                                      const cl::Buffer &A, const cl::Buffer &B, const cl::Buffer &C,
+                                      const cl::Buffer &offsets) const {
+    auto mmul = cl::KernelFunctor<int, int, int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
+            cl::LocalSpaceArg, cl::LocalSpaceArg>(indexed);
+    return mmul(
+            cl::EnqueueArgs(
+                    queue,
+                    global(M, N, batch),
+                    cl::NDRange(blksz, blksz, 1)),
+            M, N, K,
+            A, B, C,
+            offsets,
+            cl::Local(sizeof(float) * blksz * blksz),
+            cl::Local(sizeof(float) * blksz * blksz));
+}
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL square product with the Strassen-Winograd recursion
+//
+//------------------------------------------------------------------------------
+StrassenGemm::StrassenGemm(const cl::Context &context, int cutoff, int blksz) :
+        cutoff(cutoff),
+        base(context, blksz),
+        addKernel(util::buildProgram(context, MATRIX_ADD), "add"),
+        pool(context) {
+}
+
+void StrassenGemm::add(cl::CommandQueue &queue, int count, const cl::Buffer &X, float sign, const cl::Buffer &Y,
+                       const cl::Buffer &Z) const {
+    auto kernel = cl::KernelFunctor<int, cl::Buffer, float, cl::Buffer, cl::Buffer>(addKernel);
+    kernel(cl::EnqueueArgs(queue, cl::NDRange(count)), count, X, sign, Y, Z);
+}
+
+void StrassenGemm::multiply(cl::CommandQueue &queue, int N, const cl::Buffer &A, const cl::Buffer &B,
+                            const cl::Buffer &C) const {
+    if (N <= cutoff || N % 2 != 0) {
+        base.enqueue(queue, N, N, N, A, B, C);
+        return;
+    }
+
+    const int h = N / 2;
+    const int count = h * h;
+    const size_t row = sizeof(float) * h;
+    const size_t pitch = sizeof(float) * N;
+    const cl::array<cl::size_type, 3> origin{0, 0, 0};
+    const cl::array<cl::size_type, 3> region{row, static_cast<size_t>(h), 1};
+
+    auto corner = [&](int qi, int qj) {
+        return cl::array<cl::size_type, 3>{qj * row, static_cast<size_t>(qi * h), 0};
+    };
+    // Quadrant (qi, qj) of an N x N matrix as a contiguous h x h temporary.
+    auto quadrant = [&](const cl::Buffer &matrix, int qi, int qj) {
+        auto part = pool.acquire(sizeof(float) * count);
+        queue.enqueueCopyBufferRect(matrix, part.get(), corner(qi, qj), origin, region, pitch, 0, row, 0);
+        return part;
+    };
+    auto temporary = [&]() { return pool.acquire(sizeof(float) * count); };
+
+    auto A11 = quadrant(A, 0, 0), A12 = quadrant(A, 0, 1), A21 = quadrant(A, 1, 0), A22 = quadrant(A, 1, 1);
+    auto B11 = quadrant(B, 0, 0), B12 = quadrant(B, 0, 1), B21 = quadrant(B, 1, 0), B22 = quadrant(B, 1, 1);
+
+    auto S1 = temporary(), S2 = temporary(), S3 = temporary(), S4 = temporary();
+    auto T1 = temporary(), T2 = temporary(), T3 = temporary(), T4 = temporary();
+    add(queue, count, A21.get(), 1.0f, A22.get(), S1.get());
+    add(queue, count, S1.get(), -1.0f, A11.get(), S2.get());
+    add(queue, count, A11.get(), -1.0f, A21.get(), S3.get());
+    add(queue, count, A12.get(), -1.0f, S2.get(), S4.get());
+    add(queue, count, B12.get(), -1.0f, B11.get(), T1.get());
+    add(queue, count, B22.get(), -1.0f, T1.get(), T2.get());
+    add(queue, count, B22.get(), -1.0f, B12.get(), T3.get());
+    add(queue, count, T2.get(), -1.0f, B21.get(), T4.get());
+
+    auto P1 = temporary(), P2 = temporary(), P3 = temporary(), P4 = temporary();
+    auto P5 = temporary(), P6 = temporary(), P7 = temporary();
+    multiply(queue, h, A11.get(), B11.get(), P1.get());
+    multiply(queue, h, A12.get(), B21.get(), P2.get());
+    multiply(queue, h, S4.get(), B22.get(), P3.get());
+    multiply(queue, h, A22.get(), T4.get(), P4.get());
+    multiply(queue, h, S1.get(), T1.get(), P5.get());
+    multiply(queue, h, S2.get(), T2.get(), P6.get());
+    multiply(queue, h, S3.get(), T3.get(), P7.get());
+
+    // The quadrants of C are assembled in P2 (C11), P3 (C12), P4 (C21) and S1 (C22).
+    add(queue, count, P1.get(), 1.0f, P2.get(), P2.get());
+    add(queue, count, P1.get(), 1.0f, P6.get(), P6.get());     // U2
+    add(queue, count, P6.get(), 1.0f, P7.get(), P7.get());     // U3
+    add(queue, count, P7.get(), 1.0f, P5.get(), S1.get());
+    add(queue, count, P6.get(), 1.0f, P5.get(), P5.get());     // U4
+    add(queue, count, P5.get(), 1.0f, P3.get(), P3.get());
+    add(queue, count, P7.get(), -1.0f, P4.get(), P4.get());
+
+    queue.enqueueCopyBufferRect(P2.get(), C, origin, corner(0, 0), region, row, 0, pitch, 0);
+    queue.enqueueCopyBufferRect(P3.get(), C, origin, corner(0, 1), region, row, 0, pitch, 0);
+    queue.enqueueCopyBufferRect(P4.get(), C, origin, corner(1, 0), region, row, 0, pitch, 0);
+    queue.enqueueCopyBufferRect(S1.get(), C, origin, corner(1, 1), region, row, 0, pitch, 0);
+}
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL product split across several devices
+//
+//------------------------------------------------------------------------------
+const int CALIBRATION_ROWS = 256;   // rows of C computed by each device to measure it
+
+MultiDeviceGemm::MultiDeviceGemm(const std::vector<cl::Device> &devices, int blksz) {
+    for (size_t first = 0; first < devices.size();) {
+        const auto platform = devices[first].getInfo<CL_DEVICE_PLATFORM>();
+        size_t last = first;
+        while (last < devices.size() && devices[last].getInfo<CL_DEVICE_PLATFORM>() == platform) last++;
+
+        std::vector<cl::Device> members(devices.begin() + first, devices.begin() + last);
+        cl::Context context(members);
+        groups.push_back({context, BlockGemm(context, blksz)});
+        for (const auto &device: members) {
+            if (groups.back().gemm.supports(device)) {
+                lanes.push_back({device, cl::CommandQueue(context, device), groups.size() - 1});
+            }
+        }
+        first = last;
+    }
+    if (lanes.empty()) {
+        throw std::runtime_error("No device can run the blocked multiplication");
+    }
+    weights.assign(lanes.size(), 1.0);
+}
+
+std::vector<cl::Device> MultiDeviceGemm::devices() const {
+    std::vector<cl::Device> result;
+    for (const auto &lane: lanes) result.push_back(lane.device);
+    return result;
+}
+
+void MultiDeviceGemm::setWeights(const std::vector<double> &new_weights) {
+    if (new_weights.size() != lanes.size() ||
+        std::any_of(new_weights.begin(), new_weights.end(), [](double w) { return !(w >= 0.0); }) ||
+        std::accumulate(new_weights.begin(), new_weights.end(), 0.0) <= 0.0) {
+        throw std::invalid_argument("Expected a non-negative weight per device");
+    }
+    weights = new_weights;
+}
+
+std::vector<double> MultiDeviceGemm::calibrate(int M, int N, int K,
+                                               std::span<const float> A, std::span<const float> B,
+                                               std::span<float> C) {
+    const int rows = std::min(M, CALIBRATION_ROWS);
+    std::vector<double> gflops(lanes.size());
+    for (size_t i = 0; i < lanes.size(); i++) {
+        // All rows go to the device being measured.
+        weights.assign(lanes.size(), 0.0);
+        weights[i] = 1.0;
+
+        multiply(rows, N, K, A, B, C);   // warm-up
+        util::Timer timer;
+        multiply(rows, N, K, A, B, C);
+        double run_time = static_cast<double>(timer.getTimeMicroseconds()) / 1000000.0;
+        gflops[i] = 2.0 * rows * N * K / (1000000000.0 * run_time);
+    }
+    weights = gflops;
+    return gflops;
+}
+
+std::vector<int> MultiDeviceGemm::partition(int M, int N, int K) const {
+    // Row granularity that keeps the byte offsets of the A and C panels aligned.
+    size_t align = 1;
+    for (const auto &lane: lanes) {
+        align = std::max<size_t>(align, lane.device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8);
+    }
+    const size_t rows_a = align / std::gcd(align, sizeof(float) * K);
+    const size_t rows_c = align / std::gcd(align, sizeof(float) * N);
+    const int step = static_cast<int>(std::lcm(rows_a, rows_c));
+
+    const double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+    std::vector<int> starts{0};
+    double cumulative = 0.0;
+    for (size_t i = 0; i + 1 < lanes.size(); i++) {
+        cumulative += weights[i];
+        int boundary = static_cast<int>(std::lround(M * cumulative / total / step)) * step;
+        starts.push_back(std::clamp(boundary, starts.back(), M));
+    }
+    starts.push_back(M);
+    return starts;
+}
+
+void MultiDeviceGemm::multiply(int M, int N, int K,
+                               std::span<const float> A, std::span<const float> B, std::span<float> C) {
+    const auto starts = partition(M, N, K);
+
+    // Kept until every queue finished.
+    std::vector<cl::Buffer> buffers;
+    for (size_t first = 0; first < lanes.size();) {
+        const size_t group = lanes[first].group;
+        size_t last = first;
+        while (last < lanes.size() && lanes[last].group == group) last++;
+
+        const size_t row0 = starts[first];
+        const size_t rows = starts[last] - row0;
+        if (rows > 0) {
+            const auto &context = groups[group].context;
+            cl::Buffer d_a(context, CL_MEM_READ_ONLY, sizeof(float) * rows * K);
+            cl::Buffer d_b(context, CL_MEM_READ_ONLY, sizeof(float) * K * N);
+            cl::Buffer d_c(context, CL_MEM_WRITE_ONLY, sizeof(float) * rows * N);
+
+            // B is written once through the first queue of the context, the others wait for it.
+            std::vector<cl::Event> write_b(1);
+            lanes[first].queue.enqueueWriteBuffer(d_b, CL_FALSE, 0, sizeof(float) * K * N, B.data(),
+                                                  nullptr, &write_b[0]);
+
+            for (size_t i = first; i < last; i++) {
+                const size_t start = starts[i];
+                const size_t count = starts[i + 1] - start;
+                if (count == 0) continue;
+
+                auto &queue = lanes[i].queue;
+                cl_buffer_region a_region{sizeof(float) * (start - row0) * K, sizeof(float) * count * K};
+                cl_buffer_region c_region{sizeof(float) * (start - row0) * N, sizeof(float) * count * N};
+                auto a_panel = d_a.createSubBuffer(CL_MEM_READ_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &a_region);
+                auto c_panel = d_c.createSubBuffer(CL_MEM_WRITE_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &c_region);
+
+                queue.enqueueWriteBuffer(a_panel, CL_FALSE, 0, a_region.size, A.data() + start * K);
+                if (i != first) queue.enqueueBarrierWithWaitList(&write_b);
+                groups[group].gemm.enqueue(queue, static_cast<int>(count), N, K, a_panel, d_b, c_panel);
+                queue.enqueueReadBuffer(c_panel, CL_FALSE, 0, c_region.size, C.data() + start * N);
+
+                buffers.insert(buffers.end(), {a_panel, c_panel});
+            }
+            buffers.insert(buffers.end(), {d_a, d_b, d_c});
+        }
+        first = last;
+    }
+
+    for (auto &lane: lanes) {
+        lane.queue.finish();
+    }
+}
@@ -9,43 +9,167 @@
 //
 //------------------------------------------------------------------------------
 
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <span>
 #include <vector>
 
+// The OpenCL settings of the drivers, in case this header is included first.
+#ifndef CL_HPP_ENABLE_EXCEPTIONS
+#define CL_HPP_ENABLE_EXCEPTIONS
+#endif
+#ifndef CL_HPP_MINIMUM_OPENCL_VERSION
+#define CL_HPP_MINIMUM_OPENCL_VERSION 120
+#endif
+#ifndef CL_HPP_TARGET_OPENCL_VERSION
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+#endif
+
+#include "../common/cpp/cl.hpp"
+#include "../common/cpp/first_touch.hpp"
+#include "../common/cpp/specialization_cache.hpp"
+#include "buffer_pool.hpp"
+#include "scalar_type.hpp"
+#include "epilogue.hpp"
+#include "mapped_file.hpp"
+
+//------------------------------------------------------------------------------
+//
+//  The functions templated on the element type T are instantiated for float
+//  and double in matrix_lib.cpp.
+//
+//------------------------------------------------------------------------------
+
 //------------------------------------------------------------------------------
 //
 //  Function to compute the matrix product (sequential algorithm, dot producdt)
 //
 //------------------------------------------------------------------------------
-void seq_mat_mul_sdot(int N, std::vector<float> &A, std::vector<float> &B, std::vector<float> &C);
-void better_seq_mat_mul_sdot(int N, std::vector<float> &A, std::vector<float> &B, std::vector<float> &C);
+template<typename T, typename Allocator>
+void seq_mat_mul_sdot(int N, std::vector<T, Allocator> &A, std::vector<T, Allocator> &B,
+                      std::vector<T, Allocator> &C);
+template<typename T, typename Allocator>
+void better_seq_mat_mul_sdot(int N, std::vector<T, Allocator> &A, std::vector<T, Allocator> &B,
+                             std::vector<T, Allocator> &C);
+
+//------------------------------------------------------------------------------
+//
+//  Function to compute the matrix product on the host with all cores
+//
+//  C(M,N) = A(M,K) * B(K,N) for row-major matrices with leading dimensions
+//  lda, ldb and ldc. Panels of A and B are packed into aligned buffers and
+//  multiplied by an AVX-512, AVX2 or portable micro-kernel, picked at runtime
+//  from what the CPU supports. threads <= 0 uses every hardware thread.
+//
+//------------------------------------------------------------------------------
+void host_sgemm(int M, int N, int K, const float *A, int lda, const float *B, int ldb, float *C, int ldc,
+                int threads = 0);
+void par_mat_mul_packed(int N, std::span<const float> A, std::span<const float> B, std::span<float> C);
+const char *host_sgemm_kernel_name();
+
+//------------------------------------------------------------------------------
+//
+//  Function to compute the square matrix product on the host with the
+//  Strassen-Winograd recursion (see strassen.hpp) above host_sgemm
+//
+//------------------------------------------------------------------------------
+void host_strassen(int N, const float *A, int lda, const float *B, int ldb, float *C, int ldc, int cutoff);
+
+//------------------------------------------------------------------------------
+//
+//  Host storage of the matrices of the driver
+//
+//  Allocating a HostMatrix doesn't write its elements, so the first writes
+//  are those of initmat (or zero_mat), which place every page on the NUMA
+//  node of the thread filling its rows (see first_touch.hpp).
+//
+//------------------------------------------------------------------------------
+using HostMatrix = util::FirstTouchVector<float>;
 
 //------------------------------------------------------------------------------
 //
 //  Function to initialize the input matrices A and B
 //
+//  Large matrices are filled in row blocks by one thread per core.
+//
 //------------------------------------------------------------------------------
-void initmat(int N, std::vector<float> &A, std::vector<float> &B, std::vector<float> &C);
+template<typename T, typename Allocator>
+void initmat(int N, std::vector<T, Allocator> &A, std::vector<T, Allocator> &B, std::vector<T, Allocator> &C);
+template<typename T, typename Allocator>
+void initmat(int M, int N, int K, std::vector<T, Allocator> &A, std::vector<T, Allocator> &B,
+             std::vector<T, Allocator> &C);
 
 //------------------------------------------------------------------------------
 //
-//  Function to set a matrix to zero 
+//  Function to set a matrix to zero, in parallel like initmat
 //
 //------------------------------------------------------------------------------
-void zero_mat(int N, std::vector<float> &C);
+template<typename T, typename Allocator>
+void zero_mat(int N, std::vector<T, Allocator> &C);
 
 //------------------------------------------------------------------------------
 //
 //  Function to fill Btrans(Mdim,Pdim)  with transpose of B(Pdim,Mdim)
 //
 //------------------------------------------------------------------------------
-void trans(int N, std::vector<float> &B, std::vector<float> &Btrans);
+template<typename T, typename Allocator>
+void trans(int N, std::vector<T, Allocator> &B, std::vector<T, Allocator> &Btrans);
+
+//------------------------------------------------------------------------------
+//
+//  Functions to convert between float and IEEE half (binary16) on the host
+//
+//  float_to_half rounds to nearest even, overflows to infinity and keeps
+//  subnormals, NaN stays NaN. Every half converts to float exactly.
+//
+//------------------------------------------------------------------------------
+cl_half float_to_half(float value);
+float half_to_float(cl_half value);
+std::vector<cl_half> to_half(std::span<const float> values);
+std::vector<float> to_float(const std::vector<cl_half> &values);
 
 //------------------------------------------------------------------------------
 //
 //  Function to compute errors of the product matrix
 //
 //------------------------------------------------------------------------------
-float error(int N, std::vector<float> &C);
+template<typename T, typename Allocator>
+T error(int N, std::vector<T, Allocator> &C);
+template<typename T, typename Allocator>
+T error(int M, int N, int K, std::vector<T, Allocator> &C);
+
+//------------------------------------------------------------------------------
+//
+//  Function to report errors of the product matrix, prints nothing if correct
+//
+//------------------------------------------------------------------------------
+template<typename T, typename Allocator>
+void check(int N, std::vector<T, Allocator> &C);
+template<typename T, typename Allocator>
+void check(int M, int N, int K, std::vector<T, Allocator> &C);
+
+//------------------------------------------------------------------------------
+//
+//  Function to check a product of any inputs, C(M,N) = A(M,K) * B(K,N),
+//  with Freivalds' algorithm in O(MK + KN + MN) instead of O(MNK)
+//
+//  For a random vector r of +-1, A*(B*r) is compared with C*r, all three
+//  products in double on every core (AVX2 when the CPU has it). A wrong
+//  element of C moves its row of C*r by its error, so it is caught in one
+//  round unless other wrong elements of the row cancel it, which every
+//  further round makes half as likely. The check passes when the largest
+//  difference is at most tolerance times the largest element of A*(B*r).
+//
+//------------------------------------------------------------------------------
+struct FreivaldsResult {
+    bool passed;
+    double deviation;    // largest |A*(B*r) - C*r| relative to the largest |A*(B*r)|, over the rounds
+};
+
+FreivaldsResult freivalds(int M, int N, int K, const float *A, const float *B, const float *C,
+                          int rounds = 2, double tolerance = 1e-5, unsigned seed = 1);
 
 
 //------------------------------------------------------------------------------
@@ -53,4 +177,374 @@ float error(int N, std::vector<float> &C);
 //  Function to analyze and output results 
 //
 //------------------------------------------------------------------------------
-void results(int N, std::vector<float> &C, double run_time);
+template<typename T, typename Allocator>
+void results(int N, std::vector<T, Allocator> &C, double run_time);
+template<typename T, typename Allocator>
+void results(int M, int N, int K, std::vector<T, Allocator> &C, double run_time);
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL product of rectangular matrices C(M,N) = A(M,K) * B(K,N)
+//
+//  Any M, N and K are supported, the edge blocks are handled by
+//  guarded loads in the kernel, so the host doesn't pad anything.
+//  The program is built once in the constructor, for elements of
+//  type T: BasicBlockGemm<double> needs a device with cl_khr_fp64.
+//  A and B are stored as Storage, T unless given, and C as T.
+//  With accumulate the kernel computes C += A * B, otherwise the
+//  epilogue is fused into the store of C (see epilogue.hpp).
+//
+//------------------------------------------------------------------------------
+template<typename T, typename Storage = T>
+class BasicBlockGemm {
+public:
+    explicit BasicBlockGemm(const cl::Context &context, int blksz = 16, bool accumulate = false,
+                            const Epilogue &epilogue = Epilogue());
+
+    // Enqueues the product of device buffers, returns the kernel event.
+    // bias holds M or N values if the epilogue has a bias.
+    cl::Event enqueue(cl::CommandQueue &queue, int M, int N, int K,
+                      const cl::Buffer &A, const cl::Buffer &B, const cl::Buffer &C,
+                      const cl::Buffer &bias = cl::Buffer()) const;
+
+    // Uploads A and B, computes the product and reads C back.
+    // The events of the uploads, the kernel and the read back are appended to events if given.
+    void multiply(cl::CommandQueue &queue, int M, int N, int K,
+                  std::span<const Storage> A, std::span<const Storage> B, std::span<T> C,
+                  std::vector<cl::Event> *events = nullptr) const;
+
+    // Whether a blksz x blksz work-group fits the kernel on the device.
+    bool supports(const cl::Device &device) const;
+
+private:
+    const int blksz;
+    Epilogue epilogue;
+    cl::Context context;
+    cl::Kernel kernel;    // created once and shared by the launches, which set all of its arguments
+};
+
+using BlockGemm = BasicBlockGemm<float>;
+
+//------------------------------------------------------------------------------
+//
+//  The epilogue of a float product as separate passes over C(M,N)
+//
+//  The product P of A and B is in its own buffer. One kernel computes
+//  C = alpha*P + beta*C, one adds the bias and one applies the activation,
+//  each only if the epilogue has that step. P may be C when alpha is 1 and
+//  beta 0, then the first pass is skipped.
+//
+//------------------------------------------------------------------------------
+class EpiloguePasses {
+public:
+    EpiloguePasses(const cl::Context &context, const Epilogue &epilogue);
+
+    // Enqueues the passes in order, returns their events.
+    std::vector<cl::Event> enqueue(cl::CommandQueue &queue, int M, int N,
+                                   const cl::Buffer &P, const cl::Buffer &bias, const cl::Buffer &C) const;
+
+private:
+    Epilogue epilogue;
+    cl::Kernel scale;
+    cl::Kernel addBias;
+    cl::Kernel activation;
+};
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL product of square matrices of any order, C(n,n) = A(n,n) * B(n,n)
+//
+//  An order is served by the rectangular kernel, which takes it as an
+//  argument, until it was requested specializeAfter times. If blksz
+//  divides it, the blocked kernel built with the order as a constant
+//  takes over from then on. Programs are cached per (variant, order,
+//  blksz), see specialization_cache.hpp, the kernel of each is created once.
+//
+//------------------------------------------------------------------------------
+class SquareGemm {
+public:
+    explicit SquareGemm(const cl::Context &context, int blksz = 16, size_t specializeAfter = 2);
+
+    // Enqueues the product of device buffers, returns the kernel event.
+    // *specialized, if given, tells whether the program was built for n.
+    cl::Event enqueue(cl::CommandQueue &queue, int n, const cl::Buffer &A, const cl::Buffer &B, const cl::Buffer &C,
+                      bool *specialized = nullptr) const;
+
+    [[nodiscard]] util::SpecializationCache::Stats stats() const { return cache.stats(); }
+
+private:
+    // The kernel of a program of the cache, created on its first launch.
+    cl::Kernel kernel(const cl::Program &program) const;
+
+    const int blksz;
+    mutable util::SpecializationCache cache;
+    mutable std::map<cl_program, cl::Kernel> kernels;
+    mutable std::mutex mutex;
+};
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL product C(M,N) = A(M,K) * B(K,N) streamed in row panels
+//
+//  B is uploaded once, A and C move in panels of panelRows rows through
+//  `slots` device buffers each. Uploads, kernels and read backs go to three
+//  in-order queues and are ordered by events only, so the upload of panel
+//  p+1 and the read back of panel p-1 overlap the kernel of panel p. A slot
+//  is written again once the kernel (for A) or the read back (for C) of the
+//  panel that used it before has completed.
+//
+//------------------------------------------------------------------------------
+class PipelinedGemm {
+public:
+    PipelinedGemm(const cl::Context &context, const cl::Device &device, int panelRows, int slots = 2,
+                  int blksz = 16);
+
+    void multiply(int M, int N, int K, std::span<const float> A, std::span<const float> B, std::span<float> C);
+
+private:
+    const int panelRows;
+    const int slots;
+    cl::Context context;
+    cl::CommandQueue upload;
+    cl::CommandQueue compute;
+    cl::CommandQueue download;
+    BlockGemm gemm;
+};
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL product C(M,N) = A(M,K) * B(K,N) of matrices in files
+//
+//  A, B and C are mapped files of row-major floats and never have to fit
+//  in host or device memory. C is computed in tiles of rows x cols, each
+//  as a sum over slices of depth columns of A and rows of B. One device
+//  buffer per operand holds the current tile, together they take at most
+//  deviceBytes. Tiles of A and B are copied straight from the mapping with
+//  rectangular writes, a finished tile of C is read into its mapping and
+//  its write back to the file is started.
+//
+//  plan() compares full-depth panels against square tiles, visited by
+//  rows or by columns of C in a serpentine order, and keeps the tiling
+//  that uploads the fewest bytes: a tile still in its buffer from the
+//  previous step isn't uploaded again.
+//
+//------------------------------------------------------------------------------
+class OutOfCoreGemm {
+public:
+    struct Tiling {
+        int rows;
+        int cols;
+        int depth;
+        bool rowsFirst;     // visits the tiles of a row of C tiles before moving to the next one
+        size_t uploaded;    // bytes of A and B uploaded by the product
+    };
+
+    struct Traffic {
+        size_t uploaded = 0;      // bytes from the files of A and B to the device
+        size_t downloaded = 0;    // bytes from the device to the file of C
+    };
+
+    OutOfCoreGemm(const cl::Context &context, const cl::Device &device, size_t deviceBytes, int blksz = 16);
+
+    [[nodiscard]] Tiling plan(int M, int N, int K) const;
+
+    Traffic multiply(int M, int N, int K, const MappedFile &A, const MappedFile &B, MappedFile &C);
+
+private:
+    const size_t deviceBytes;
+    const size_t maxAlloc;
+    const int blksz;
+    cl::Context context;
+    cl::CommandQueue queue;
+    BlockGemm assign;
+    BlockGemm accumulate;
+};
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL transpose Bt(cols,rows) of B(rows,cols), through local memory tiles
+//  (see transpose.hpp). The device equivalent of trans().
+//
+//------------------------------------------------------------------------------
+class DeviceTranspose {
+public:
+    explicit DeviceTranspose(const cl::Context &context, int tile = 16);
+
+    // Enqueues the transpose, returns the kernel event.
+    cl::Event enqueue(cl::CommandQueue &queue, int rows, int cols, const cl::Buffer &B, const cl::Buffer &Bt) const;
+
+    // Whether a tile x tile work-group fits the kernel on the device.
+    bool supports(const cl::Device &device) const;
+
+private:
+    const int tile;
+    cl::Kernel kernel;
+};
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL matrix-vector products and rank-1 update of a row-major A(M,N)
+//  (see gemv.hpp)
+//
+//    gemvN ... y(M) = alpha * A * x + beta * y
+//    gemvT ... y(N) = alpha * A^T * x + beta * y
+//    ger   ... A += alpha * x(M) * y(N)^T
+//
+//  They're memory bound, gemv_bytes and ger_bytes count the bytes they
+//  move at least, to report their bandwidth. host_sgemv and host_sger
+//  compute the same on the host, accumulating in double.
+//
+//------------------------------------------------------------------------------
+class DeviceGemv {
+public:
+    // group: work-items per row of gemvN, a power of two.
+    // tile x lanes: the work-group of gemvT, tile columns read by lanes rows of work-items.
+    explicit DeviceGemv(const cl::Context &context, int group = 128, int tile = 32, int lanes = 8);
+
+    // Each enqueues its kernel, returns the kernel event.
+    cl::Event gemvN(cl::CommandQueue &queue, int M, int N, float alpha, const cl::Buffer &A, const cl::Buffer &x,
+                    float beta, const cl::Buffer &y) const;
+    cl::Event gemvT(cl::CommandQueue &queue, int M, int N, float alpha, const cl::Buffer &A, const cl::Buffer &x,
+                    float beta, const cl::Buffer &y) const;
+    cl::Event ger(cl::CommandQueue &queue, int M, int N, float alpha, const cl::Buffer &x, const cl::Buffer &y,
+                  const cl::Buffer &A) const;
+
+    // Whether the work-groups of both products fit their kernels on the device.
+    bool supports(const cl::Device &device) const;
+
+private:
+    const int group;
+    const int tile;
+    const int lanes;
+    cl::Kernel gemvNKernel;
+    cl::Kernel gemvTKernel;
+    cl::Kernel gerKernel;
+};
+
+double gemv_bytes(int M, int N, bool transposed, float beta);
+double ger_bytes(int M, int N);
+void host_sgemv(bool transposed, int M, int N, float alpha, const float *A, const float *x, float beta, float *y);
+void host_sger(int M, int N, float alpha, const float *x, const float *y, float *A);
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL product C(M,N) = A(M,K) * B(K,N) with A and B stored in half
+//
+//  The buffers of A and B hold cl_half values, see to_half(), and take
+//  half of the memory and of the upload of float operands. The kernel
+//  accumulates in float and C is float. Only vload_half is used, so no
+//  fp16 extension is required.
+//
+//------------------------------------------------------------------------------
+using HalfGemm = BasicBlockGemm<float, cl_half>;
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL products of a batch of small matrices in one launch
+//
+//  Every product of the batch is C(M,N) = A(M,K) * B(K,N). The matrices
+//  are stored in one buffer per operand, either at a fixed stride (in
+//  floats) or at arbitrary offsets: offsets holds three ints per product,
+//  the starts of its A, B and C. Both kernels are built and created once.
+//
+//------------------------------------------------------------------------------
+class BatchedGemm {
+public:
+    explicit BatchedGemm(const cl::Context &context, int blksz = 16);
+
+    cl::Event enqueueStrided(cl::CommandQueue &queue, int M, int N, int K, int batch,
+                             const cl::Buffer &A, int strideA,
+                             const cl::Buffer &B, int strideB,
+                             const cl::Buffer &C, int strideC) const;
+
+    cl::Event enqueueIndexed(cl::CommandQueue &queue, int M, int N, int K, int batch,
+                             const cl::Buffer &A, const cl::Buffer &B, const cl::Buffer &C,
+                             const cl::Buffer &offsets) const;
+
+private:
+    // The first two dimensions cover C in whole blocks, the third the batch.
+    cl::NDRange global(int M, int N, int batch) const;
+
+    const int blksz;
+    cl::Kernel strided;
+    cl::Kernel indexed;
+};
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL square product with the Strassen-Winograd recursion
+//
+//  A, B and C are N x N device buffers. Quadrants are copied out with
+//  clEnqueueCopyBufferRect, the sums and the 7 sub-products stay on the
+//  device in temporaries of the pool, and the recursion ends in BlockGemm
+//  once the order is odd or not above the cutoff. Everything is enqueued
+//  on one in-order queue, so a temporary can be reused as soon as its
+//  last command is enqueued.
+//
+//------------------------------------------------------------------------------
+class StrassenGemm {
+public:
+    StrassenGemm(const cl::Context &context, int cutoff, int blksz = 16);
+
+    void multiply(cl::CommandQueue &queue, int N, const cl::Buffer &A, const cl::Buffer &B,
+                  const cl::Buffer &C) const;
+
+private:
+    // Z = X + sign * Y on count floats.
+    void add(cl::CommandQueue &queue, int count, const cl::Buffer &X, float sign, const cl::Buffer &Y,
+             const cl::Buffer &Z) const;
+
+    const int cutoff;
+    BlockGemm base;
+    cl::Kernel addKernel;
+    mutable BufferPool pool;
+};
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL product split across several devices
+//
+//  C is cut into row panels, one per device, sized in proportion to the
+//  weight (GFLOPS) of the device. Consecutive devices of a platform share a
+//  context: A and C are allocated once for their rows and each device
+//  works on sub-buffers of its panel, B is uploaded once per context.
+//  Panel boundaries are rounded so the sub-buffer origins respect
+//  CL_DEVICE_MEM_BASE_ADDR_ALIGN. Devices on which BlockGemm can't run
+//  are left out.
+//
+//------------------------------------------------------------------------------
+class MultiDeviceGemm {
+public:
+    explicit MultiDeviceGemm(const std::vector<cl::Device> &devices, int blksz = 16);
+
+    // The devices taking part, in panel order.
+    std::vector<cl::Device> devices() const;
+
+    // One weight per device, equal by default.
+    void setWeights(const std::vector<double> &weights);
+
+    // Times every device alone on the first rows of the product and uses its GFLOPS as weight.
+    std::vector<double> calibrate(int M, int N, int K,
+                                  std::span<const float> A, std::span<const float> B, std::span<float> C);
+
+    // First row of the panel of every device, followed by M.
+    std::vector<int> partition(int M, int N, int K) const;
+
+    void multiply(int M, int N, int K, std::span<const float> A, std::span<const float> B, std::span<float> C);
+
+private:
+    struct Group {
+        cl::Context context;
+        BlockGemm gemm;
+    };
+
+    struct Lane {
+        cl::Device device;
+        cl::CommandQueue queue;
+        size_t group;
+    };
+
+    std::vector<Group> groups;
+    std::vector<Lane> lanes;
+    std::vector<double> weights;
+};
@@ -0,0 +1,144 @@
+//-------------------------------------------------------------
+//
+//  PROGRAM: Register tiled Matrix Multiplication kernel
+//
+//  PURPOSE: Computes a WPTM x WPTN micro-tile of the product matrix
+//
+//              C = A * B
+//
+//           per work-item.
+//
+//           The blocked kernel computes a single element of C per
+//           work-item, so every multiply-add needs two reads from
+//           local memory. Here a work-group computes a TS x TS block
+//           of C and every work-item keeps WPTM x WPTN accumulators
+//           in private memory. For each k a work-item reads WPTM
+//           values of A and WPTN values of B from local memory and
+//           performs WPTM*WPTN multiply-adds with them.
+//
+//           The elements owned by a work-item are strided by the
+//           work-group dimensions, so neighbouring work-items read
+//           neighbouring local memory words. The tiles are loaded
+//           from global memory with vload4, every work-item loads
+//           WPTM*WPTN/4 float4 values of A and of B per tile.
+//           Local tiles are padded by PAD columns to avoid bank
+//           conflicts when the rows of Asub are read.
+//
+//           Compile time constants:
+//
+//             N          ... order of the matrices
+//             TS         ... tile size, N must be a multiple of TS
+//             WPTM, WPTN ... rows and columns of C per work-item,
+//                            TS must be a multiple of both and
+//                            WPTM*WPTN must be a multiple of 4
+//             PAD        ... padding of the local tiles
+//             KUNROLL    ... unroll factor of the loop over k,
+//                            TS must be a multiple of it
+//
+//           C is stored through the epilogue, see epilogue.hpp.
+//
+//           NDRange: global (N/WPTN, N/WPTM), local (TS/WPTN, TS/WPTM).
+//
+//-------------------------------------------------------------
+
+#include "epilogue.hpp"
+
+#include <string>
+
+const std::string REGISTER_TILED_MULTIPLICATION = GEMM_EPILOGUE + R"(
+#ifndef PAD
+#define PAD 1
+#endif
+
+#ifndef KUNROLL
+#define KUNROLL 1
+#endif
+
+// Work-items per work-group in each dimension
+#define RTSM (TS/WPTM)
+#define RTSN (TS/WPTN)
+
+// float4 loads per work-item for each of the tiles
+#define LPT ((WPTM*WPTN)/4)
+
+__kernel void mmul(
+                __global const float* restrict A,
+                __global const float* restrict B,
+                __global       float* restrict C
+                EPILOGUE_ARGS)
+{
+    __local float Asub[TS][TS + PAD];
+    __local float Bsub[TS][TS + PAD];
+
+    // Column and row of the work-item inside the work-group
+    const int tidn = get_local_id(0);
+    const int tidm = get_local_id(1);
+    const int tid = tidm * RTSN + tidn;
+
+    // Upper-left corner of the C block of this work-group
+    const int offsetN = get_group_id(0) * TS;
+    const int offsetM = get_group_id(1) * TS;
+
+    float Areg;
+    float Breg[WPTN];
+    float acc[WPTM][WPTN];
+    for (int wm = 0; wm < WPTM; wm++)
+        for (int wn = 0; wn < WPTN; wn++)
+            acc[wm][wn] = 0.0f;
+
+    for (int t = 0; t < N / TS; t++)
+    {
+        // Load A(offsetM.., t*TS..) and B(t*TS.., offsetN..) into local memory.
+        for (int l = 0; l < LPT; l++)
+        {
+            const int id = l * RTSM * RTSN + tid;
+            const int row = id / (TS / 4);
+            const int col = (id % (TS / 4)) * 4;
+
+            const float4 a = vload4(0, A + (offsetM + row) * N + t * TS + col);
+            Asub[row][col + 0] = a.x;
+            Asub[row][col + 1] = a.y;
+            Asub[row][col + 2] = a.z;
+            Asub[row][col + 3] = a.w;
+
+            const float4 b = vload4(0, B + (t * TS + row) * N + offsetN + col);
+            Bsub[row][col + 0] = b.x;
+            Bsub[row][col + 1] = b.y;
+            Bsub[row][col + 2] = b.z;
+            Bsub[row][col + 3] = b.w;
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int k0 = 0; k0 < TS; k0 += KUNROLL)
+        {
+            #pragma unroll
+            for (int ku = 0; ku < KUNROLL; ku++)
+            {
+                const int k = k0 + ku;
+
+                #pragma unroll
+                for (int wn = 0; wn < WPTN; wn++)
+                    Breg[wn] = Bsub[k][tidn + wn * RTSN];
+
+                #pragma unroll
+                for (int wm = 0; wm < WPTM; wm++)
+                {
+                    Areg = Asub[tidm + wm * RTSM][k];
+                    #pragma unroll
+                    for (int wn = 0; wn < WPTN; wn++)
+                        acc[wm][wn] += Areg * Breg[wn];
+                }
+            }
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    for (int wm = 0; wm < WPTM; wm++)
+    {
+        const int row = offsetM + tidm + wm * RTSM;
+        for (int wn = 0; wn < WPTN; wn++)
+            STORE_C(C, row, offsetN + tidn + wn * RTSN, N, acc[wm][wn]);
+    }
+})";
@@ -0,0 +1,73 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Element types of the matrix kernels
+//
+//  PURPOSE: Kernels written for any element type use `real` for it. The
+//           source generated by scalarDefines<T>() is put in front of them:
+//           it defines `real` as the OpenCL name of T and enables the
+//           extension T needs.
+//
+//           float is core OpenCL. double needs cl_khr_fp64, which some
+//           devices don't have (Intel UHD for example), so a double kernel
+//           is only built after supportsScalar<double>() said yes.
+//
+//           Half has no arithmetic without cl_khr_fp16, so it is only a
+//           storage type: storageDefines<cl_half>() makes the kernel read
+//           A and B with vload_half, which is core OpenCL, and compute in
+//           `real`. Any other storage type is `real` itself.
+//
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include "../common/cpp/cl.hpp"
+
+#include <string>
+#include <type_traits>
+
+template<typename T>
+struct ScalarType;
+
+template<>
+struct ScalarType<float> {
+    static constexpr const char *name = "float";
+    static constexpr const char *extension = "";
+};
+
+template<>
+struct ScalarType<double> {
+    static constexpr const char *name = "double";
+    static constexpr const char *extension = "cl_khr_fp64";
+};
+
+template<typename T>
+std::string scalarDefines() {
+    const std::string extension = ScalarType<T>::extension;
+    std::string defines;
+    if (!extension.empty()) defines += "#pragma OPENCL EXTENSION " + extension + " : enable\n";
+    return defines + "#define real " + ScalarType<T>::name + "\n";
+}
+
+// Whether the device reports an extension. The list is space separated, a plain substring
+// search would take cl_khr_fp16 for cl_khr_fp16_foo.
+inline bool hasExtension(const cl::Device &device, const std::string &extension) {
+    const std::string extensions = " " + device.getInfo<CL_DEVICE_EXTENSIONS>() + " ";
+    return extensions.find(" " + extension + " ") != std::string::npos;
+}
+
+// Whether the device reports the extension T needs, if any.
+template<typename T>
+bool supportsScalar(const cl::Device &device) {
+    const std::string extension = ScalarType<T>::extension;
+    return extension.empty() || hasExtension(device, extension);
+}
+
+// Defines `storage`, the type of A and B in memory, and LOAD(offset, p) reading one of them as `real`.
+template<typename Storage>
+std::string storageDefines() {
+    if constexpr (std::is_same_v<Storage, cl_half>) {
+        return "#define storage half\n#define LOAD(offset, p) vload_half(offset, p)\n";
+    } else {
+        return "#define storage real\n#define LOAD(offset, p) (p)[offset]\n";
+    }
+}
@@ -0,0 +1,327 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Sparse matrix library
+//
+//  PURPOSE: Build sparse matrices, convert them between formats and
+//           multiply them on the host and with the kernels of spmv.hpp.
+//
+//------------------------------------------------------------------------------
+
+#include "sparse_lib.hpp"
+#include "spmv.hpp"
+#include "../common/cpp/program_cache.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+//------------------------------------------------------------------------------
+//
+//  Functions to build sparse matrices
+//
+//------------------------------------------------------------------------------
+int CsrMatrix::maxRowLength() const {
+    int longest = 0;
+    for (int i = 0; i < rows; i++) {
+        longest = std::max(longest, rowPtr[i + 1] - rowPtr[i]);
+    }
+    return longest;
+}
+
+CsrMatrix banded_matrix(int n, int bandwidth) {
+    CsrMatrix A{n, n};
+    A.rowPtr.reserve(n + 1);
+    A.colIdx.reserve(static_cast<size_t>(n) * (2 * bandwidth + 1));
+    A.values.reserve(A.colIdx.capacity());
+    A.rowPtr.push_back(0);
+    for (int i = 0; i < n; i++) {
+        for (int j = std::max(0, i - bandwidth); j <= std::min(n - 1, i + bandwidth); j++) {
+            A.colIdx.push_back(j);
+            A.values.push_back(j == i ? 2.0f : -1.0f / static_cast<float>(std::abs(i - j) + 1));
+        }
+        A.rowPtr.push_back(static_cast<int>(A.colIdx.size()));
+    }
+    return A;
+}
+
+CsrMatrix power_law_matrix(int rows, int cols, double exponent, int minLength, unsigned seed) {
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::uniform_int_distribution<int> column(0, cols - 1);
+    std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+
+    CsrMatrix A{rows, cols};
+    A.rowPtr.reserve(rows + 1);
+    A.rowPtr.push_back(0);
+    std::vector<int> row;
+    for (int i = 0; i < rows; i++) {
+        // Inverse of the Pareto distribution function
+        const double length = minLength * std::pow(1.0 - uniform(generator), -1.0 / (exponent - 1.0));
+        const int n = static_cast<int>(std::min(length, static_cast<double>(cols)));
+
+        row.clear();
+        for (int k = 0; k < n; k++) {
+            row.push_back(column(generator));
+        }
+        std::sort(row.begin(), row.end());
+        row.erase(std::unique(row.begin(), row.end()), row.end());
+
+        for (int j: row) {
+            A.colIdx.push_back(j);
+            A.values.push_back(value(generator));
+        }
+        A.rowPtr.push_back(static_cast<int>(A.colIdx.size()));
+    }
+    return A;
+}
+
+EllMatrix to_ell(const CsrMatrix &A) {
+    EllMatrix ell{A.rows, A.cols, A.maxRowLength()};
+    const size_t padded = static_cast<size_t>(ell.width) * A.rows;
+    ell.colIdx.assign(padded, 0);
+    ell.values.assign(padded, 0.0f);
+    for (int i = 0; i < A.rows; i++) {
+        for (int k = A.rowPtr[i]; k < A.rowPtr[i + 1]; k++) {
+            const size_t at = static_cast<size_t>(k - A.rowPtr[i]) * A.rows + i;
+            ell.colIdx[at] = A.colIdx[k];
+            ell.values[at] = A.values[k];
+        }
+    }
+    return ell;
+}
+
+SellMatrix to_sell(const CsrMatrix &A, int C, int sigma) {
+    if (sigma % C != 0) {
+        throw std::invalid_argument("SELL-C-sigma needs sigma to be a multiple of C");
+    }
+    auto length = [&A](int i) { return A.rowPtr[i + 1] - A.rowPtr[i]; };
+
+    SellMatrix sell{A.rows, A.cols, C, sigma};
+    sell.rowOrder.resize(A.rows);
+    std::iota(sell.rowOrder.begin(), sell.rowOrder.end(), 0);
+    for (int window = 0; window < A.rows; window += sigma) {
+        std::stable_sort(sell.rowOrder.begin() + window,
+                         sell.rowOrder.begin() + std::min(window + sigma, A.rows),
+                         [&length](int a, int b) { return length(a) > length(b); });
+    }
+
+    const int slices = (A.rows + C - 1) / C;
+    sell.sliceStart.reserve(slices + 1);
+    sell.sliceStart.push_back(0);
+    for (int s = 0; s < slices; s++) {
+        int width = 0;
+        for (int p = s * C; p < std::min((s + 1) * C, A.rows); p++) {
+            width = std::max(width, length(sell.rowOrder[p]));
+        }
+        sell.sliceStart.push_back(sell.sliceStart.back() + width * C);
+    }
+
+    sell.colIdx.assign(sell.sliceStart.back(), 0);
+    sell.values.assign(sell.sliceStart.back(), 0.0f);
+    for (int p = 0; p < A.rows; p++) {
+        const int row = sell.rowOrder[p];
+        const int start = sell.sliceStart[p / C];
+        const int lane = p % C;
+        for (int k = A.rowPtr[row]; k < A.rowPtr[row + 1]; k++) {
+            const int at = start + (k - A.rowPtr[row]) * C + lane;
+            sell.colIdx[at] = A.colIdx[k];
+            sell.values[at] = A.values[k];
+        }
+    }
+    return sell;
+}
+
+//------------------------------------------------------------------------------
+//
+//  Functions to compute the sparse products on the host
+//
+//------------------------------------------------------------------------------
+void csr_spmv(const CsrMatrix &A, const std::vector<float> &x, std::vector<float> &y) {
+    y.resize(A.rows);
+    for (int i = 0; i < A.rows; i++) {
+        float sum = 0.0f;
+        for (int k = A.rowPtr[i]; k < A.rowPtr[i + 1]; k++) {
+            sum += A.values[k] * x[A.colIdx[k]];
+        }
+        y[i] = sum;
+    }
+}
+
+void csr_spmm(const CsrMatrix &A, int width, const std::vector<float> &X, std::vector<float> &Y) {
+    Y.assign(static_cast<size_t>(A.rows) * width, 0.0f);
+    for (int i = 0; i < A.rows; i++) {
+        float *y = &Y[static_cast<size_t>(i) * width];
+        for (int k = A.rowPtr[i]; k < A.rowPtr[i + 1]; k++) {
+            const float a = A.values[k];
+            const float *x = &X[static_cast<size_t>(A.colIdx[k]) * width];
+            for (int j = 0; j < width; j++) {
+                y[j] += a * x[j];
+            }
+        }
+    }
+}
+
+double spmv_bytes(const CsrMatrix &A) {
+    return spmm_bytes(A, 1);
+}
+
+double spmm_bytes(const CsrMatrix &A, int width) {
+    const double matrix = (sizeof(float) + sizeof(int)) * static_cast<double>(A.nnz())
+                          + sizeof(int) * (A.rows + 1.0);
+    return matrix + sizeof(float) * static_cast<double>(width) * (A.rows + A.cols);
+}
+
+//------------------------------------------------------------------------------
+//
+//  Sparse matrices uploaded to a context
+//
+//------------------------------------------------------------------------------
+namespace {
+
+template<typename T>
+cl::Buffer upload(const cl::Context &context, const std::vector<T> &host) {
+    return {context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(T) * host.size(), const_cast<T *>(host.data())};
+}
+
+} // namespace
+
+DeviceCsr::DeviceCsr(const cl::Context &context, const CsrMatrix &A) :
+        rows(A.rows),
+        cols(A.cols),
+        rowPtr(upload(context, A.rowPtr)),
+        colIdx(upload(context, A.colIdx)),
+        values(upload(context, A.values)) {
+}
+
+DeviceEll::DeviceEll(const cl::Context &context, const EllMatrix &A) :
+        rows(A.rows),
+        cols(A.cols),
+        width(A.width),
+        colIdx(upload(context, A.colIdx)),
+        values(upload(context, A.values)) {
+}
+
+DeviceSell::DeviceSell(const cl::Context &context, const SellMatrix &A) :
+        rows(A.rows),
+        cols(A.cols),
+        C(A.C),
+        sliceStart(upload(context, A.sliceStart)),
+        rowOrder(upload(context, A.rowOrder)),
+        colIdx(upload(context, A.colIdx)),
+        values(upload(context, A.values)) {
+}
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL sparse products
+//
+//------------------------------------------------------------------------------
+SparseKernels::SparseKernels(const cl::Context &context, int vectorSize, int sliceHeight) :
+        vectorSize(vectorSize),
+        sliceHeight(sliceHeight),
+        program(util::buildProgram(context, "#define SELL_C " + std::to_string(sliceHeight) + "\n"
+                                            + SPMV_CSR_SCALAR + SPMV_CSR_VECTOR + SPMV_ELL + SPMV_SELL
+                                            + SPMM_CSR_SCALAR + SPMM_CSR_VECTOR)),
+        spmvScalarKernel(program, "spmv_csr_scalar"),
+        spmvVectorKernel(program, "spmv_csr_vector"),
+        spmvEllKernel(program, "spmv_ell"),
+        spmvSellKernel(program, "spmv_sell"),
+        spmmScalarKernel(program, "spmm_csr_scalar"),
+        spmmVectorKernel(program, "spmm_csr_vector") {
+    if (vectorSize <= 0 || (vectorSize & (vectorSize - 1)) != 0) {
+        throw std::invalid_argument("The vector-row work-group size must be a power of two");
+    }
+}
+
+cl::Event SparseKernels::spmvScalar(cl::CommandQueue &queue, const DeviceCsr &A,
+                                    const cl::Buffer &x, const cl::Buffer &y) const {
+    auto spmv = cl::KernelFunctor<int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer>(
+            spmvScalarKernel);
+
+    return spmv(
+            cl::EnqueueArgs(
+                    queue,
+                    cl::NDRange(A.rows)),
+            A.rows, A.rowPtr, A.colIdx, A.values, x, y);
+}
+
+cl::Event SparseKernels::spmvVector(cl::CommandQueue &queue, const DeviceCsr &A,
+                                    const cl::Buffer &x, const cl::Buffer &y) const {
+    auto spmv = cl::KernelFunctor<int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::LocalSpaceArg>(
+            spmvVectorKernel);
+
+    return spmv(
+            cl::EnqueueArgs(
+                    queue,
+                    cl::NDRange(static_cast<size_t>(A.rows) * vectorSize),
+                    cl::NDRange(vectorSize)),
+            A.rows, A.rowPtr, A.colIdx, A.values, x, y,
+            cl::Local(sizeof(float) * vectorSize));
+}
+
+cl::Event SparseKernels::spmvEll(cl::CommandQueue &queue, const DeviceEll &A,
+                                 const cl::Buffer &x, const cl::Buffer &y) const {
+    auto spmv = cl::KernelFunctor<int, int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer>(spmvEllKernel);
+
+    return spmv(
+            cl::EnqueueArgs(
+                    queue,
+                    cl::NDRange(A.rows)),
+            A.rows, A.width, A.colIdx, A.values, x, y);
+}
+
+cl::Event SparseKernels::spmvSell(cl::CommandQueue &queue, const DeviceSell &A,
+                                  const cl::Buffer &x, const cl::Buffer &y) const {
+    if (A.C != sliceHeight) {
+        throw std::invalid_argument("The SELL kernel is built for slices of " + std::to_string(sliceHeight) + " rows");
+    }
+    auto spmv = cl::KernelFunctor<int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer>(
+            spmvSellKernel);
+
+    return spmv(
+            cl::EnqueueArgs(
+                    queue,
+                    cl::NDRange((A.rows + sliceHeight - 1) / sliceHeight * sliceHeight)),
+            A.rows, A.sliceStart, A.rowOrder, A.colIdx, A.values, x, y);
+}
+
+cl::Event SparseKernels::spmmScalar(cl::CommandQueue &queue, const DeviceCsr &A, int width,
+                                    const cl::Buffer &X, const cl::Buffer &Y) const {
+    auto spmm = cl::KernelFunctor<int, int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer>(
+            spmmScalarKernel);
+
+    return spmm(
+            cl::EnqueueArgs(
+                    queue,
+                    cl::NDRange(width, A.rows)),
+            A.rows, width, A.rowPtr, A.colIdx, A.values, X, Y);
+}
+
+cl::Event SparseKernels::spmmVector(cl::CommandQueue &queue, const DeviceCsr &A, int width,
+                                    const cl::Buffer &X, const cl::Buffer &Y) const {
+    if (width <= 0 || width > vectorSize || (width & (width - 1)) != 0) {
+        throw std::invalid_argument("The vector-row SpMM needs a power of two width up to "
+                                    + std::to_string(vectorSize));
+    }
+    auto spmm = cl::KernelFunctor<int, int, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
+            cl::LocalSpaceArg>(spmmVectorKernel);
+
+    return spmm(
+            cl::EnqueueArgs(
+                    queue,
+                    cl::NDRange(static_cast<size_t>(A.rows) * vectorSize),
+                    cl::NDRange(vectorSize)),
+            A.rows, width, A.rowPtr, A.colIdx, A.values, X, Y,
+            cl::Local(sizeof(float) * vectorSize));
+}
+
+bool SparseKernels::supportsVector(const cl::Device &device) const {
+    for (const cl::Kernel *kernel: {&spmvVectorKernel, &spmmVectorKernel}) {
+        if (static_cast<size_t>(vectorSize) > kernel->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,183 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Sparse matrix library include file
+//
+//  PURPOSE: Sparse matrices in CSR, ELL and SELL-C-σ form, host builders
+//           and reference products, and the OpenCL SpMV and SpMM kernels
+//           of spmv.hpp.
+//
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include "matrix_lib.hpp"
+
+#include <vector>
+
+//------------------------------------------------------------------------------
+//
+//  Compressed sparse rows: the entries of row i are colIdx and values
+//  at rowPtr[i] .. rowPtr[i+1]-1, with increasing columns.
+//
+//------------------------------------------------------------------------------
+struct CsrMatrix {
+    int rows = 0;
+    int cols = 0;
+    std::vector<int> rowPtr = {};
+    std::vector<int> colIdx = {};
+    std::vector<float> values = {};
+
+    [[nodiscard]] size_t nnz() const { return values.size(); }
+
+    [[nodiscard]] int maxRowLength() const;
+};
+
+//------------------------------------------------------------------------------
+//
+//  ELLPACK: every row padded to width entries, stored column by column,
+//  entry k of row i at k*rows + i. Padding has column 0 and value 0.
+//
+//------------------------------------------------------------------------------
+struct EllMatrix {
+    int rows = 0;
+    int cols = 0;
+    int width = 0;
+    std::vector<int> colIdx = {};
+    std::vector<float> values = {};
+};
+
+//------------------------------------------------------------------------------
+//
+//  SELL-C-σ: the rows are sorted by decreasing length within windows of
+//  sigma rows, rowOrder[i] is the row at sorted position i. Slices of C
+//  sorted rows are stored like ELL, padded to their longest row: entry k
+//  of lane l of slice s is at sliceStart[s] + k*C + l.
+//
+//------------------------------------------------------------------------------
+struct SellMatrix {
+    int rows = 0;
+    int cols = 0;
+    int C = 0;
+    int sigma = 0;
+    std::vector<int> sliceStart = {};
+    std::vector<int> rowOrder = {};
+    std::vector<int> colIdx = {};
+    std::vector<float> values = {};
+};
+
+//------------------------------------------------------------------------------
+//
+//  Functions to build sparse matrices
+//
+//  banded_matrix has the 2*bandwidth+1 diagonals around the main one.
+//  power_law_matrix draws every row length from a Pareto distribution,
+//  P(length >= d) = (minLength / d)^(exponent - 1), and the columns
+//  uniformly, so a few rows are much longer than the others.
+//
+//------------------------------------------------------------------------------
+CsrMatrix banded_matrix(int n, int bandwidth);
+CsrMatrix power_law_matrix(int rows, int cols, double exponent, int minLength, unsigned seed);
+EllMatrix to_ell(const CsrMatrix &A);
+SellMatrix to_sell(const CsrMatrix &A, int C, int sigma);
+
+//------------------------------------------------------------------------------
+//
+//  Functions to compute the sparse products on the host
+//
+//  y = A * x, and Y(rows,width) = A * X(cols,width) with row-major X and Y
+//
+//------------------------------------------------------------------------------
+void csr_spmv(const CsrMatrix &A, const std::vector<float> &x, std::vector<float> &y);
+void csr_spmm(const CsrMatrix &A, int width, const std::vector<float> &X, std::vector<float> &Y);
+
+//------------------------------------------------------------------------------
+//
+//  Bytes a product has to move at least: the matrix in CSR form, x or X
+//  and y or Y once each. Padded formats are rated against the same bytes.
+//
+//------------------------------------------------------------------------------
+double spmv_bytes(const CsrMatrix &A);
+double spmm_bytes(const CsrMatrix &A, int width);
+
+//------------------------------------------------------------------------------
+//
+//  Sparse matrices uploaded to a context
+//
+//------------------------------------------------------------------------------
+struct DeviceCsr {
+    DeviceCsr(const cl::Context &context, const CsrMatrix &A);
+
+    int rows;
+    int cols;
+    cl::Buffer rowPtr;
+    cl::Buffer colIdx;
+    cl::Buffer values;
+};
+
+struct DeviceEll {
+    DeviceEll(const cl::Context &context, const EllMatrix &A);
+
+    int rows;
+    int cols;
+    int width;
+    cl::Buffer colIdx;
+    cl::Buffer values;
+};
+
+struct DeviceSell {
+    DeviceSell(const cl::Context &context, const SellMatrix &A);
+
+    int rows;
+    int cols;
+    int C;
+    cl::Buffer sliceStart;
+    cl::Buffer rowOrder;
+    cl::Buffer colIdx;
+    cl::Buffer values;
+};
+
+//------------------------------------------------------------------------------
+//
+//  OpenCL sparse products
+//
+//  The vector-row kernels use work-groups of vectorSize work-items, a
+//  power of two. The SELL kernel is built for slices of sliceHeight rows
+//  and only takes matrices with that C. All kernels are built and created
+//  once.
+//
+//------------------------------------------------------------------------------
+class SparseKernels {
+public:
+    explicit SparseKernels(const cl::Context &context, int vectorSize = 64, int sliceHeight = 32);
+
+    cl::Event spmvScalar(cl::CommandQueue &queue, const DeviceCsr &A, const cl::Buffer &x, const cl::Buffer &y) const;
+
+    cl::Event spmvVector(cl::CommandQueue &queue, const DeviceCsr &A, const cl::Buffer &x, const cl::Buffer &y) const;
+
+    cl::Event spmvEll(cl::CommandQueue &queue, const DeviceEll &A, const cl::Buffer &x, const cl::Buffer &y) const;
+
+    cl::Event spmvSell(cl::CommandQueue &queue, const DeviceSell &A, const cl::Buffer &x, const cl::Buffer &y) const;
+
+    cl::Event spmmScalar(cl::CommandQueue &queue, const DeviceCsr &A, int width,
+                         const cl::Buffer &X, const cl::Buffer &Y) const;
+
+    // width must be a power of two, at most vectorSize.
+    cl::Event spmmVector(cl::CommandQueue &queue, const DeviceCsr &A, int width,
+                         const cl::Buffer &X, const cl::Buffer &Y) const;
+
+    // Whether work-groups of vectorSize fit the vector-row kernels on the device.
+    bool supportsVector(const cl::Device &device) const;
+
+    [[nodiscard]] int getSliceHeight() const { return sliceHeight; }
+
+private:
+    const int vectorSize;
+    const int sliceHeight;
+    cl::Program program;
+    cl::Kernel spmvScalarKernel;
+    cl::Kernel spmvVectorKernel;
+    cl::Kernel spmvEllKernel;
+    cl::Kernel spmvSellKernel;
+    cl::Kernel spmmScalarKernel;
+    cl::Kernel spmmVectorKernel;
+};
@@ -0,0 +1,181 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Sparse matrix kernels
+//
+//  PURPOSE: Products of a sparse matrix A(rows,cols) with a dense vector
+//
+//              y = A * x
+//
+//           and with a dense row-major matrix of width columns
+//
+//              Y(rows,width) = A * X(cols,width)
+//
+//           The scalar-row kernels give a row to a work-item. That's
+//           enough for short rows, but the accesses of neighbouring
+//           work-items are far apart and one long row holds back its
+//           whole wavefront. The vector-row kernels give a row to a
+//           work-group, which reads it contiguously and reduces the
+//           partial sums in local memory.
+//
+//           CSR stores the rows one after the other (rowPtr, colIdx,
+//           values). ELL pads every row to the longest one and stores
+//           the entries column by column, so the reads of a scalar-row
+//           kernel are coalesced, at the price of the padding. SELL-C-σ
+//           does the same within slices of C rows, after sorting the
+//           rows by length within windows of σ rows: the padding is
+//           limited to the slice (see sparse_lib.hpp).
+//
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <string>
+
+const std::string SPMV_CSR_SCALAR = R"(
+__kernel void spmv_csr_scalar(
+                const int rows,
+                __global const int*   restrict rowPtr,
+                __global const int*   restrict colIdx,
+                __global const float* restrict values,
+                __global const float* restrict x,
+                __global       float* restrict y)
+{
+    const int row = get_global_id(0);
+    if (row < rows) {
+        float sum = 0.0f;
+        for (int k = rowPtr[row]; k < rowPtr[row+1]; k++)
+            sum += values[k] * x[colIdx[k]];
+        y[row] = sum;
+    }
+})";
+
+// The local size must be a power of two.
+const std::string SPMV_CSR_VECTOR = R"(
+__kernel void spmv_csr_vector(
+                const int rows,
+                __global const int*   restrict rowPtr,
+                __global const int*   restrict colIdx,
+                __global const float* restrict values,
+                __global const float* restrict x,
+                __global       float* restrict y,
+                __local        float* restrict partial)
+{
+    const int row = get_group_id(0);
+    const int lid = get_local_id(0);
+    const int size = get_local_size(0);
+
+    float sum = 0.0f;
+    for (int k = rowPtr[row] + lid; k < rowPtr[row+1]; k += size)
+        sum += values[k] * x[colIdx[k]];
+    partial[lid] = sum;
+
+    for (int stride = size/2; stride > 0; stride /= 2) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < stride)
+            partial[lid] += partial[lid+stride];
+    }
+    if (lid == 0)
+        y[row] = partial[0];
+})";
+
+// Entry k of a row is at k*rows + row, padding has a zero value.
+const std::string SPMV_ELL = R"(
+__kernel void spmv_ell(
+                const int rows,
+                const int width,
+                __global const int*   restrict colIdx,
+                __global const float* restrict values,
+                __global const float* restrict x,
+                __global       float* restrict y)
+{
+    const int row = get_global_id(0);
+    if (row < rows) {
+        float sum = 0.0f;
+        for (int k = 0; k < width; k++)
+            sum += values[k*rows+row] * x[colIdx[k*rows+row]];
+        y[row] = sum;
+    }
+})";
+
+// Work-item i handles the i-th row in sorted order, which is lane i%SELL_C of
+// slice i/SELL_C. Entry k of the lane is at sliceStart[slice] + k*SELL_C + lane.
+const std::string SPMV_SELL = R"(
+__kernel void spmv_sell(
+                const int rows,
+                __global const int*   restrict sliceStart,
+                __global const int*   restrict rowOrder,
+                __global const int*   restrict colIdx,
+                __global const float* restrict values,
+                __global const float* restrict x,
+                __global       float* restrict y)
+{
+    const int position = get_global_id(0);
+    const int slice = position / SELL_C;
+    const int lane = position % SELL_C;
+
+    if (position < rows) {
+        const int start = sliceStart[slice];
+        const int width = (sliceStart[slice+1] - start) / SELL_C;
+        float sum = 0.0f;
+        for (int k = 0; k < width; k++)
+            sum += values[start + k*SELL_C + lane] * x[colIdx[start + k*SELL_C + lane]];
+        y[rowOrder[position]] = sum;
+    }
+})";
+
+// Work-item (j, row) computes Y(row, j), neighbours read neighbouring columns of X.
+const std::string SPMM_CSR_SCALAR = R"(
+__kernel void spmm_csr_scalar(
+                const int rows,
+                const int width,
+                __global const int*   restrict rowPtr,
+                __global const int*   restrict colIdx,
+                __global const float* restrict values,
+                __global const float* restrict X,
+                __global       float* restrict Y)
+{
+    const int j = get_global_id(0);
+    const int row = get_global_id(1);
+
+    if (row < rows && j < width) {
+        float sum = 0.0f;
+        for (int k = rowPtr[row]; k < rowPtr[row+1]; k++)
+            sum += values[k] * X[colIdx[k]*width + j];
+        Y[row*width + j] = sum;
+    }
+})";
+
+// The work-group of a row is split in local_size/width teams of width work-items.
+// Team t takes the entries t, t + teams, ... of the row, its work-item j the column
+// j of X, then the teams are summed in local memory. width must divide the local
+// size and both must be powers of two.
+const std::string SPMM_CSR_VECTOR = R"(
+__kernel void spmm_csr_vector(
+                const int rows,
+                const int width,
+                __global const int*   restrict rowPtr,
+                __global const int*   restrict colIdx,
+                __global const float* restrict values,
+                __global const float* restrict X,
+                __global       float* restrict Y,
+                __local        float* restrict partial)
+{
+    const int row = get_group_id(0);
+    const int lid = get_local_id(0);
+    const int teams = get_local_size(0) / width;
+    const int team = lid / width;
+    const int j = lid % width;
+
+    float sum = 0.0f;
+    for (int k = rowPtr[row] + team; k < rowPtr[row+1]; k += teams)
+        sum += values[k] * X[colIdx[k]*width + j];
+    partial[lid] = sum;
+
+    for (int stride = teams/2; stride > 0; stride /= 2) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (team < stride)
+            partial[lid] += partial[lid + stride*width];
+    }
+    if (team == 0)
+        Y[row*width + j] = partial[j];
+})";
@@ -0,0 +1,45 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Strassen-Winograd matrix multiplication
+//
+//  PURPOSE: Splits A, B and C into quadrants and replaces the 8 products of
+//           the blocked algorithm by 7 products and 15 additions:
+//
+//             S1 = A21 + A22     T1 = B12 - B11     P1 = A11 * B11
+//             S2 = S1  - A11     T2 = B22 - T1      P2 = A12 * B21
+//             S3 = A11 - A21     T3 = B22 - B12     P3 = S4  * B22
+//             S4 = A12 - S2      T4 = T2  - B21     P4 = A22 * T4
+//                                                   P5 = S1  * T1
+//                                                   P6 = S2  * T2
+//                                                   P7 = S3  * T3
+//
+//             U2 = P1 + P6       U3 = U2 + P7       U4 = U2 + P5
+//
+//             C11 = P1 + P2      C12 = U4 + P3
+//             C21 = U3 - P4      C22 = U3 + P5
+//
+//           The products recurse while the order is even and above the
+//           cutoff, then the base kernel takes over. Each level saves 1/8
+//           of the multiplications but the additions cost bandwidth and
+//           the error bound grows with the depth, so the cutoff is tuned
+//           against both speed and accuracy.
+//
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <string>
+
+// Z = X + sign * Y for contiguous arrays of count elements, Z may be X or Y.
+const std::string MATRIX_ADD = R"(
+__kernel void add(
+                const int count,
+                __global const float* X,
+                const float sign,
+                __global const float* Y,
+                __global       float* Z)
+{
+    const int i = get_global_id(0);
+    if (i < count)
+        Z[i] = X[i] + sign*Y[i];
+})";
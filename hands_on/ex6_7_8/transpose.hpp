@@ -0,0 +1,49 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Tiled matrix transpose
+//
+//  PURPOSE: Computes Bt(cols,rows) = transpose of B(rows,cols)
+//
+//           A naive transpose reads rows and writes columns, so one of the
+//           two accesses strides through memory. Here a work-group copies
+//           a TILE x TILE tile of B into local memory along its rows, and
+//           writes the transposed tile along the rows of Bt. The tile has
+//           one extra column: reading it by column then touches TILE
+//           different local memory banks instead of one.
+//
+//           The orders don't have to be multiples of TILE, the NDRange is
+//           rounded up to whole tiles and the accesses are guarded.
+//
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include <string>
+
+const std::string TILED_TRANSPOSE = R"(
+__kernel void transpose(
+                const int rows,
+                const int cols,
+                __global const float* restrict B,
+                __global       float* restrict Bt)
+{
+    __local float tile[TILE][TILE+1];
+
+    // This work-item reads B(y,x)
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    const int xloc = get_local_id(0);
+    const int yloc = get_local_id(1);
+
+    if (y < rows && x < cols)
+        tile[yloc][xloc] = B[y*cols+x];
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // and writes Bt(ty,tx) = B(tx,ty), which the tile holds at [xloc][yloc]
+    const int tx = get_group_id(1)*TILE + xloc;
+    const int ty = get_group_id(0)*TILE + yloc;
+
+    if (ty < cols && tx < rows)
+        Bt[ty*rows+tx] = tile[xloc][yloc];
+})";
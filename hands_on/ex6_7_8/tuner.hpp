@@ -0,0 +1,212 @@
+//------------------------------------------------------------------------------
+//
+//  PROGRAM: Auto-tuner for the matrix multiplication kernels
+//
+//  PURPOSE: Sweeps launch configurations of a kernel family on a device,
+//           keeps the fastest one and remembers it in a tuning database.
+//
+//           A candidate is a complete kernel source (with the #define
+//           prefix) plus its NDRange. All kernels take A, B and C followed
+//           by optional local memory arguments. Candidates which exceed
+//           CL_KERNEL_WORK_GROUP_SIZE, CL_DEVICE_MAX_WORK_ITEM_SIZES or
+//           CL_DEVICE_LOCAL_MEM_SIZE, or fail to build or launch, are skipped.
+//           Kernels are timed by their profiling events, so launch overhead
+//           and host timer resolution don't decide between close candidates.
+//           C is filled with 1e30 before a candidate runs, and the product of
+//           every candidate about to become the fastest is passed to the
+//           check of the tuner, a miscompiled or out of bounds configuration
+//           is rejected instead of being stored.
+//
+//           The database is a text file with one tab separated line per
+//           (device, kernel family, order):
+//
+//             family N local0 local1 tile wptm wptn unroll seconds device
+//
+//           The device is keyed by the getDeviceName() string. The file is
+//           MMUL_TUNING_DB if the environment variable is set, otherwise
+//           mmul_tuning.db in the working directory.
+//
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include "../common/cpp/cl.hpp"
+#include "../common/cpp/program_cache.hpp"
+#include "../common/cpp/profiling.hpp"
+#include "gemm_registry.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+struct KernelConfig {
+    size_t local0 = 1;   // work-group shape
+    size_t local1 = 1;
+    size_t tile = 0;     // block or tile size, 0 if the family has none
+    size_t wptm = 1;     // rows of C per work-item
+    size_t wptn = 1;     // columns of C per work-item
+    size_t unroll = 1;   // unroll factor of the inner loop
+
+    [[nodiscard]] std::string describe() const {
+        std::string text = "local " + std::to_string(local0) + "x" + std::to_string(local1);
+        if (tile != 0) text += ", tile " + std::to_string(tile);
+        if (wptm * wptn != 1) text += ", " + std::to_string(wptm) + "x" + std::to_string(wptn) + " per work item";
+        if (unroll != 1) text += ", unroll " + std::to_string(unroll);
+        return text;
+    }
+};
+
+struct TuningResult {
+    KernelConfig config;
+    double seconds;
+};
+
+struct TuningCandidate {
+    KernelConfig config;
+    std::string source;
+    cl::NDRange global;
+    cl::NDRange local;
+    std::vector<size_t> localArgs;   // sizes in bytes of the __local arguments after A, B and C
+};
+
+class TuningDatabase {
+public:
+    explicit TuningDatabase(std::string path = defaultPath()) : path(std::move(path)) {
+        std::ifstream stream(this->path);
+        std::string line;
+        while (std::getline(stream, line)) {
+            std::istringstream fields(line);
+            std::string family, device;
+            size_t n;
+            TuningResult result{};
+            auto &c = result.config;
+            if (std::getline(fields, family, '\t') &&
+                fields >> n >> c.local0 >> c.local1 >> c.tile >> c.wptm >> c.wptn >> c.unroll >> result.seconds) {
+                fields.ignore(1, '\t');
+                if (std::getline(fields, device)) {
+                    entries[{device, family, n}] = result;
+                }
+            }
+        }
+    }
+
+    [[nodiscard]] std::optional<TuningResult> find(const std::string &device, const std::string &family, size_t n) const {
+        auto it = entries.find({device, family, n});
+        if (it == entries.end()) return std::nullopt;
+        return it->second;
+    }
+
+    void store(const std::string &device, const std::string &family, size_t n, const TuningResult &result) {
+        entries[{device, family, n}] = result;
+    }
+
+    void save() const {
+        std::ofstream stream(path, std::ios::trunc);
+        for (const auto &[key, result]: entries) {
+            const auto &[device, family, n] = key;
+            const auto &c = result.config;
+            stream << family << '\t' << n << '\t'
+                   << c.local0 << '\t' << c.local1 << '\t' << c.tile << '\t'
+                   << c.wptm << '\t' << c.wptn << '\t' << c.unroll << '\t'
+                   << result.seconds << '\t' << device << '\n';
+        }
+    }
+
+    static std::string defaultPath() {
+        const char *env = std::getenv("MMUL_TUNING_DB");
+        return env != nullptr ? env : "mmul_tuning.db";
+    }
+
+private:
+    std::string path;
+    std::map<std::tuple<std::string, std::string, size_t>, TuningResult> entries;
+};
+
+class Tuner {
+public:
+    // Whether C, computed on queue by the last candidate, holds the product of A and B.
+    using Check = std::function<bool(cl::CommandQueue &queue, const cl::Buffer &C)>;
+
+    Tuner(const cl::Context &context, const cl::Device &device, const cl::Buffer &A, const cl::Buffer &B,
+          const cl::Buffer &C, Check check = {}) :
+            context(context), device(device), queue(context, device, CL_QUEUE_PROFILING_ENABLE), A(A), B(B), C(C),
+            check(std::move(check)) {}
+
+    // Runs every candidate that fits the device and returns the fastest one with a correct product.
+    std::optional<TuningResult> sweep(const std::string &family, const std::vector<TuningCandidate> &candidates) {
+        std::optional<TuningResult> best;
+        for (const auto &candidate: candidates) {
+            auto seconds = measure(candidate);
+            if (!seconds) continue;
+            printf("Tuning '%s', %s,\t%.4f seconds\n", family.c_str(), candidate.config.describe().c_str(), *seconds);
+            if (!best || *seconds < best->seconds) {
+                if (check && !check(queue, C)) {
+                    printf("Tuning '%s', %s, wrong product, rejected\n", family.c_str(),
+                           candidate.config.describe().c_str());
+                    continue;
+                }
+                best = TuningResult{candidate.config, *seconds};
+            }
+        }
+        return best;
+    }
+
+    // Best of a few runs after a warm-up launch, nothing if the candidate can't run on the device.
+    std::optional<double> measure(const TuningCandidate &candidate) {
+        if (launchMisfit(device, nullptr, candidate.local, candidate.localArgs)) return std::nullopt;
+
+        try {
+            auto program = util::buildProgram(context, candidate.source);
+            cl::Kernel kernel(program, "mmul");
+            if (launchMisfit(device, &kernel, candidate.local, candidate.localArgs)) return std::nullopt;
+
+            kernel.setArg(0, A);
+            kernel.setArg(1, B);
+            kernel.setArg(2, C);
+            for (size_t i = 0; i < candidate.localArgs.size(); i++) {
+                kernel.setArg(static_cast<cl_uint>(3 + i), cl::Local(candidate.localArgs[i]));
+            }
+
+            // Elements the candidate doesn't write fail the check. The sentinel is finite, NaN could
+            // slip through comparisons compiled with -ffast-math.
+            queue.enqueueFillBuffer(C, UNWRITTEN, 0, C.getInfo<CL_MEM_SIZE>());
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange, candidate.global, candidate.local);
+            queue.finish();
+
+            double best = 0.0;
+            for (int i = 0; i < RUNS; i++) {
+                cl::Event event;
+                queue.enqueueNDRangeKernel(kernel, cl::NullRange, candidate.global, candidate.local,
+                                           nullptr, &event);
+                event.wait();
+                double run_time = util::eventTimes(event).seconds();
+                if (i == 0 || run_time < best) best = run_time;
+            }
+            return best;
+        } catch (cl::Error &err) {
+            // Build failures and CL_OUT_OF_RESOURCES only rule out this candidate.
+            return std::nullopt;
+        }
+    }
+
+private:
+    static constexpr int RUNS = 3;
+    // What C holds before a candidate runs, far from any product of the tuning inputs.
+    static constexpr float UNWRITTEN = 1e30f;
+
+    cl::Context context;
+    cl::Device device;
+    cl::CommandQueue queue;
+    cl::Buffer A;
+    cl::Buffer B;
+    cl::Buffer C;
+    Check check;
+};
@@ -15,6 +15,7 @@ is great since it gives us an easy way to check the answer.
 
 #include "../common/cpp/util.hpp"
 #include "../common/cpp/device_picker.hpp"
+#include "../common/cpp/program_cache.hpp"
 
 #include <cstdio>
 
@@ -171,18 +172,7 @@ void find_pi_cl(const std::string &kernelCode, const std::string &name_info) {
         const cl::Context context(device);
         cl::CommandQueue queue(context, device);
 
-        cl::Program program(context, kernelCode);
-        try {
-            program.build();
-        }
-        catch (cl::Error &err) {
-            cl_int buildErr = CL_SUCCESS;
-            auto buildInfo = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(&buildErr);
-            for (auto &pair: buildInfo) {
-                std::cerr << pair.second << std::endl << std::endl;
-            }
-            throw err;
-        }
+        auto program = util::buildProgram(context, kernelCode);
         auto pi_kernel = cl::KernelFunctor<unsigned long, float, cl::LocalSpaceArg, cl::Buffer>(
                 program, "pi");
 
@@ -229,18 +219,7 @@ struct MulContext {
 void find_pi_cl_multiple_devices() {
     const auto devices = getDeviceList();
     const cl::Context context(devices);
-    cl::Program program(context, SIMPLE_PI_MULTI_DEVICE);
-    try {
-        program.build();
-    }
-    catch (cl::Error &err) {
-        cl_int buildErr = CL_SUCCESS;
-        auto buildInfo = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(&buildErr);
-        for (auto &pair: buildInfo) {
-            std::cerr << pair.second << std::endl << std::endl;
-        }
-        throw err;
-    }
+    auto program = util::buildProgram(context, SIMPLE_PI_MULTI_DEVICE);
     auto pi_kernel = cl::KernelFunctor<unsigned long, unsigned long, float, cl::LocalSpaceArg, cl::Buffer>(program,
                                                                                                            "pi");
 